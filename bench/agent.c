@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+/*
+ * agent.c provides minimal stand-ins for the Zabbix agent symbols that
+ * libzbxsystemd.so resolves at load time, so the module can be driven outside
+ * of zabbix_agentd.
+ */
+#include <sysinc.h>
+#include <module.h>
+#include <common.h>
+#include <log.h>
+#include <zbxjson.h>
+#include <cfg.h>
+
+int bench_log_level = LOG_LEVEL_WARNING;
+
+/* number of times a json buffer was grown */
+zbx_uint64_t bench_json_grows = 0;
+
+void __zbx_zabbix_log(int level, const char *fmt, ...)
+{
+	va_list	args;
+
+	if (level > bench_log_level)
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+void *zbx_malloc2(const char *filename, int line, void *old, size_t size)
+{
+	void	*ptr;
+
+	if (NULL == (ptr = malloc(size))) {
+		fprintf(stderr, "%s:%d: out of memory\n", filename, line);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+void *zbx_realloc2(const char *filename, int line, void *old, size_t size)
+{
+	void	*ptr;
+
+	if (NULL == (ptr = realloc(old, size))) {
+		fprintf(stderr, "%s:%d: out of memory\n", filename, line);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+char *zbx_strdup2(const char *filename, int line, char *old, const char *str)
+{
+	free(old);
+	return strcpy(zbx_malloc2(filename, line, NULL, strlen(str) + 1), str);
+}
+
+size_t zbx_strlcpy(char *dst, const char *src, size_t siz)
+{
+	size_t	len = strlen(src);
+
+	if (0 != siz) {
+		if (len >= siz)
+			len = siz - 1;
+		memcpy(dst, src, len);
+		dst[len] = '\0';
+	}
+
+	return len;
+}
+
+size_t zbx_strlcat(char *dst, const char *src, size_t siz)
+{
+	size_t	len = strnlen(dst, siz);
+
+	return len + zbx_strlcpy(dst + len, src, siz - len);
+}
+
+size_t zbx_snprintf(char *str, size_t count, const char *fmt, ...)
+{
+	va_list	args;
+	int	n;
+
+	va_start(args, fmt);
+	n = vsnprintf(str, count, fmt, args);
+	va_end(args);
+
+	if (0 > n)
+		return 0;
+
+	return (size_t)n >= count ? count - 1 : (size_t)n;
+}
+
+char *zbx_dsprintf(char *dest, const char *f, ...)
+{
+	va_list	args;
+	char	*s = NULL;
+
+	va_start(args, f);
+	if (0 > vasprintf(&s, f, args))
+		s = NULL;
+	va_end(args);
+	free(dest);
+
+	return s;
+}
+
+const char *zbx_strerror(int errnum)
+{
+	return strerror(errnum);
+}
+
+char *string_replace(const char *str, const char *sub_str1, const char *sub_str2)
+{
+	size_t		len1 = strlen(sub_str1), len2 = strlen(sub_str2), n = 0;
+	const char	*p, *q;
+	char		*out, *o;
+
+	for (p = str; 0 != len1 && NULL != (q = strstr(p, sub_str1)); p = q + len1)
+		n++;
+
+	o = out = zbx_malloc(NULL, strlen(str) + n * len2 + 1);
+	for (p = str; 0 != len1 && NULL != (q = strstr(p, sub_str1)); p = q + len1) {
+		memcpy(o, p, q - p);
+		o += q - p;
+		memcpy(o, sub_str2, len2);
+		o += len2;
+	}
+	strcpy(o, p);
+
+	return out;
+}
+
+double zbx_time(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int parse_cfg_file(const char *cfg_file, struct cfg_line *cfg, int optional, int strict)
+{
+	FILE		*f;
+	char		line[MAX_STRING_LEN], *value, *c;
+	struct cfg_line	*p;
+
+	if (NULL == cfg_file || NULL == (f = fopen(cfg_file, "r")))
+		return ZBX_CFG_FILE_OPTIONAL == optional ? SUCCEED : FAIL;
+
+	while (NULL != fgets(line, sizeof(line), f)) {
+		if ('#' == line[0] || NULL == (value = strchr(line, '=')))
+			continue;
+
+		*value++ = '\0';
+		if (NULL != (c = strpbrk(value, "\r\n")))
+			*c = '\0';
+
+		for (p = cfg; NULL != p->parameter; p++) {
+			if (0 != strcmp(p->parameter, line))
+				continue;
+
+			switch (p->type) {
+			case TYPE_INT:
+				*((int *)p->variable) = atoi(value);
+				break;
+			case TYPE_UINT64:
+				*((zbx_uint64_t *)p->variable) = strtoull(value, NULL, 10);
+				break;
+			case TYPE_STRING:
+				*((char **)p->variable) = strdup(value);
+				break;
+			}
+			break;
+		}
+
+		if (NULL == p->parameter && ZBX_CFG_STRICT == strict) {
+			fprintf(stderr, "unknown parameter \"%s\" in %s\n", line, cfg_file);
+			fclose(f);
+			return FAIL;
+		}
+	}
+
+	fclose(f);
+	return SUCCEED;
+}
+
+/*
+ * The json writer mimics libzbxjson: closing brackets are written up front and
+ * new values are inserted at buffer_offset.
+ */
+static void json_insert(struct zbx_json *j, const char *s, size_t len)
+{
+	if (j->buffer_size + len + 1 > j->buffer_allocated) {
+		j->buffer_allocated = (j->buffer_size + len + 1) * 2;
+		bench_json_grows++;
+		if (j->buffer == j->buf_stat) {
+			j->buffer = zbx_malloc(NULL, j->buffer_allocated);
+			memcpy(j->buffer, j->buf_stat, j->buffer_size + 1);
+		}
+		else
+			j->buffer = zbx_realloc(j->buffer, j->buffer_allocated);
+	}
+
+	memmove(j->buffer + j->buffer_offset + len, j->buffer + j->buffer_offset,
+			j->buffer_size - j->buffer_offset + 1);
+	memcpy(j->buffer + j->buffer_offset, s, len);
+	j->buffer_offset += len;
+	j->buffer_size += len;
+}
+
+static void json_insert_string(struct zbx_json *j, const char *s)
+{
+	char		buf[8];
+	const char	*c;
+
+	json_insert(j, "\"", 1);
+	for (c = s; '\0' != *c; c++) {
+		switch (*c) {
+		case '"':
+		case '\\':
+			buf[0] = '\\';
+			buf[1] = *c;
+			json_insert(j, buf, 2);
+			break;
+		case '\n':
+			json_insert(j, "\\n", 2);
+			break;
+		case '\t':
+			json_insert(j, "\\t", 2);
+			break;
+		default:
+			if (0x20 > (unsigned char)*c) {
+				snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*c);
+				json_insert(j, buf, 6);
+			}
+			else
+				json_insert(j, c, 1);
+		}
+	}
+	json_insert(j, "\"", 1);
+}
+
+static void json_insert_name(struct zbx_json *j, const char *name)
+{
+	if (ZBX_JSON_COMMA == j->status)
+		json_insert(j, ",", 1);
+
+	if (NULL != name) {
+		json_insert_string(j, name);
+		json_insert(j, ":", 1);
+	}
+}
+
+static void json_init(struct zbx_json *j, const char *s)
+{
+	j->buffer = j->buf_stat;
+	j->buffer_allocated = sizeof(j->buf_stat);
+	strcpy(j->buffer, s);
+	j->buffer_size = 2;
+	j->buffer_offset = 1;
+	j->status = ZBX_JSON_EMPTY;
+	j->level = 0;
+}
+
+void zbx_json_init(struct zbx_json *j, size_t allocate)
+{
+	json_init(j, "{}");
+}
+
+void zbx_json_initarray(struct zbx_json *j, size_t allocate)
+{
+	json_init(j, "[]");
+}
+
+void zbx_json_clean(struct zbx_json *j)
+{
+	j->buffer_offset = 1;
+	j->buffer_size = 2;
+	j->buffer[1] = j->buffer[0] == '{' ? '}' : ']';
+	j->buffer[2] = '\0';
+	j->status = ZBX_JSON_EMPTY;
+	j->level = 0;
+}
+
+void zbx_json_free(struct zbx_json *j)
+{
+	if (j->buffer != j->buf_stat)
+		free(j->buffer);
+	j->buffer = NULL;
+}
+
+static void json_addcontainer(struct zbx_json *j, const char *name, const char *brackets)
+{
+	json_insert_name(j, name);
+	json_insert(j, brackets, 2);
+	j->buffer_offset--;
+	j->status = ZBX_JSON_EMPTY;
+	j->level++;
+}
+
+void zbx_json_addobject(struct zbx_json *j, const char *name)
+{
+	json_addcontainer(j, name, "{}");
+}
+
+void zbx_json_addarray(struct zbx_json *j, const char *name)
+{
+	json_addcontainer(j, name, "[]");
+}
+
+void zbx_json_addstring(struct zbx_json *j, const char *name, const char *string, zbx_json_type_t type)
+{
+	json_insert_name(j, name);
+
+	if (NULL == string)
+		json_insert(j, "null", 4);
+	else if (ZBX_JSON_TYPE_STRING == type)
+		json_insert_string(j, string);
+	else
+		json_insert(j, string, strlen(string));
+
+	j->status = ZBX_JSON_COMMA;
+}
+
+void zbx_json_adduint64(struct zbx_json *j, const char *name, zbx_uint64_t value)
+{
+	char	buf[32];
+
+	snprintf(buf, sizeof(buf), ZBX_FS_UI64, value);
+	zbx_json_addstring(j, name, buf, ZBX_JSON_TYPE_INT);
+}
+
+void zbx_json_addint64(struct zbx_json *j, const char *name, int64_t value)
+{
+	char	buf[32];
+
+	snprintf(buf, sizeof(buf), "%ld", (long)value);
+	zbx_json_addstring(j, name, buf, ZBX_JSON_TYPE_INT);
+}
+
+int zbx_json_close(struct zbx_json *j)
+{
+	if (0 == j->level)
+		return FAIL;
+
+	j->level--;
+	j->buffer_offset++;
+	j->status = ZBX_JSON_COMMA;
+
+	return SUCCEED;
+}
@@ -0,0 +1,515 @@
+/*
+ * bench loads libzbxsystemd.so the way zabbix_agentd does and replays a
+ * zabbix_agent_bench key file against it, reporting the latency, throughput
+ * and resident memory growth of every key.
+ *
+ * Keys are read one per line. Lines starting with whitespace are item
+ * prototypes of the preceding discovery key: they are expanded with the LLD
+ * macros of every discovered object and called after the discovery key.
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * The module connects to the system bus named in DBUS_SYSTEM_BUS_ADDRESS, so
+ * the harness is usually run by bench.sh on a private bus hosting
+ * mock-systemd. With -p, it connects directly to the given socket instead, as
+ * with the SystemdPrivateSocket setting.
+ */
+#define _GNU_SOURCE
+#include <sysinc.h>
+#include <module.h>
+#include <common.h>
+#include <log.h>
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <ctype.h>
+
+#define BENCH_KEYS_MAX    256
+#define BENCH_PARAMS_MAX  64
+#define BENCH_MACROS_MAX  16
+
+// a key of the key file and the samples collected for it
+typedef struct {
+  char          *key;
+  int           parent;     // index of the discovery key or -1
+  zbx_uint64_t  *samples;   // latency of each call in nanoseconds
+  size_t        nsamples;
+  size_t        nallocated;
+  zbx_uint64_t  errors;
+  zbx_uint64_t  bytes;      // total size of all results
+  zbx_uint64_t  grows;      // total json buffer reallocations
+  long          rss_kb;     // resident memory growth over all calls
+} bench_key;
+
+// an LLD macro of a discovered object
+typedef struct {
+  char  *name;
+  char  *value;
+} bench_macro;
+
+extern int          bench_log_level;
+extern zbx_uint64_t bench_json_grows;
+
+static bench_key  keys[BENCH_KEYS_MAX];
+static int        nkeys = 0;
+
+static ZBX_METRIC *metrics = NULL;
+
+// command line options
+static int        iterations = 10;
+static int        item_timeout = 3;
+static int        max_objects = 50;
+static int        verbose = 0;
+static char       *private_socket = NULL;
+
+static zbx_uint64_t bench_clock_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zbx_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * bench_rss_kb returns the resident set size of the process in KiB.
+ */
+static long bench_rss_kb()
+{
+  FILE  *f;
+  long  size = 0, resident = 0;
+
+  if (NULL == (f = fopen("/proc/self/statm", "r")))
+    return 0;
+
+  if (2 != fscanf(f, "%ld %ld", &size, &resident))
+    resident = 0;
+
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * bench_load_keys appends the keys of the given key file to the key list.
+ */
+static int bench_load_keys(const char *path)
+{
+  FILE  *f;
+  char  line[MAX_STRING_LEN], *c, *e;
+  int   parent = -1;
+
+  if (NULL == (f = fopen(path, "r"))) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return FAIL;
+  }
+
+  while (NULL != fgets(line, sizeof(line), f)) {
+    for (c = line; ' ' == *c || '\t' == *c; c++);
+    for (e = c + strlen(c); e > c && isspace((unsigned char) e[-1]); e--);
+    *e = '\0';
+
+    if ('\0' == *c || '#' == *c)
+      continue;
+
+    if (BENCH_KEYS_MAX == nkeys) {
+      fprintf(stderr, "too many keys in %s\n", path);
+      break;
+    }
+
+    if (c == line)
+      parent = -1;
+
+    memset(&keys[nkeys], 0, sizeof(bench_key));
+    keys[nkeys].key = strdup(c);
+    keys[nkeys].parent = parent;
+
+    if (c == line)
+      parent = nkeys;
+
+    nkeys++;
+  }
+
+  fclose(f);
+  return SUCCEED;
+}
+
+/*
+ * bench_parse_key splits the given item key in place into its name and
+ * parameters, unquoting quoted parameters.
+ */
+static void bench_parse_key(char *key, AGENT_REQUEST *request, char **params)
+{
+  char  *c, *o;
+
+  request->key = key;
+  request->nparam = 0;
+  request->params = params;
+
+  if (NULL == (c = strchr(key, '[')))
+    return;
+
+  *c++ = '\0';
+  while (request->nparam < BENCH_PARAMS_MAX) {
+    while (' ' == *c)
+      c++;
+
+    params[request->nparam++] = o = c;
+    if ('"' == *c) {
+      for (c++; '\0' != *c && '"' != *c; c++) {
+        if ('\\' == *c && '"' == c[1])
+          c++;
+        *o++ = *c;
+      }
+      if ('"' == *c)
+        c++;
+      while ('\0' != *c && ',' != *c && ']' != *c)
+        c++;
+    } else {
+      while ('\0' != *c && ',' != *c && ']' != *c)
+        c++;
+      o = c;
+    }
+
+    if (',' != *c) {
+      *o = '\0';
+      break;
+    }
+
+    *c++ = '\0';
+    *o = '\0';
+  }
+}
+
+/*
+ * bench_call calls the handler of the given item key and records the sample
+ * with the given key index. The result string is returned in result, which
+ * the caller must free, if the call succeeded.
+ */
+static int bench_call(int index, const char *key, char **result)
+{
+  bench_key     *k = &keys[index];
+  AGENT_REQUEST request;
+  AGENT_RESULT  res;
+  ZBX_METRIC    *m;
+  char          buf[MAX_STRING_LEN], *params[BENCH_PARAMS_MAX], *value = NULL;
+  zbx_uint64_t  start, grows;
+  long          rss;
+  int           ret;
+
+  zbx_strlcpy(buf, key, sizeof(buf));
+  bench_parse_key(buf, &request, params);
+
+  for (m = metrics; NULL != m->key; m++)
+    if (0 == strcmp(m->key, request.key))
+      break;
+
+  if (NULL == m->key) {
+    k->errors++;
+    if (verbose)
+      fprintf(stderr, "%s: unsupported item key\n", key);
+    return FAIL;
+  }
+
+  memset(&res, 0, sizeof(res));
+  rss = bench_rss_kb();
+  grows = bench_json_grows;
+  start = bench_clock_ns();
+  ret = m->function(&request, &res);
+
+  if (k->nsamples == k->nallocated) {
+    k->nallocated = k->nallocated ? k->nallocated * 2 : 64;
+    k->samples = zbx_realloc(k->samples, sizeof(zbx_uint64_t) * k->nallocated);
+  }
+  k->samples[k->nsamples++] = bench_clock_ns() - start;
+  k->rss_kb += bench_rss_kb() - rss;
+  k->grows += bench_json_grows - grows;
+
+  if (SYSINFO_RET_OK != ret) {
+    k->errors++;
+    if (verbose)
+      fprintf(stderr, "%s: %s\n", key, res.msg ? res.msg : "failed");
+  } else if (res.type & AR_STRING) {
+    value = res.str;
+    res.str = NULL;
+  } else if (res.type & AR_TEXT) {
+    value = res.text;
+    res.text = NULL;
+  } else if (res.type & AR_UINT64) {
+    value = zbx_dsprintf(NULL, ZBX_FS_UI64, res.ui64);
+  } else if (res.type & AR_DOUBLE) {
+    value = zbx_dsprintf(NULL, ZBX_FS_DBL, res.dbl);
+  }
+
+  if (value) {
+    k->bytes += strlen(value);
+    if (verbose > 1)
+      fprintf(stderr, "%s: %s\n", key, value);
+  }
+
+  free(res.str);
+  free(res.text);
+  free(res.msg);
+
+  *result = value;
+  return SYSINFO_RET_OK == ret ? SUCCEED : FAIL;
+}
+
+/*
+ * bench_json_string parses the JSON string at the given position in place and
+ * returns a pointer past its closing quote, or NULL if it is malformed.
+ */
+static char *bench_json_string(char *c, char **value)
+{
+  char  *o;
+
+  if ('"' != *c)
+    return NULL;
+
+  *value = o = ++c;
+  for (; '\0' != *c && '"' != *c; c++) {
+    if ('\\' == *c && '\0' != c[1])
+      c++;
+    *o++ = *c;
+  }
+
+  if ('"' != *c)
+    return NULL;
+
+  *o = '\0';
+  return c + 1;
+}
+
+/*
+ * bench_next_object parses the next object of an LLD data array, starting at
+ * the given position, into the given macro list and returns a pointer past
+ * it, or NULL if there are no more objects. Only string values are kept.
+ */
+static char *bench_next_object(char *c, bench_macro *macros, int *nmacros)
+{
+  char  *name, *value;
+
+  *nmacros = 0;
+  if (NULL == (c = strchr(c, '{')))
+    return NULL;
+
+  for (c++; '\0' != *c && '}' != *c; ) {
+    while (isspace((unsigned char) *c) || ',' == *c)
+      c++;
+
+    if (NULL == (c = bench_json_string(c, &name)))
+      return NULL;
+
+    while (isspace((unsigned char) *c) || ':' == *c)
+      c++;
+
+    if ('"' == *c) {
+      if (NULL == (c = bench_json_string(c, &value)))
+        return NULL;
+
+      if (*nmacros < BENCH_MACROS_MAX) {
+        macros[*nmacros].name = name;
+        macros[*nmacros].value = value;
+        (*nmacros)++;
+      }
+    } else {
+      while ('\0' != *c && ',' != *c && '}' != *c)
+        c++;
+    }
+
+    while (isspace((unsigned char) *c))
+      c++;
+  }
+
+  return '}' == *c ? c + 1 : NULL;
+}
+
+/*
+ * bench_expand returns a copy of the given item prototype key with all LLD
+ * macros of the given list replaced by their value.
+ */
+static char *bench_expand(const char *key, const bench_macro *macros, int nmacros)
+{
+  char  *s = strdup(key), *t;
+  int   i;
+
+  for (i = 0; i < nmacros; i++) {
+    t = string_replace(s, macros[i].name, macros[i].value);
+    free(s);
+    s = t;
+  }
+
+  return s;
+}
+
+/*
+ * bench_discover calls the prototypes of the given discovery key for up to
+ * max_objects of the objects in the given discovery result.
+ */
+static void bench_discover(int parent, char *json)
+{
+  bench_macro macros[BENCH_MACROS_MAX];
+  char        *c, *key, *value;
+  int         i, nmacros, nobjects = 0;
+
+  if (NULL == (c = strstr(json, "\"data\"")) || NULL == (c = strchr(c, '[')))
+    return;
+
+  while (nobjects++ < max_objects && NULL != (c = bench_next_object(c, macros, &nmacros))) {
+    for (i = parent + 1; i < nkeys && parent == keys[i].parent; i++) {
+      key = bench_expand(keys[i].key, macros, nmacros);
+      if (SUCCEED == bench_call(i, key, &value))
+        free(value);
+      free(key);
+    }
+  }
+}
+
+static int bench_cmp_samples(const void *a, const void *b)
+{
+  zbx_uint64_t x = *(const zbx_uint64_t*) a, y = *(const zbx_uint64_t*) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double bench_percentile_us(const bench_key *k, double p)
+{
+  size_t i = (size_t) (p * (k->nsamples - 1) + 0.5);
+
+  return k->samples[i] / 1000.0;
+}
+
+static void bench_report(double elapsed, long rss_kb)
+{
+  bench_key     *k;
+  zbx_uint64_t  sum;
+  size_t        j;
+  int           i;
+
+  printf("%-60s %8s %7s %10s %10s %10s %10s %6s %8s\n",
+    "key", "calls", "errors", "p50 us", "p99 us", "calls/s", "bytes", "grows", "rss KiB");
+
+  for (i = 0; i < nkeys; i++) {
+    k = &keys[i];
+    if (0 == k->nsamples) {
+      printf("%s%-*s %8d %7llu\n", -1 == k->parent ? "" : "  ",
+        -1 == k->parent ? 60 : 58, k->key, 0, (unsigned long long) k->errors);
+      continue;
+    }
+
+    qsort(k->samples, k->nsamples, sizeof(zbx_uint64_t), bench_cmp_samples);
+    for (sum = 0, j = 0; j < k->nsamples; j++)
+      sum += k->samples[j];
+
+    printf("%s%-*s %8zu %7llu %10.1f %10.1f %10.0f %10llu %6llu %8ld\n",
+      -1 == k->parent ? "" : "  ", -1 == k->parent ? 60 : 58, k->key,
+      k->nsamples, (unsigned long long) k->errors,
+      bench_percentile_us(k, 0.50), bench_percentile_us(k, 0.99),
+      sum ? k->nsamples / (sum / 1e9) : 0.0,
+      (unsigned long long) (k->bytes / k->nsamples),
+      (unsigned long long) (k->grows / k->nsamples), k->rss_kb);
+  }
+
+  printf("\n%d iterations in %.3fs, rss growth %ld KiB\n", iterations, elapsed, rss_kb);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-i iterations] [-t timeout] [-m objects] [-l level] [-p socket] [-v] keyfile module.so\n"
+    "\n"
+    "  -i  number of times the key file is replayed (default: 10)\n"
+    "  -t  item timeout passed to the module in seconds (default: 3)\n"
+    "  -m  discovered objects for which prototypes are called (default: 50)\n"
+    "  -l  Zabbix log level of module messages (default: 3)\n"
+    "  -p  connect directly to the given private socket of systemd\n"
+    "  -v  print failed calls, twice to print all results\n",
+    name);
+}
+
+int main(int argc, char *argv[])
+{
+  void          *module;
+  int           (*init)(void);
+  int           (*uninit)(void);
+  void          (*set_timeout)(int);
+  ZBX_METRIC    *(*item_list)(void);
+  zbx_uint64_t  start;
+  long          rss;
+  char          *value, **socket_setting;
+  int           c, i, n;
+
+  while (-1 != (c = getopt(argc, argv, "i:t:m:l:p:vh"))) {
+    switch (c) {
+    case 'i': iterations = atoi(optarg); break;
+    case 't': item_timeout = atoi(optarg); break;
+    case 'm': max_objects = atoi(optarg); break;
+    case 'l': bench_log_level = atoi(optarg); break;
+    case 'p': private_socket = optarg; break;
+    case 'v': verbose++; break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (2 != argc - optind) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (FAIL == bench_load_keys(argv[optind]))
+    return EXIT_FAILURE;
+
+  if (NULL == (module = dlopen(argv[optind + 1], RTLD_NOW))) {
+    fprintf(stderr, "failed to load module: %s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  init = dlsym(module, "zbx_module_init");
+  uninit = dlsym(module, "zbx_module_uninit");
+  set_timeout = dlsym(module, "zbx_module_item_timeout");
+  item_list = dlsym(module, "zbx_module_item_list");
+  if (NULL == init || NULL == item_list) {
+    fprintf(stderr, "%s is not a Zabbix module\n", argv[optind + 1]);
+    return EXIT_FAILURE;
+  }
+
+  if (ZBX_MODULE_OK != init()) {
+    fprintf(stderr, "module initialization failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (set_timeout)
+    set_timeout(item_timeout);
+
+  // the module connects on the first call
+  if (NULL != private_socket) {
+    if (NULL == (socket_setting = dlsym(module, "dbus_private_socket"))) {
+      fprintf(stderr, "%s does not support direct connections\n", argv[optind + 1]);
+      return EXIT_FAILURE;
+    }
+
+    *socket_setting = private_socket;
+  }
+
+  metrics = item_list();
+
+  rss = bench_rss_kb();
+  start = bench_clock_ns();
+  for (n = 0; n < iterations; n++) {
+    for (i = 0; i < nkeys; i++) {
+      if (-1 != keys[i].parent || FAIL == bench_call(i, keys[i].key, &value))
+        continue;
+
+      if (i + 1 < nkeys && i == keys[i + 1].parent)
+        bench_discover(i, value);
+
+      free(value);
+    }
+  }
+
+  bench_report((bench_clock_ns() - start) / 1e9, bench_rss_kb() - rss);
+
+  if (uninit)
+    uninit();
+
+  return EXIT_SUCCESS;
+}
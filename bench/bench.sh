@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# bench.sh starts a private D-Bus system bus hosting mock-systemd and runs the
+# benchmark driver against the given module. The call and reply size
+# counters of the mock are printed once the driver is done.
+#
+# usage: bench.sh [-n units] [-i iterations] [-m objects] [-k keyfile]
+#                 [-l latency_usec] [-e errors_per_mille] [-L] [-p]
+#                 [-s calls] module.so
+#
+# With -p, the module connects directly to a private socket of the mock, like
+# /run/systemd/private, instead of via dbus-daemon. With -s, the keys are
+# called the given number of times by the soak driver, which reports memory
+# growth instead of latency.
+#
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+BUILD_DIR=${BENCH_BUILD_DIR:-$BENCH_DIR}
+DBUS_DAEMON=${DBUS_DAEMON:-dbus-daemon}
+
+UNITS=100
+ITERATIONS=10
+OBJECTS=50
+KEYS="$BENCH_DIR/../bench.keys"
+MOCK_ARGS=
+DIRECT=
+SOAK_CALLS=
+
+while getopts "n:i:m:k:l:e:Lps:" opt; do
+	case $opt in
+	n) UNITS=$OPTARG ;;
+	i) ITERATIONS=$OPTARG ;;
+	m) OBJECTS=$OPTARG ;;
+	k) KEYS=$OPTARG ;;
+	l) MOCK_ARGS="$MOCK_ARGS -l $OPTARG" ;;
+	e) MOCK_ARGS="$MOCK_ARGS -e $OPTARG" ;;
+	L) MOCK_ARGS="$MOCK_ARGS -L" ;;
+	p) DIRECT=1 ;;
+	s) SOAK_CALLS=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 [-n units] [-i iterations] [-m objects] [-k keyfile]" \
+		"[-l latency_usec] [-e errors_per_mille] [-L] [-p] [-s calls] module.so" >&2
+	exit 2
+fi
+
+MODULE=$1
+WORK_DIR=$(mktemp -d)
+BUS_PID=
+MOCK_PID=
+
+cleanup() {
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null || true
+	[ -n "$BUS_PID" ] && kill "$BUS_PID" 2>/dev/null || true
+	rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+"$DBUS_DAEMON" \
+	--config-file="$BENCH_DIR/bus.conf" \
+	--fork \
+	--print-address=1 \
+	--print-pid=1 \
+	> "$WORK_DIR/bus"
+
+DBUS_SYSTEM_BUS_ADDRESS=$(sed -n 1p "$WORK_DIR/bus")
+BUS_PID=$(sed -n 2p "$WORK_DIR/bus")
+export DBUS_SYSTEM_BUS_ADDRESS
+
+BENCH_ARGS=
+if [ -n "$DIRECT" ]; then
+	MOCK_ARGS="$MOCK_ARGS -p $WORK_DIR/private"
+	BENCH_ARGS="-p $WORK_DIR/private"
+fi
+
+# the mock prints a line once it owns its bus name
+mkfifo "$WORK_DIR/ready"
+"$BUILD_DIR/mock-systemd" -n "$UNITS" $MOCK_ARGS > "$WORK_DIR/ready" &
+MOCK_PID=$!
+read -r line < "$WORK_DIR/ready"
+echo "mock-systemd: $line"
+
+if [ -n "$SOAK_CALLS" ]; then
+	"$BUILD_DIR/soak" \
+		-n "$SOAK_CALLS" \
+		-l 1 \
+		$BENCH_ARGS \
+		"$KEYS" \
+		"$MODULE"
+else
+	"$BUILD_DIR/bench" \
+		-i "$ITERATIONS" \
+		-m "$OBJECTS" \
+		$BENCH_ARGS \
+		"$KEYS" \
+		"$MODULE"
+fi
+
+echo
+kill -TERM "$MOCK_PID"
+wait "$MOCK_PID" || true
+MOCK_PID=
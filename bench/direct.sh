@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# direct.sh runs the keys of direct.keys against mock-systemd twice, once via
+# dbus-daemon and once connected directly to the private socket of the mock,
+# to show the latency saved by SystemdPrivateSocket.
+#
+# usage: direct.sh [-n units] [-i iterations] [-l latency_usec] module.so
+#
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+UNITS=100
+ITERATIONS=10
+MOCK_ARGS=
+
+while getopts "n:i:l:" opt; do
+	case $opt in
+	n) UNITS=$OPTARG ;;
+	i) ITERATIONS=$OPTARG ;;
+	l) MOCK_ARGS="-l $OPTARG" ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 [-n units] [-i iterations] [-l latency_usec] module.so" >&2
+	exit 2
+fi
+
+for mode in bus direct; do
+	echo "=== $mode"
+	"$BENCH_DIR/bench.sh" \
+		-n "$UNITS" \
+		-i "$ITERATIONS" \
+		-m 50 \
+		-k "$BENCH_DIR/direct.keys" \
+		$MOCK_ARGS \
+		$([ $mode = direct ] && echo -p) \
+		"$1" 2>&1
+	echo
+done
@@ -0,0 +1,964 @@
+/*
+ * mock-systemd serves a synthetic org.freedesktop.systemd1 service on the
+ * D-Bus system bus given in DBUS_SYSTEM_BUS_ADDRESS. It is intended to be run
+ * on a private dbus-daemon so that libzbxsystemd can be benchmarked without a
+ * real PID 1.
+ *
+ * The Manager, Unit, Service, Socket and Slice interfaces are implemented to the
+ * extent that the module uses them. An additional org.freedesktop.systemd1.Mock
+ * interface on the root node exposes per-method call counters and lets a test
+ * change unit state and emit signals.
+ *
+ * With -p, the mock also accepts peer to peer connections on the given socket,
+ * like the private socket of systemd at /run/systemd/private, so that direct
+ * connections can be compared with calls via dbus-daemon.
+ *
+ * On SIGINT or SIGTERM the number of calls and reply bytes of every method
+ * are printed to stderr.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <dbus/dbus.h>
+
+#define SYSTEMD_SERVICE_NAME          "org.freedesktop.systemd1"
+#define SYSTEMD_ROOT_NODE             "/org/freedesktop/systemd1"
+#define SYSTEMD_UNIT_PREFIX           SYSTEMD_ROOT_NODE "/unit/"
+#define SYSTEMD_MANAGER_INTERFACE     SYSTEMD_SERVICE_NAME ".Manager"
+#define SYSTEMD_UNIT_INTERFACE        SYSTEMD_SERVICE_NAME ".Unit"
+#define SYSTEMD_SERVICE_INTERFACE     SYSTEMD_SERVICE_NAME ".Service"
+#define SYSTEMD_SOCKET_INTERFACE      SYSTEMD_SERVICE_NAME ".Socket"
+#define SYSTEMD_SLICE_INTERFACE       SYSTEMD_SERVICE_NAME ".Slice"
+#define MOCK_INTERFACE                SYSTEMD_SERVICE_NAME ".Mock"
+#define DBUS_PROPERTIES_INTERFACE     "org.freedesktop.DBus.Properties"
+
+#define MOCK_WATCHES_MAX              256
+#define MOCK_PEERS_MAX                64
+
+typedef struct {
+  char        *id;
+  char        *path;
+  char        *description;
+  char        *load_state;
+  char        *active_state;
+  char        *sub_state;
+  char        *fragment_path;
+  char        *unit_file_state;
+  char        *following;
+  char        *control_group;
+  char        *type;
+  char        *result;
+  char        *user;
+  char        *exec_path;
+  dbus_bool_t condition_result;
+  dbus_bool_t can_start;
+  dbus_bool_t can_stop;
+  dbus_bool_t can_reload;
+  dbus_bool_t can_isolate;
+  uint32_t    nrestarts;
+  uint32_t    main_pid;
+  uint32_t    nconnections;
+  uint64_t    memory_current;
+  uint64_t    cpu_usage_nsec;
+  uint64_t    tasks_current;
+  uint64_t    active_enter_timestamp;
+} mock_unit;
+
+typedef struct {
+  const char  *interface;
+  const char  *name;
+  const char  *signature;
+  size_t      offset;
+} mock_property;
+
+#define P(iface, name, sig, field)  { iface, name, sig, offsetof(mock_unit, field) }
+#define P_CUSTOM(iface, name, sig)  { iface, name, sig, (size_t) -1 }
+
+static const mock_property unit_properties[] = {
+  P(SYSTEMD_UNIT_INTERFACE, "Id", "s", id),
+  P_CUSTOM(SYSTEMD_UNIT_INTERFACE, "Names", "as"),
+  P(SYSTEMD_UNIT_INTERFACE, "Following", "s", following),
+  P(SYSTEMD_UNIT_INTERFACE, "Description", "s", description),
+  P(SYSTEMD_UNIT_INTERFACE, "LoadState", "s", load_state),
+  P(SYSTEMD_UNIT_INTERFACE, "ActiveState", "s", active_state),
+  P(SYSTEMD_UNIT_INTERFACE, "SubState", "s", sub_state),
+  P(SYSTEMD_UNIT_INTERFACE, "FragmentPath", "s", fragment_path),
+  P(SYSTEMD_UNIT_INTERFACE, "UnitFileState", "s", unit_file_state),
+  P(SYSTEMD_UNIT_INTERFACE, "ActiveEnterTimestamp", "t", active_enter_timestamp),
+  P(SYSTEMD_UNIT_INTERFACE, "CanStart", "b", can_start),
+  P(SYSTEMD_UNIT_INTERFACE, "CanStop", "b", can_stop),
+  P(SYSTEMD_UNIT_INTERFACE, "CanReload", "b", can_reload),
+  P(SYSTEMD_UNIT_INTERFACE, "CanIsolate", "b", can_isolate),
+  P(SYSTEMD_UNIT_INTERFACE, "ConditionResult", "b", condition_result),
+  P(SYSTEMD_SERVICE_INTERFACE, "Type", "s", type),
+  P(SYSTEMD_SERVICE_INTERFACE, "Result", "s", result),
+  P(SYSTEMD_SERVICE_INTERFACE, "User", "s", user),
+  P(SYSTEMD_SERVICE_INTERFACE, "NRestarts", "u", nrestarts),
+  P(SYSTEMD_SERVICE_INTERFACE, "MainPID", "u", main_pid),
+  P(SYSTEMD_SERVICE_INTERFACE, "ControlGroup", "s", control_group),
+  P(SYSTEMD_SERVICE_INTERFACE, "MemoryCurrent", "t", memory_current),
+  P(SYSTEMD_SERVICE_INTERFACE, "CPUUsageNSec", "t", cpu_usage_nsec),
+  P(SYSTEMD_SERVICE_INTERFACE, "TasksCurrent", "t", tasks_current),
+  P_CUSTOM(SYSTEMD_SERVICE_INTERFACE, "ExecStart", "a(sasbttuii)"),
+  P(SYSTEMD_SOCKET_INTERFACE, "NConnections", "u", nconnections),
+  P(SYSTEMD_SOCKET_INTERFACE, "ControlGroup", "s", control_group),
+  P(SYSTEMD_SLICE_INTERFACE, "ControlGroup", "s", control_group),
+  { NULL }
+};
+
+// command line options
+static int          nunits = 100;
+static int          latency = 0;
+static int          error_rate = 0;
+static int          legacy = 0;
+static const char   *private_socket = NULL;
+
+static mock_unit    *units = NULL;
+static int          nunits_total = 0;
+static const char   *method_names[64];
+static unsigned     method_calls[64];
+static uint64_t     method_bytes[64];
+
+static volatile sig_atomic_t stop = 0;
+
+// file descriptors of the bus connection, the private socket and its peers
+static DBusWatch      *watches[MOCK_WATCHES_MAX];
+static int            nwatches = 0;
+static DBusConnection *peers[MOCK_PEERS_MAX];
+static int            npeers = 0;
+
+/*
+ * bus_path_escape escapes a unit name into an object path element in the same
+ * way as sd_bus_path_encode.
+ */
+static char *bus_path_escape(const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+  char              *buf, *c;
+
+  c = buf = calloc(strlen(SYSTEMD_UNIT_PREFIX) + strlen(s) * 3 + 2, 1);
+  c = stpcpy(c, SYSTEMD_UNIT_PREFIX);
+  if ('\0' == *s)
+    *c++ = '_';
+
+  for (const char *p = s; *p; p++) {
+    if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+        (p > s && *p >= '0' && *p <= '9')) {
+      *c++ = *p;
+    } else {
+      *c++ = '_';
+      *c++ = hex[((unsigned char) *p) >> 4];
+      *c++ = hex[((unsigned char) *p) & 15];
+    }
+  }
+
+  return buf;
+}
+
+static void add_unit(const char *id, const char *description, const char *active_state, const char *sub_state)
+{
+  mock_unit   *u;
+  const char  *ext;
+  char        buf[1024];
+
+  units = realloc(units, sizeof(mock_unit) * (nunits_total + 1));
+  u = &units[nunits_total++];
+  memset(u, 0, sizeof(*u));
+
+  ext = strrchr(id, '.');
+  u->id = strdup(id);
+  u->path = bus_path_escape(id);
+  u->description = strdup(description);
+  u->load_state = strdup("loaded");
+  u->active_state = strdup(active_state);
+  u->sub_state = strdup(sub_state);
+  snprintf(buf, sizeof(buf), "/usr/lib/systemd/system/%s", id);
+  u->fragment_path = strdup(buf);
+  u->unit_file_state = strdup(nunits_total % 5 ? "enabled" : "static");
+  u->following = strdup("");
+  // units without processes have no cgroup
+  snprintf(buf, sizeof(buf), "/system.slice/%s", id);
+  u->control_group = strdup(0 == strcmp(active_state, "active") ? buf : "");
+  u->type = strdup("simple");
+  u->result = strdup(0 == strcmp(active_state, "failed") ? "exit-code" : "success");
+  u->user = strdup("");
+  snprintf(buf, sizeof(buf), "/usr/sbin/%.*s", (int) (ext ? ext - id : strlen(id)), id);
+  u->exec_path = strdup(buf);
+  u->condition_result = 1;
+  u->can_start = 1;
+  u->can_stop = 1;
+  u->can_reload = 0 == nunits_total % 3;
+  u->nrestarts = nunits_total % 4;
+  u->main_pid = 0 == strcmp(active_state, "active") ? 1000 + nunits_total : 0;
+  u->memory_current = 1048576ULL * (nunits_total % 64 + 1);
+  u->cpu_usage_nsec = 1000000ULL * nunits_total;
+  u->tasks_current = nunits_total % 8 + 1;
+  u->active_enter_timestamp = 1500000000000000ULL + nunits_total;
+}
+
+static void init_units()
+{
+  char buf[256], desc[256];
+
+  add_unit("-.slice", "Root Slice", "active", "active");
+  free(units[nunits_total - 1].control_group);
+  units[nunits_total - 1].control_group = strdup("/");
+  add_unit("system.slice", "System Slice", "active", "active");
+  free(units[nunits_total - 1].control_group);
+  units[nunits_total - 1].control_group = strdup("/system.slice");
+  add_unit("dbus.service", "D-Bus System Message Bus", "active", "running");
+  add_unit("dbus.socket", "D-Bus System Message Bus Socket", "active", "running");
+  add_unit("sshd.service", "OpenSSH server daemon", "active", "running");
+  add_unit("zabbix-agent.service", "Zabbix Agent", "active", "running");
+  add_unit("dev-mqueue.mount", "POSIX Message Queue File System", "active", "mounted");
+  add_unit("multi-user.target", "Multi-User System", "active", "active");
+  add_unit("kdump.service", "Crash recovery kernel arming", "failed", "failed");
+
+  // a unit in a nested slice
+  add_unit("app.slice", "Applications", "active", "active");
+  free(units[nunits_total - 1].control_group);
+  units[nunits_total - 1].control_group = strdup("/app.slice");
+  add_unit("app-web.slice", "Web Applications", "active", "active");
+  free(units[nunits_total - 1].control_group);
+  units[nunits_total - 1].control_group = strdup("/app.slice/app-web.slice");
+  add_unit("web.service", "Web Server", "active", "running");
+  free(units[nunits_total - 1].control_group);
+  units[nunits_total - 1].control_group = strdup("/app.slice/app-web.slice/web.service");
+
+  for (int i = 0; i < nunits; i++) {
+    snprintf(buf, sizeof(buf), "worker@%d.service", i);
+    snprintf(desc, sizeof(desc), "Worker instance %d", i);
+    if (0 == i % 50)
+      add_unit(buf, desc, "failed", "failed");
+    else if (0 == i % 10)
+      add_unit(buf, desc, "inactive", "dead");
+    else
+      add_unit(buf, desc, "active", "running");
+  }
+}
+
+static mock_unit *find_unit_by_id(const char *id)
+{
+  for (int i = 0; i < nunits_total; i++)
+    if (0 == strcmp(units[i].id, id))
+      return &units[i];
+  return NULL;
+}
+
+static mock_unit *find_unit_by_path(const char *path)
+{
+  for (int i = 0; i < nunits_total; i++)
+    if (0 == strcmp(units[i].path, path))
+      return &units[i];
+  return NULL;
+}
+
+static const char *unit_type(const mock_unit *u)
+{
+  const char *c = strrchr(u->id, '.');
+  return c ? c + 1 : "";
+}
+
+/*
+ * interface_applies returns non-zero if the given interface is implemented by
+ * the given unit.
+ */
+static int interface_applies(const mock_unit *u, const char *interface)
+{
+  // as with sd-bus, GetAll of the empty interface returns all interfaces
+  if ('\0' == *interface || 0 == strcmp(interface, SYSTEMD_UNIT_INTERFACE))
+    return 1;
+  if (0 == strcmp(interface, SYSTEMD_SERVICE_INTERFACE))
+    return 0 == strcmp(unit_type(u), "service");
+  if (0 == strcmp(interface, SYSTEMD_SOCKET_INTERFACE))
+    return 0 == strcmp(unit_type(u), "socket");
+  if (0 == strcmp(interface, SYSTEMD_SLICE_INTERFACE))
+    return 0 == strcmp(unit_type(u), "slice");
+  return 0;
+}
+
+static void append_property_value(DBusMessageIter *iter, const mock_unit *u, const mock_property *p)
+{
+  DBusMessageIter var, arr, st, argv;
+  const void      *field = ((const char *) u) + p->offset;
+  dbus_bool_t     b = 0;
+  dbus_uint64_t   t = 0;
+  dbus_int32_t    i = 0;
+  const char      *s;
+
+  dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, p->signature, &var);
+  if (0 == strcmp(p->name, "Names")) {
+    dbus_message_iter_open_container(&var, DBUS_TYPE_ARRAY, "s", &arr);
+    dbus_message_iter_append_basic(&arr, DBUS_TYPE_STRING, &u->id);
+    dbus_message_iter_close_container(&var, &arr);
+  } else if (0 == strcmp(p->name, "ExecStart")) {
+    // a(sasbttuii): path, argv, ignore_failure, start/stop timestamps, pid,
+    // code, status
+    dbus_message_iter_open_container(&var, DBUS_TYPE_ARRAY, "(sasbttuii)", &arr);
+    dbus_message_iter_open_container(&arr, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->exec_path);
+    dbus_message_iter_open_container(&st, DBUS_TYPE_ARRAY, "s", &argv);
+    dbus_message_iter_append_basic(&argv, DBUS_TYPE_STRING, &u->exec_path);
+    s = "--foreground";
+    dbus_message_iter_append_basic(&argv, DBUS_TYPE_STRING, &s);
+    dbus_message_iter_close_container(&st, &argv);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_BOOLEAN, &b);
+    t = u->active_enter_timestamp;
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT64, &t);
+    t = 0;
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT64, &t);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &u->main_pid);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, &i);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_INT32, &i);
+    dbus_message_iter_close_container(&arr, &st);
+    dbus_message_iter_close_container(&var, &arr);
+  } else {
+    switch (p->signature[0]) {
+    case 's':
+      dbus_message_iter_append_basic(&var, DBUS_TYPE_STRING, (const char **) field);
+      break;
+    case 'b':
+      dbus_message_iter_append_basic(&var, DBUS_TYPE_BOOLEAN, (const dbus_bool_t *) field);
+      break;
+    case 'u':
+      dbus_message_iter_append_basic(&var, DBUS_TYPE_UINT32, (const uint32_t *) field);
+      break;
+    case 't':
+      dbus_message_iter_append_basic(&var, DBUS_TYPE_UINT64, (const uint64_t *) field);
+      break;
+    }
+  }
+  dbus_message_iter_close_container(iter, &var);
+}
+
+static void append_manager_property(DBusMessageIter *iter, const char *name)
+{
+  DBusMessageIter var;
+  const char      *s = NULL;
+  uint32_t        u = 0;
+  double          d = 1.0;
+
+  if (0 == strcmp(name, "Version")) {
+    s = "239";
+  } else if (0 == strcmp(name, "Architecture")) {
+    s = "x86-64";
+  } else if (0 == strcmp(name, "Features")) {
+    s = "+PAM +AUDIT +SELINUX";
+  } else if (0 == strcmp(name, "NNames")) {
+    u = nunits_total;
+  } else if (0 == strcmp(name, "NFailedUnits")) {
+    for (int i = 0; i < nunits_total; i++)
+      u += 0 == strcmp(units[i].active_state, "failed");
+  }
+
+  if (0 == strcmp(name, "Progress")) {
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "d", &var);
+    dbus_message_iter_append_basic(&var, DBUS_TYPE_DOUBLE, &d);
+  } else if (s) {
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "s", &var);
+    dbus_message_iter_append_basic(&var, DBUS_TYPE_STRING, &s);
+  } else {
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "u", &var);
+    dbus_message_iter_append_basic(&var, DBUS_TYPE_UINT32, &u);
+  }
+  dbus_message_iter_close_container(iter, &var);
+}
+
+static const char *manager_properties[] = {
+  "Version", "Architecture", "Features", "NNames", "NFailedUnits", "Progress", NULL
+};
+
+static DBusMessage *error_reply(DBusMessage *msg, const char *name, const char *fmt, const char *arg)
+{
+  char buf[1024];
+  snprintf(buf, sizeof(buf), fmt, arg);
+  return dbus_message_new_error(msg, name, buf);
+}
+
+static void string_list(DBusMessageIter *args, const char **list, int max)
+{
+  DBusMessageIter arr;
+  int             n = 0;
+
+  list[0] = NULL;
+  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(args))
+    return;
+
+  dbus_message_iter_recurse(args, &arr);
+  while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&arr) && n < max - 1) {
+    dbus_message_iter_get_basic(&arr, &list[n++]);
+    dbus_message_iter_next(&arr);
+  }
+  list[n] = NULL;
+}
+
+static int unit_matches(const mock_unit *u, const char **states, const char **patterns)
+{
+  int ok;
+
+  if (states[0]) {
+    ok = 0;
+    for (int i = 0; states[i]; i++)
+      if (0 == strcmp(states[i], u->active_state) || 0 == strcmp(states[i], u->sub_state) ||
+          0 == strcmp(states[i], u->load_state))
+        ok = 1;
+    if (!ok)
+      return 0;
+  }
+
+  if (patterns[0]) {
+    ok = 0;
+    for (int i = 0; patterns[i]; i++)
+      if (0 == fnmatch(patterns[i], u->id, FNM_NOESCAPE))
+        ok = 1;
+    if (!ok)
+      return 0;
+  }
+
+  return 1;
+}
+
+static DBusMessage *list_units(DBusMessage *msg, const char **states, const char **patterns)
+{
+  DBusMessage     *reply = dbus_message_new_method_return(msg);
+  DBusMessageIter args, arr, st;
+  const char      *empty = "", *job_path = "/";
+  uint32_t        job_id = 0;
+
+  dbus_message_iter_init_append(reply, &args);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(ssssssouso)", &arr);
+  for (int i = 0; i < nunits_total; i++) {
+    mock_unit *u = &units[i];
+    if (!unit_matches(u, states, patterns))
+      continue;
+
+    dbus_message_iter_open_container(&arr, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->id);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->description);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->load_state);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->active_state);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &u->sub_state);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &empty);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_OBJECT_PATH, &u->path);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &job_id);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_STRING, &empty);
+    dbus_message_iter_append_basic(&st, DBUS_TYPE_OBJECT_PATH, &job_path);
+    dbus_message_iter_close_container(&arr, &st);
+  }
+  dbus_message_iter_close_container(&args, &arr);
+
+  return reply;
+}
+
+static void emit_signal(DBusConnection *conn, DBusMessage *sig)
+{
+  dbus_connection_send(conn, sig, NULL);
+  dbus_message_unref(sig);
+}
+
+static void emit_properties_changed(DBusConnection *conn, const mock_unit *u)
+{
+  DBusMessage     *sig;
+  DBusMessageIter args, dict, entry, inval;
+  const char      *iface = SYSTEMD_UNIT_INTERFACE;
+
+  sig = dbus_message_new_signal(u->path, DBUS_PROPERTIES_INTERFACE, "PropertiesChanged");
+  dbus_message_iter_init_append(sig, &args);
+  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &iface);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}", &dict);
+  for (const mock_property *p = unit_properties; p->name; p++) {
+    if (0 != strcmp(p->interface, iface))
+      continue;
+    if (0 != strcmp(p->name, "ActiveState") && 0 != strcmp(p->name, "SubState"))
+      continue;
+    dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &p->name);
+    append_property_value(&entry, u, p);
+    dbus_message_iter_close_container(&dict, &entry);
+  }
+  dbus_message_iter_close_container(&args, &dict);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "s", &inval);
+  dbus_message_iter_close_container(&args, &inval);
+  emit_signal(conn, sig);
+}
+
+static DBusMessage *handle_mock(DBusConnection *conn, DBusMessage *msg, const char *member)
+{
+  DBusMessage     *reply;
+  DBusMessageIter args, arr, entry, st;
+  const char      *id = NULL, *state = NULL;
+  mock_unit       *u;
+  dbus_bool_t     b;
+
+  if (0 == strcmp(member, "Stats")) {
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_iter_init_append(reply, &args);
+    dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{s(ut)}", &arr);
+    for (int i = 0; method_names[i]; i++) {
+      dbus_message_iter_open_container(&arr, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+      dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &method_names[i]);
+      dbus_message_iter_open_container(&entry, DBUS_TYPE_STRUCT, NULL, &st);
+      dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT32, &method_calls[i]);
+      dbus_message_iter_append_basic(&st, DBUS_TYPE_UINT64, &method_bytes[i]);
+      dbus_message_iter_close_container(&entry, &st);
+      dbus_message_iter_close_container(&arr, &entry);
+    }
+    dbus_message_iter_close_container(&args, &arr);
+    return reply;
+  }
+
+  if (0 == strcmp(member, "ResetStats")) {
+    memset(method_calls, 0, sizeof(method_calls));
+    memset(method_bytes, 0, sizeof(method_bytes));
+    return dbus_message_new_method_return(msg);
+  }
+
+  if (0 == strcmp(member, "SetActiveState")) {
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &state, DBUS_TYPE_INVALID))
+      return error_reply(msg, DBUS_ERROR_INVALID_ARGS, "%s", "expected (ss)");
+    if (NULL == (u = find_unit_by_id(id)))
+      return error_reply(msg, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not loaded.", id);
+    free(u->active_state);
+    u->active_state = strdup(state);
+    emit_properties_changed(conn, u);
+    return dbus_message_new_method_return(msg);
+  }
+
+  if (0 == strcmp(member, "RemoveUnit")) {
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &id, DBUS_TYPE_INVALID))
+      return error_reply(msg, DBUS_ERROR_INVALID_ARGS, "%s", "expected (s)");
+    if (NULL == (u = find_unit_by_id(id)))
+      return error_reply(msg, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not loaded.", id);
+    reply = dbus_message_new_signal(SYSTEMD_ROOT_NODE, SYSTEMD_MANAGER_INTERFACE, "UnitRemoved");
+    dbus_message_append_args(reply, DBUS_TYPE_STRING, &u->id, DBUS_TYPE_OBJECT_PATH, &u->path, DBUS_TYPE_INVALID);
+    emit_signal(conn, reply);
+    *u = units[--nunits_total];
+    return dbus_message_new_method_return(msg);
+  }
+
+  if (0 == strcmp(member, "Reload")) {
+    for (int i = 1; i >= 0; i--) {
+      b = i;
+      reply = dbus_message_new_signal(SYSTEMD_ROOT_NODE, SYSTEMD_MANAGER_INTERFACE, "Reloading");
+      dbus_message_append_args(reply, DBUS_TYPE_BOOLEAN, &b, DBUS_TYPE_INVALID);
+      emit_signal(conn, reply);
+    }
+    return dbus_message_new_method_return(msg);
+  }
+
+  return NULL;
+}
+
+static DBusMessage *handle_manager(DBusMessage *msg, const char *member)
+{
+  DBusMessage     *reply;
+  DBusMessageIter args;
+  const char      *states[64], *patterns[64], *id = NULL;
+  mock_unit       *u;
+
+  states[0] = patterns[0] = NULL;
+  if (0 == strcmp(member, "ListUnits"))
+    return list_units(msg, states, patterns);
+
+  if (0 == strcmp(member, "ListUnitsFiltered") && !legacy) {
+    if (dbus_message_iter_init(msg, &args))
+      string_list(&args, states, 64);
+    return list_units(msg, states, patterns);
+  }
+
+  if (0 == strcmp(member, "ListUnitsByPatterns") && !legacy) {
+    if (dbus_message_iter_init(msg, &args)) {
+      string_list(&args, states, 64);
+      dbus_message_iter_next(&args);
+      string_list(&args, patterns, 64);
+    }
+    return list_units(msg, states, patterns);
+  }
+
+  if (0 == strcmp(member, "GetUnit")) {
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &id, DBUS_TYPE_INVALID))
+      return error_reply(msg, DBUS_ERROR_INVALID_ARGS, "%s", "expected (s)");
+    if (NULL == (u = find_unit_by_id(id)))
+      return error_reply(msg, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not loaded.", id);
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_append_args(reply, DBUS_TYPE_OBJECT_PATH, &u->path, DBUS_TYPE_INVALID);
+    return reply;
+  }
+
+  if (0 == strcmp(member, "Subscribe") || 0 == strcmp(member, "Unsubscribe"))
+    return dbus_message_new_method_return(msg);
+
+  return NULL;
+}
+
+static DBusMessage *handle_properties(DBusMessage *msg, const char *path, const char *member)
+{
+  DBusMessage     *reply;
+  DBusMessageIter args, dict, entry;
+  const char      *interface = NULL, *name = NULL;
+  mock_unit       *u = NULL;
+  int             root = 0 == strcmp(path, SYSTEMD_ROOT_NODE);
+
+  if (!root && NULL == (u = find_unit_by_path(path)))
+    return error_reply(msg, DBUS_ERROR_UNKNOWN_OBJECT, "Unknown object '%s'.", path);
+
+  if (0 == strcmp(member, "Get")) {
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+      return error_reply(msg, DBUS_ERROR_INVALID_ARGS, "%s", "expected (ss)");
+
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_iter_init_append(reply, &args);
+    if (root) {
+      for (int i = 0; manager_properties[i]; i++) {
+        if (0 == strcmp(manager_properties[i], name)) {
+          append_manager_property(&args, name);
+          return reply;
+        }
+      }
+    } else if (interface_applies(u, interface)) {
+      for (const mock_property *p = unit_properties; p->name; p++) {
+        if (0 == strcmp(p->interface, interface) && 0 == strcmp(p->name, name)) {
+          append_property_value(&args, u, p);
+          return reply;
+        }
+      }
+    }
+
+    dbus_message_unref(reply);
+    return error_reply(msg, DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property or interface: %s", name);
+  }
+
+  if (0 == strcmp(member, "GetAll")) {
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID))
+      return error_reply(msg, DBUS_ERROR_INVALID_ARGS, "%s", "expected (s)");
+
+    if (!root && !interface_applies(u, interface))
+      return error_reply(msg, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface %s.", interface);
+
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_iter_init_append(reply, &args);
+    dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    if (root) {
+      for (int i = 0; manager_properties[i]; i++) {
+        dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &manager_properties[i]);
+        append_manager_property(&entry, manager_properties[i]);
+        dbus_message_iter_close_container(&dict, &entry);
+      }
+    } else {
+      for (const mock_property *p = unit_properties; p->name; p++) {
+        if ('\0' != *interface && 0 != strcmp(p->interface, interface))
+          continue;
+        if (!interface_applies(u, p->interface))
+          continue;
+        dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &p->name);
+        append_property_value(&entry, u, p);
+        dbus_message_iter_close_container(&dict, &entry);
+      }
+    }
+    dbus_message_iter_close_container(&args, &dict);
+    return reply;
+  }
+
+  return NULL;
+}
+
+/*
+ * count_call counts a call of the given method and returns its index in the
+ * method counters, or -1 if too many methods were called.
+ */
+static int count_call(const char *member)
+{
+  int i;
+
+  for (i = 0; method_names[i]; i++)
+    if (0 == strcmp(method_names[i], member))
+      break;
+
+  if (NULL == method_names[i]) {
+    if (i == sizeof(method_names) / sizeof(method_names[0]) - 1)
+      return -1;
+    method_names[i] = strdup(member);
+  }
+
+  method_calls[i]++;
+  return i;
+}
+
+/*
+ * count_reply adds the marshalled size of the given reply to the counters of
+ * the method with the given index.
+ */
+static void count_reply(int method, DBusMessage *reply)
+{
+  char  *buf = NULL;
+  int   len = 0;
+
+  if (0 > method || !dbus_message_marshal(reply, &buf, &len))
+    return;
+
+  method_bytes[method] += len;
+  dbus_free(buf);
+}
+
+static void print_stats()
+{
+  fprintf(stderr, "%-24s %10s %14s %12s\n", "method", "calls", "reply bytes", "bytes/call");
+  for (int i = 0; method_names[i]; i++) {
+    if (0 == method_calls[i])
+      continue;
+    fprintf(stderr, "%-24s %10u %14llu %12llu\n", method_names[i], method_calls[i],
+      (unsigned long long) method_bytes[i],
+      (unsigned long long) method_bytes[i] / method_calls[i]);
+  }
+}
+
+static void handle_signal(int sig)
+{
+  stop = 1;
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+  DBusMessage *reply = NULL;
+  const char  *interface, *member, *path;
+  int         method = -1;
+
+  if (DBUS_MESSAGE_TYPE_METHOD_CALL != dbus_message_get_type(msg))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  interface = dbus_message_get_interface(msg);
+  member = dbus_message_get_member(msg);
+  path = dbus_message_get_path(msg);
+  if (NULL == interface || NULL == member || NULL == path)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (0 != strcmp(interface, MOCK_INTERFACE)) {
+    method = count_call(member);
+
+    if (latency)
+      usleep(latency);
+
+    if (error_rate && (rand() % 1000) < error_rate) {
+      reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, "injected failure");
+      goto send;
+    }
+  }
+
+  if (0 == strcmp(interface, DBUS_PROPERTIES_INTERFACE))
+    reply = handle_properties(msg, path, member);
+  else if (0 == strcmp(interface, SYSTEMD_MANAGER_INTERFACE) && 0 == strcmp(path, SYSTEMD_ROOT_NODE))
+    reply = handle_manager(msg, member);
+  else if (0 == strcmp(interface, MOCK_INTERFACE) && 0 == strcmp(path, SYSTEMD_ROOT_NODE))
+    reply = handle_mock(conn, msg, member);
+
+  if (NULL == reply)
+    reply = error_reply(msg, DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", member);
+
+send:
+  count_reply(method, reply);
+  if (!dbus_message_get_no_reply(msg))
+    dbus_connection_send(conn, reply, NULL);
+  dbus_message_unref(reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static dbus_bool_t add_watch(DBusWatch *watch, void *data)
+{
+  if (MOCK_WATCHES_MAX == nwatches)
+    return FALSE;
+
+  watches[nwatches++] = watch;
+  return TRUE;
+}
+
+static void remove_watch(DBusWatch *watch, void *data)
+{
+  for (int i = 0; i < nwatches; i++) {
+    if (watches[i] == watch) {
+      watches[i] = watches[--nwatches];
+      return;
+    }
+  }
+}
+
+// watches are polled if enabled, so there is nothing to do when toggled
+static void toggle_watch(DBusWatch *watch, void *data)
+{
+}
+
+static int has_watch(DBusWatch *watch)
+{
+  for (int i = 0; i < nwatches; i++)
+    if (watches[i] == watch)
+      return 1;
+
+  return 0;
+}
+
+static void serve_connection(DBusConnection *conn)
+{
+  DBusObjectPathVTable vtable = { NULL, handle_message };
+
+  dbus_connection_set_watch_functions(conn, add_watch, remove_watch, toggle_watch, NULL, NULL);
+  dbus_connection_register_fallback(conn, SYSTEMD_ROOT_NODE, &vtable, NULL);
+}
+
+// new_peer serves a client of the private socket. Unreferenced connections
+// are dropped by libdbus.
+static void new_peer(DBusServer *server, DBusConnection *peer, void *data)
+{
+  if (MOCK_PEERS_MAX == npeers)
+    return;
+
+  peers[npeers++] = dbus_connection_ref(peer);
+  serve_connection(peer);
+}
+
+/*
+ * run polls the file descriptors of all connections and dispatches their
+ * messages until stopped.
+ */
+static void run(DBusConnection *bus)
+{
+  struct pollfd fds[MOCK_WATCHES_MAX];
+  DBusWatch     *polled[MOCK_WATCHES_MAX];
+  unsigned int  flags;
+  int           n;
+
+  while (!stop) {
+    for (n = 0; n < nwatches; n++) {
+      polled[n] = watches[n];
+      flags = dbus_watch_get_flags(watches[n]);
+      fds[n].fd = dbus_watch_get_unix_fd(watches[n]);
+      fds[n].events = 0;
+      fds[n].revents = 0;
+      if (dbus_watch_get_enabled(watches[n]))
+        fds[n].events = (flags & DBUS_WATCH_READABLE ? POLLIN : 0) | (flags & DBUS_WATCH_WRITABLE ? POLLOUT : 0);
+    }
+
+    if (0 >= poll(fds, n, 100))
+      continue;
+
+    // handling a watch may remove others
+    for (int i = 0; i < n; i++) {
+      if (0 == fds[i].revents || !has_watch(polled[i]))
+        continue;
+
+      flags = 0;
+      if (fds[i].revents & POLLIN)
+        flags |= DBUS_WATCH_READABLE;
+      if (fds[i].revents & POLLOUT)
+        flags |= DBUS_WATCH_WRITABLE;
+      if (fds[i].revents & POLLHUP)
+        flags |= DBUS_WATCH_HANGUP;
+      if (fds[i].revents & POLLERR)
+        flags |= DBUS_WATCH_ERROR;
+      dbus_watch_handle(polled[i], flags);
+    }
+
+    while (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_dispatch(bus))
+      ;
+    dbus_connection_flush(bus);
+
+    for (int i = 0; i < npeers; i++) {
+      while (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_dispatch(peers[i]))
+        ;
+      dbus_connection_flush(peers[i]);
+
+      if (!dbus_connection_get_is_connected(peers[i])) {
+        dbus_connection_unref(peers[i]);
+        peers[i--] = peers[--npeers];
+      }
+    }
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-n units] [-l latency_usec] [-e errors_per_mille] [-L] [-p socket]\n"
+    "\n"
+    "  -n  number of synthetic worker@N.service units (default: 100)\n"
+    "  -l  latency injected before every reply, in microseconds\n"
+    "  -e  per mille of method calls that fail with org.freedesktop.DBus.Error.Failed\n"
+    "  -L  legacy mode: ListUnitsFiltered and ListUnitsByPatterns are unknown\n"
+    "  -p  also accept direct connections on the given unix socket\n",
+    name);
+}
+
+int main(int argc, char *argv[])
+{
+  DBusConnection          *conn;
+  DBusServer              *server = NULL;
+  DBusError               err;
+  char                    address[4096];
+  int                     c;
+
+  while (-1 != (c = getopt(argc, argv, "n:l:e:Lp:h"))) {
+    switch (c) {
+    case 'n': nunits = atoi(optarg); break;
+    case 'l': latency = atoi(optarg); break;
+    case 'e': error_rate = atoi(optarg); break;
+    case 'L': legacy = 1; break;
+    case 'p': private_socket = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  init_units();
+
+  dbus_error_init(&err);
+  if (NULL == (conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err))) {
+    fprintf(stderr, "failed to connect to bus: %s\n", err.message);
+    return 1;
+  }
+
+  if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != dbus_bus_request_name(conn, SYSTEMD_SERVICE_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, &err)) {
+    fprintf(stderr, "failed to acquire %s: %s\n", SYSTEMD_SERVICE_NAME, dbus_error_is_set(&err) ? err.message : "name taken");
+    return 1;
+  }
+
+  serve_connection(conn);
+
+  if (NULL != private_socket) {
+    unlink(private_socket);
+    snprintf(address, sizeof(address), "unix:path=%s", private_socket);
+    if (NULL == (server = dbus_server_listen(address, &err))) {
+      fprintf(stderr, "failed to listen on %s: %s\n", private_socket, err.message);
+      return 1;
+    }
+
+    dbus_server_set_new_connection_function(server, new_peer, NULL, NULL);
+    dbus_server_set_watch_functions(server, add_watch, remove_watch, toggle_watch, NULL, NULL);
+  }
+
+  // ready for clients
+  printf("%d units\n", nunits_total);
+  fflush(stdout);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  run(conn);
+
+  if (NULL != server) {
+    dbus_server_disconnect(server);
+    dbus_server_unref(server);
+  }
+
+  print_stats();
+
+  return 0;
+}
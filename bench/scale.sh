@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# scale.sh runs the discovery keys of scale.keys against mock-systemd with an
+# increasing number of units, to show how discovery time, D-Bus reply size and
+# JSON result size grow with the number of units.
+#
+# usage: scale.sh [-i iterations] module.so [units...]
+#
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+ITERATIONS=10
+
+while getopts "i:" opt; do
+	case $opt in
+	i) ITERATIONS=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 [-i iterations] module.so [units...]" >&2
+	exit 2
+fi
+
+MODULE=$1
+shift
+[ $# -gt 0 ] || set -- 100 1000 10000
+
+for units in "$@"; do
+	echo "=== $units units"
+	"$BENCH_DIR/bench.sh" \
+		-n "$units" \
+		-i "$ITERATIONS" \
+		-m 0 \
+		-k "$BENCH_DIR/scale.keys" \
+		"$MODULE" 2>&1
+	echo
+done
@@ -0,0 +1,285 @@
+/*
+ * soak loads libzbxsystemd.so the way zabbix_agentd does and calls the keys
+ * of a key file round robin, a million times by default, to show whether a
+ * long-running poller leaks memory.
+ *
+ * Unlike bench, no per-call samples are kept, so the resident set size and the
+ * heap in use reported at every checkpoint only grow if the module leaks.
+ * Growth is reported relative to the first checkpoint, after caches and
+ * connection buffers were warmed up.
+ *
+ * Keys are read one per line. Blank lines, lines starting with '#' and item
+ * prototypes are ignored. Quoted parameters are not supported.
+ */
+#define _GNU_SOURCE
+#include <sysinc.h>
+#include <module.h>
+#include <common.h>
+#include <log.h>
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <malloc.h>
+
+#define SOAK_KEYS_MAX     64
+#define SOAK_PARAMS_MAX   16
+
+// a key of the key file, parsed once
+typedef struct {
+  char          *key;
+  AGENT_REQUEST request;
+  char          *params[SOAK_PARAMS_MAX];
+  ZBX_METRIC    *metric;
+  zbx_uint64_t  errors;
+} soak_key;
+
+extern int  bench_log_level;
+
+static soak_key keys[SOAK_KEYS_MAX];
+static int      nkeys = 0;
+
+static zbx_uint64_t soak_clock_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zbx_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * soak_rss_kb returns the resident set size of the process in KiB.
+ */
+static long soak_rss_kb()
+{
+  FILE  *f;
+  long  size = 0, resident = 0;
+
+  if (NULL == (f = fopen("/proc/self/statm", "r")))
+    return 0;
+
+  if (2 != fscanf(f, "%ld %ld", &size, &resident))
+    resident = 0;
+
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * soak_heap_kb returns the heap memory in use in KiB, or -1 if the C library
+ * does not tell.
+ */
+static long soak_heap_kb()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return (long) (mallinfo2().uordblks / 1024);
+#else
+  return -1;
+#endif
+}
+
+/*
+ * soak_parse_key splits the given item key in place into its name and
+ * parameters.
+ */
+static void soak_parse_key(soak_key *k)
+{
+  char  *c;
+
+  k->request.key = k->key;
+  k->request.nparam = 0;
+  k->request.params = k->params;
+
+  if (NULL == (c = strchr(k->key, '[')))
+    return;
+
+  *c++ = '\0';
+  if (NULL != strrchr(c, ']'))
+    *strrchr(c, ']') = '\0';
+
+  while (k->request.nparam < SOAK_PARAMS_MAX) {
+    k->params[k->request.nparam++] = c;
+    if (NULL == (c = strchr(c, ',')))
+      break;
+
+    *c++ = '\0';
+  }
+}
+
+/*
+ * soak_load_keys reads the keys of the given key file.
+ */
+static int soak_load_keys(const char *path)
+{
+  FILE  *f;
+  char  line[MAX_STRING_LEN], *e;
+
+  if (NULL == (f = fopen(path, "r"))) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return FAIL;
+  }
+
+  while (NULL != fgets(line, sizeof(line), f)) {
+    for (e = line + strlen(line); e > line && isspace((unsigned char) e[-1]); e--);
+    *e = '\0';
+
+    if ('\0' == *line || '#' == *line || isspace((unsigned char) *line))
+      continue;
+
+    if (SOAK_KEYS_MAX == nkeys) {
+      fprintf(stderr, "too many keys in %s\n", path);
+      break;
+    }
+
+    memset(&keys[nkeys], 0, sizeof(soak_key));
+    keys[nkeys].key = strdup(line);
+    soak_parse_key(&keys[nkeys]);
+    nkeys++;
+  }
+
+  fclose(f);
+  return 0 < nkeys ? SUCCEED : FAIL;
+}
+
+/*
+ * soak_call calls the handler of the given key once and frees its result.
+ */
+static void soak_call(soak_key *k)
+{
+  AGENT_RESULT  res;
+
+  memset(&res, 0, sizeof(res));
+  if (SYSINFO_RET_OK != k->metric->function(&k->request, &res))
+    k->errors++;
+
+  zbx_free(res.str);
+  zbx_free(res.text);
+  zbx_free(res.msg);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-n calls] [-r checkpoints] [-t timeout] [-l level] [-p socket] keyfile module.so\n"
+    "\n"
+    "  -n  total number of calls (default: 1000000)\n"
+    "  -r  number of checkpoints at which memory is reported (default: 10)\n"
+    "  -t  item timeout passed to the module in seconds (default: 3)\n"
+    "  -l  Zabbix log level of module messages (default: 3)\n"
+    "  -p  connect directly to the given private socket of systemd\n",
+    name);
+}
+
+int main(int argc, char *argv[])
+{
+  void          *module;
+  int           (*init)(void);
+  int           (*uninit)(void);
+  void          (*set_timeout)(int);
+  ZBX_METRIC    *(*item_list)(void);
+  ZBX_METRIC    *metrics, *m;
+  char          *private_socket = NULL, **socket_setting;
+  zbx_uint64_t  calls = 1000000, every, n, start, errors;
+  long          rss0 = 0, heap0 = 0, rss, heap;
+  int           c, i, checkpoints = 10, item_timeout = 3;
+
+  while (-1 != (c = getopt(argc, argv, "n:r:t:l:p:h"))) {
+    switch (c) {
+    case 'n': calls = strtoull(optarg, NULL, 10); break;
+    case 'r': checkpoints = atoi(optarg); break;
+    case 't': item_timeout = atoi(optarg); break;
+    case 'l': bench_log_level = atoi(optarg); break;
+    case 'p': private_socket = optarg; break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (2 != argc - optind || 0 == calls || 1 > checkpoints) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (FAIL == soak_load_keys(argv[optind]))
+    return EXIT_FAILURE;
+
+  if (NULL == (module = dlopen(argv[optind + 1], RTLD_NOW))) {
+    fprintf(stderr, "failed to load module: %s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  init = dlsym(module, "zbx_module_init");
+  uninit = dlsym(module, "zbx_module_uninit");
+  set_timeout = dlsym(module, "zbx_module_item_timeout");
+  item_list = dlsym(module, "zbx_module_item_list");
+  if (NULL == init || NULL == item_list) {
+    fprintf(stderr, "%s is not a Zabbix module\n", argv[optind + 1]);
+    return EXIT_FAILURE;
+  }
+
+  if (ZBX_MODULE_OK != init()) {
+    fprintf(stderr, "module initialization failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (set_timeout)
+    set_timeout(item_timeout);
+
+  if (NULL != private_socket) {
+    if (NULL == (socket_setting = dlsym(module, "dbus_private_socket"))) {
+      fprintf(stderr, "%s does not support direct connections\n", argv[optind + 1]);
+      return EXIT_FAILURE;
+    }
+
+    *socket_setting = private_socket;
+  }
+
+  metrics = item_list();
+  for (i = 0; i < nkeys; i++) {
+    for (m = metrics; NULL != m->key; m++)
+      if (0 == strcmp(m->key, keys[i].request.key))
+        break;
+
+    if (NULL == m->key) {
+      fprintf(stderr, "%s: unsupported item key\n", keys[i].request.key);
+      return EXIT_FAILURE;
+    }
+
+    keys[i].metric = m;
+  }
+
+  printf("%d keys, %llu calls\n\n", nkeys, (unsigned long long) calls);
+  printf("%12s %10s %10s %12s %10s %12s %10s\n",
+    "calls", "errors", "calls/s", "rss KiB", "growth", "heap KiB", "growth");
+
+  if (0 == (every = calls / checkpoints))
+    every = 1;
+  start = soak_clock_ns();
+  for (n = 1; n <= calls; n++) {
+    soak_call(&keys[(n - 1) % nkeys]);
+    if (0 != n % every && n != calls)
+      continue;
+
+    rss = soak_rss_kb();
+    heap = soak_heap_kb();
+    if (n == every) {
+      rss0 = rss;
+      heap0 = heap;
+    }
+
+    for (errors = 0, i = 0; i < nkeys; i++)
+      errors += keys[i].errors;
+
+    printf("%12llu %10llu %10.0f %12ld %+10ld %12ld %+10ld\n",
+      (unsigned long long) n, (unsigned long long) errors,
+      n / ((soak_clock_ns() - start) / 1e9),
+      rss, rss - rss0, heap, -1 == heap ? 0 : heap - heap0);
+    fflush(stdout);
+  }
+
+  if (uninit)
+    uninit();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/*
+ * statparse compares the cost of looking up values in a cgroup stat file with
+ * the line scanners the module used before (fopen, fgets and sscanf per line,
+ * or pread and sscanf per line) against the indexed parser of cgroups.c.
+ *
+ * Each metric is looked up separately, re-reading the file every time, as an
+ * item poll does. The 'all' row reads every value of the file once, as the
+ * whole-file items do.
+ *
+ * Without a file, a memory.stat file listing all known stat names is
+ * generated. With -s, a seed that maps all known stat names to distinct slots
+ * is searched for CGROUP_STAT_SEED instead.
+ */
+#define _GNU_SOURCE
+#include "../src/modules/systemd/libzbxsystemd.h"
+
+#include <dlfcn.h>
+#include <getopt.h>
+
+#define STATPARSE_METRICS_MAX   32
+
+static char *(*read_file)(const char *filename, size_t *len);
+static unsigned int (*stat_hash)(const char *key, size_t len, unsigned int seed);
+static int (*stat_parse)(cgroup_stat *stat, char *buf);
+static int (*stat_get)(const cgroup_stat *stat, const char *key, zbx_uint64_t *value);
+static const char **stat_names;
+
+static cgroup_stat  parsed;
+
+// defeats dead code elimination of the lookups
+static volatile zbx_uint64_t sink;
+
+static zbx_uint64_t statparse_clock_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zbx_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * next_line returns the line at the given position, terminated in place, and
+ * advances the position. Returns NULL at the end of the buffer.
+ */
+static char *next_line(char **cursor)
+{
+  char  *line = *cursor, *eol;
+
+  if (NULL == line || '\0' == *line)
+    return NULL;
+
+  if (NULL != (eol = strchr(line, '\n'))) {
+    *eol = '\0';
+    *cursor = eol + 1;
+  } else {
+    *cursor = NULL;
+  }
+
+  return line;
+}
+
+/*
+ * lookup_fgets looks up a value the way the module did before files were kept
+ * open.
+ */
+static int lookup_fgets(const char *filename, const char *metric, zbx_uint64_t *value)
+{
+  FILE    *f;
+  char    line[MAX_STRING_LEN], prefix[MAX_STRING_LEN];
+  size_t  n;
+  int     ret = FAIL;
+
+  if (NULL == (f = fopen(filename, "r")))
+    return FAIL;
+
+  n = zbx_snprintf(prefix, sizeof(prefix), "%s ", metric);
+  while (NULL != fgets(line, sizeof(line), f)) {
+    if (0 != strncmp(line, prefix, n))
+      continue;
+
+    if (1 == sscanf(line, "%*s " ZBX_FS_UI64, value)) {
+      ret = SUCCEED;
+      break;
+    }
+  }
+
+  fclose(f);
+  return ret;
+}
+
+/*
+ * lookup_sscanf looks up a value in a file read with pread, scanning the lines
+ * of the buffer with sscanf.
+ */
+static int lookup_sscanf(const char *filename, const char *metric, zbx_uint64_t *value)
+{
+  char    prefix[MAX_STRING_LEN], *cursor, *line;
+  size_t  n;
+
+  if (NULL == (cursor = read_file(filename, NULL)))
+    return FAIL;
+
+  n = zbx_snprintf(prefix, sizeof(prefix), "%s ", metric);
+  while (NULL != (line = next_line(&cursor))) {
+    if (0 == strncmp(line, prefix, n) && 1 == sscanf(line, "%*s " ZBX_FS_UI64, value))
+      return SUCCEED;
+  }
+
+  return FAIL;
+}
+
+/*
+ * lookup_index looks up a value with the indexed parser.
+ */
+static int lookup_index(const char *filename, const char *metric, zbx_uint64_t *value)
+{
+  char  *buf;
+
+  if (NULL == (buf = read_file(filename, NULL)))
+    return FAIL;
+
+  stat_parse(&parsed, buf);
+  return stat_get(&parsed, metric, value);
+}
+
+/*
+ * all_sscanf reads every value of the file with sscanf.
+ */
+static int all_sscanf(const char *filename, const char *metric, zbx_uint64_t *value)
+{
+  char          name[MAX_STRING_LEN], *cursor, *line;
+  zbx_uint64_t  v;
+
+  if (NULL == (cursor = read_file(filename, NULL)))
+    return FAIL;
+
+  *value = 0;
+  while (NULL != (line = next_line(&cursor))) {
+    if (2 == sscanf(line, "%s " ZBX_FS_UI64, name, &v))
+      *value += v;
+  }
+
+  return SUCCEED;
+}
+
+/*
+ * all_index reads every value of the file with the indexed parser.
+ */
+static int all_index(const char *filename, const char *metric, zbx_uint64_t *value)
+{
+  char  *buf;
+  int   i;
+
+  if (NULL == (buf = read_file(filename, NULL)))
+    return FAIL;
+
+  stat_parse(&parsed, buf);
+  for (*value = 0, i = 0; i < parsed.nentries; i++)
+    *value += parsed.entries[i].value;
+
+  return SUCCEED;
+}
+
+typedef int (*lookup_func)(const char *filename, const char *metric, zbx_uint64_t *value);
+
+/*
+ * run returns the mean cost in nanoseconds of the given lookup over the given
+ * number of iterations, or 0 if the lookup failed.
+ */
+static double run(lookup_func f, const char *filename, const char *metric, int iterations)
+{
+  zbx_uint64_t  start, value = 0;
+  int           i;
+
+  // warm up and check
+  if (SUCCEED != f(filename, metric, &value))
+    return 0;
+
+  start = statparse_clock_ns();
+  for (i = 0; i < iterations; i++) {
+    f(filename, metric, &value);
+    sink = value;
+  }
+
+  return (double) (statparse_clock_ns() - start) / iterations;
+}
+
+/*
+ * search_seed prints the first seed with which all known stat names hash to
+ * distinct slots.
+ */
+static int search_seed()
+{
+  unsigned char used[CGROUP_STAT_SLOTS];
+  unsigned int  seed, slot;
+  int           i;
+
+  for (seed = 0; seed < 1 << 24; seed++) {
+    memset(used, 0, sizeof(used));
+    for (i = 0; NULL != stat_names[i]; i++) {
+      slot = stat_hash(stat_names[i], strlen(stat_names[i]), seed) & (CGROUP_STAT_SLOTS - 1);
+      if (used[slot])
+        break;
+
+      used[slot] = 1;
+    }
+
+    if (NULL == stat_names[i]) {
+      printf("#define CGROUP_STAT_SEED    0x%08x    // %d names\n", seed, i);
+      return EXIT_SUCCESS;
+    }
+  }
+
+  fprintf(stderr, "no seed found for %d names\n", i);
+  return EXIT_FAILURE;
+}
+
+/*
+ * generate_stat_file writes all known stat names to a temporary file and
+ * returns its path.
+ */
+static char *generate_stat_file()
+{
+  static char path[] = "/tmp/statparse.XXXXXX";
+  FILE        *f;
+  int         fd, i;
+
+  if (-1 == (fd = mkstemp(path)) || NULL == (f = fdopen(fd, "w"))) {
+    fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; NULL != stat_names[i]; i++)
+    fprintf(f, "%s %d\n", stat_names[i], i * 4096);
+
+  fclose(f);
+  return path;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [-i iterations] module.so [file [metric...]]\n"
+    "       %s -s module.so\n", name, name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  void        *module;
+  const char  *metrics[STATPARSE_METRICS_MAX] = { "cache", "pgmajfault", "total_unevictable" };
+  char        *filename = NULL;
+  int         opt, i, nmetrics = 3, iterations = 100000, seed = 0, generated = 0;
+
+  while (-1 != (opt = getopt(argc, argv, "i:s"))) {
+    switch (opt) {
+    case 'i': iterations = atoi(optarg); break;
+    case 's': seed = 1; break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || 1 > iterations)
+    usage(argv[0]);
+
+  if (NULL == (module = dlopen(argv[optind], RTLD_NOW))) {
+    fprintf(stderr, "%s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  read_file = dlsym(module, "cgroup_read_file");
+  stat_hash = dlsym(module, "cgroup_stat_hash");
+  stat_parse = dlsym(module, "cgroup_stat_parse");
+  stat_get = dlsym(module, "cgroup_stat_get");
+  stat_names = dlsym(module, "cgroup_stat_names");
+  if (!read_file || !stat_hash || !stat_parse || !stat_get || !stat_names) {
+    fprintf(stderr, "%s does not export the stat parser\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  if (seed)
+    return search_seed();
+
+  if (++optind < argc) {
+    filename = argv[optind];
+  } else {
+    filename = generate_stat_file();
+    generated = 1;
+  }
+
+  if (++optind < argc)
+    for (nmetrics = 0; optind < argc && nmetrics < STATPARSE_METRICS_MAX; optind++)
+      metrics[nmetrics++] = argv[optind];
+
+  printf("%s, %d iterations, ns per lookup\n\n", filename, iterations);
+  printf("%-32s %12s %12s %12s\n", "metric", "fgets", "pread", "index");
+  for (i = 0; i < nmetrics; i++)
+    printf("%-32s %12.0f %12.0f %12.0f\n", metrics[i],
+      run(lookup_fgets, filename, metrics[i], iterations),
+      run(lookup_sscanf, filename, metrics[i], iterations),
+      run(lookup_index, filename, metrics[i], iterations));
+
+  printf("%-32s %12s %12.0f %12.0f\n", "all", "-",
+    run(all_sscanf, filename, NULL, iterations),
+    run(all_index, filename, NULL, iterations));
+
+  if (generated)
+    unlink(filename);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,490 @@
+#include "libzbxsystemd.h"
+
+// seconds a cached property value may be served. 0 disables the cache.
+int property_cache_ttl = 0;
+
+// seconds a cached value of a property that systemd does not signal may be
+// served. 0 disables caching of these properties.
+int property_cache_unsignalled_ttl = 0;
+
+// seconds a rendered discovery result may be served. 0 disables the cache.
+int discovery_cache_ttl = 0;
+
+// a cached property value
+typedef struct {
+  DBusMessage     *msg;     // Get reply or PropertiesChanged signal
+  DBusMessageIter value;    // value iterator into msg
+  time_t          expires;
+} cached_property;
+
+// cached properties keyed by "path|interface|property"
+static Map *properties = NULL;
+
+// a rendered discovery result
+typedef struct {
+  char          *json;
+  zbx_uint64_t  generation; // systemd generation the result was rendered in
+  time_t        expires;
+} cached_discovery;
+
+// rendered discovery results keyed by item key and parameters
+static Map *discoveries = NULL;
+
+// object paths for which PropertiesChanged is matched (PATH_WATCHED) or for
+// which the bus refused a match rule (PATH_REFUSED)
+static Map *watched_paths = NULL;
+
+#define PATH_WATCHED  ((void*) 1)
+#define PATH_REFUSED  ((void*) 2)
+
+// maximum number of object paths in watched_paths. Properties of further
+// objects are not cached.
+#define WATCHED_PATHS_MAX 256
+
+// match rule for PropertiesChanged signals of a systemd object
+#define PROPERTIES_CHANGED_RULE \
+  "type='signal',sender='" SYSTEMD_SERVICE_NAME "'," \
+  "interface='" DBUS_PROPERTIES_INTERFACE "',member='PropertiesChanged'," \
+  "path='%s'"
+
+/*
+ * Unit properties for which systemd emits PropertiesChanged with the new
+ * value. Only these are served from the cache for property_cache_ttl seconds.
+ * All other properties, e.g. resource accounting counters, ControlGroup or
+ * UnitFileState, are served for property_cache_unsignalled_ttl seconds only.
+ */
+static const char *signalled_properties[] = {
+  "ActiveState", "SubState", "LoadState", "FreezerState", "Job",
+  "ConditionResult", "AssertResult", "InvocationID",
+  "MainPID", "ControlPID", "StatusText", "StatusErrno", "Result",
+  "ReloadResult", "CleanResult", "NRestarts",
+  "ExecMainPID", "ExecMainCode", "ExecMainStatus",
+  "NAccepted", "NConnections", "NRefused",
+  NULL
+};
+
+// prefixes of signalled timestamps, which also have a Monotonic variant
+static const char *signalled_prefixes[] = {
+  "ActiveEnterTimestamp", "ActiveExitTimestamp", "InactiveEnterTimestamp",
+  "InactiveExitTimestamp", "StateChangeTimestamp", "ConditionTimestamp",
+  "AssertTimestamp", "ExecMainStartTimestamp", "ExecMainExitTimestamp",
+  "NextElapseUSec", "LastTriggerUSec",
+  NULL
+};
+
+/*
+ * Interfaces of unit objects, the only ones whose properties are cached. Most
+ * properties of the manager object, such as NFailedUnits or NJobs, are never
+ * signalled.
+ */
+static const char *unit_interfaces[] = {
+  SYSTEMD_UNIT_INTERFACE, SYSTEMD_SERVICE_INTERFACE,
+  SYSTEMD_SERVICE_NAME ".Socket", SYSTEMD_SERVICE_NAME ".Target",
+  SYSTEMD_SERVICE_NAME ".Device", SYSTEMD_SERVICE_NAME ".Mount",
+  SYSTEMD_SERVICE_NAME ".Automount", SYSTEMD_SERVICE_NAME ".Swap",
+  SYSTEMD_SERVICE_NAME ".Timer", SYSTEMD_SERVICE_NAME ".Path",
+  SYSTEMD_SERVICE_NAME ".Slice", SYSTEMD_SERVICE_NAME ".Scope",
+  NULL
+};
+
+static int cache_is_unit_interface(const char *interface)
+{
+  for (int i = 0; unit_interfaces[i]; i++)
+    if (0 == strcmp(interface, unit_interfaces[i]))
+      return 1;
+
+  return 0;
+}
+
+/*
+ * cache_property_ttl returns the number of seconds the given property may be
+ * served from the cache.
+ */
+static int cache_property_ttl(const char *property)
+{
+  for (int i = 0; signalled_properties[i]; i++)
+    if (0 == strcmp(property, signalled_properties[i]))
+      return property_cache_ttl;
+
+  for (int i = 0; signalled_prefixes[i]; i++)
+    if (0 == strncmp(property, signalled_prefixes[i], strlen(signalled_prefixes[i])))
+      return property_cache_ttl;
+
+  return property_cache_unsignalled_ttl;
+}
+
+static void cache_free_property(void *value)
+{
+  cached_property *p = (cached_property*) value;
+
+  dbus_message_unref(p->msg);
+  zbx_free(p);
+}
+
+/*
+ * cache_set stores the given value iterator, which must point into the given
+ * message, until the given expiry time.
+ */
+static void cache_set(
+  const char      *key,
+  DBusMessage     *msg,
+  DBusMessageIter *value,
+  time_t          expires
+) {
+  cached_property *p = NULL;
+
+  p = zbx_malloc(p, sizeof(cached_property));
+  p->msg = dbus_message_ref(msg);
+  p->value = *value;
+  p->expires = expires;
+  map_set(properties, key, p);
+}
+
+/*
+ * cache_key_has_path returns non-zero if the given cache key belongs to a
+ * property of the given object path.
+ */
+static int cache_key_has_path(const char *key, void *value, void *path)
+{
+  size_t n = strlen((const char*) path);
+
+  return 0 == strncmp(key, (const char*) path, n) && '|' == key[n];
+}
+
+/*
+ * cache_forget_path forgets all cached properties of the given object path
+ * and stops watching it, so that the path of a removed unit does not hold a
+ * match rule.
+ */
+static void cache_forget_path(const char *path)
+{
+  char  rule[4096];
+
+  map_delete_if(properties, cache_key_has_path, (void*) path);
+
+  if (PATH_WATCHED == map_get(watched_paths, path)) {
+    zbx_snprintf(rule, sizeof(rule), PROPERTIES_CHANGED_RULE, path);
+    dbus_remove_signal_match(rule);
+  }
+
+  map_delete(watched_paths, path);
+}
+
+/*
+ * cache_signal_filter updates cached properties of watched objects from
+ * org.freedesktop.DBus.Properties.PropertiesChanged signals, and forgets them
+ * when systemd unloads a unit or is about to reload.
+ */
+static DBusHandlerResult cache_signal_filter(
+  DBusConnection  *c,
+  DBusMessage     *msg,
+  void            *data
+) {
+  DBusMessageIter args, arr, entry, value;
+  const char      *path, *interface = NULL, *property = NULL, *id = NULL;
+  char            key[4096];
+  time_t          now;
+  int             ttl;
+
+  if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "UnitRemoved")) {
+    if (dbus_message_get_args(msg, NULL,
+                              DBUS_TYPE_STRING, &id,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_INVALID))
+      cache_forget_path(path);
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "Reloading")) {
+    map_reset(properties);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  if (!dbus_message_is_signal(msg, DBUS_PROPERTIES_INTERFACE, "PropertiesChanged"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  path = dbus_message_get_path(msg);
+  if (NULL == path || PATH_WATCHED != map_get(watched_paths, path))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  // signature: sa{sv}as
+  if (!dbus_message_iter_init(msg, &args) ||
+      DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&args))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  dbus_message_iter_get_basic(&args, &interface);
+  dbus_message_iter_next(&args);
+  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  // store changed values
+  now = time(NULL);
+  dbus_message_iter_recurse(&args, &arr);
+  while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&arr)) {
+    dbus_message_iter_recurse(&arr, &entry);
+    dbus_message_iter_get_basic(&entry, &property);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &value);
+
+    zbx_snprintf(key, sizeof(key), "%s|%s|%s", path, interface, property);
+    if (0 == (ttl = cache_property_ttl(property)))
+      map_delete(properties, key);
+    else
+      cache_set(key, msg, &value, now + ttl);
+    dbus_message_iter_next(&arr);
+  }
+
+  // forget invalidated values
+  dbus_message_iter_next(&args);
+  if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&args)) {
+    dbus_message_iter_recurse(&args, &arr);
+    while (DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&arr)) {
+      dbus_message_iter_get_basic(&arr, &property);
+      zbx_snprintf(key, sizeof(key), "%s|%s|%s", path, interface, property);
+      map_delete(properties, key);
+      dbus_message_iter_next(&arr);
+    }
+  }
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "properties changed: %s %s", path, interface);
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/*
+ * cache_watch_path starts matching PropertiesChanged signals of the given
+ * object path.
+ *
+ * Returns FAIL if changes of the object cannot be tracked.
+ */
+static int cache_watch_path(const char *path)
+{
+  char rule[4096];
+
+  if (NULL == properties) {
+    if (FAIL == systemd_subscribe())
+      return FAIL;
+
+    if (!dbus_connection_add_filter(conn, cache_signal_filter, NULL, NULL)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom adding signal filter");
+      return FAIL;
+    }
+
+    properties = map_create(cache_free_property);
+    watched_paths = map_create(NULL);
+  }
+
+  if (PATH_WATCHED == map_get(watched_paths, path))
+    return SUCCEED;
+
+  if (PATH_REFUSED == map_get(watched_paths, path))
+    return FAIL;
+
+  if (WATCHED_PATHS_MAX <= watched_paths->length)
+    return FAIL;
+
+  // the bus limits match rules per connection, so objects beyond the limit
+  // are not cached
+  zbx_snprintf(rule, sizeof(rule), PROPERTIES_CHANGED_RULE, path);
+  if (FAIL == dbus_add_signal_match(rule)) {
+    map_set(watched_paths, path, PATH_REFUSED);
+    return FAIL;
+  }
+
+  map_set(watched_paths, path, PATH_WATCHED);
+
+  return SUCCEED;
+}
+
+/*
+ * cache_reset forgets all cached properties, watched objects and discovery
+ * results after the connection was replaced, as its signal filter and match
+ * rules are gone and signals may have been missed.
+ */
+void cache_reset()
+{
+  if (NULL != discoveries)
+    map_reset(discoveries);
+
+  if (NULL == properties)
+    return;
+
+  map_free(properties);
+  map_free(watched_paths);
+  properties = NULL;
+  watched_paths = NULL;
+}
+
+/*
+ * cache_get_property fills the given property handle with the cached value of
+ * the given property and a new reference to its message, so that the value
+ * outlives an update of the cache while the handle is in use.
+ *
+ * Returns FAIL if the property is not cached or has expired.
+ */
+int cache_get_property(
+  dbus_property *prop,
+  const char    *service,
+  const char    *path,
+  const char    *interface,
+  const char    *property
+) {
+  cached_property *p = NULL;
+  char            key[4096];
+
+  if (0 == property_cache_ttl || NULL == properties)
+    return FAIL;
+
+  if (0 != strcmp(service, SYSTEMD_SERVICE_NAME))
+    return FAIL;
+
+  // apply pending changes
+  dbus_dispatch_signals();
+
+  zbx_snprintf(key, sizeof(key), "%s|%s|%s", path, interface, property);
+  if (NULL == (p = map_get(properties, key))) {
+    stats_record_cache(STATS_CACHE_PROPERTY, 0);
+    return FAIL;
+  }
+
+  if (p->expires <= time(NULL)) {
+    stats_record_cache(STATS_CACHE_PROPERTY, 0);
+    map_delete(properties, key);
+    return FAIL;
+  }
+
+  stats_record_cache(STATS_CACHE_PROPERTY, 1);
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cache hit: %s", key);
+  prop->msg = dbus_message_ref(p->msg);
+  prop->value = p->value;
+
+  return SUCCEED;
+}
+
+/*
+ * cache_put_property caches the given value iterator of the given property,
+ * keeping a reference to the message it points into.
+ */
+void cache_put_property(
+  const char      *service,
+  const char      *path,
+  const char      *interface,
+  const char      *property,
+  DBusMessage     *msg,
+  DBusMessageIter *value
+) {
+  char  key[4096];
+  int   ttl;
+
+  if (0 == property_cache_ttl || 0 != strcmp(service, SYSTEMD_SERVICE_NAME))
+    return;
+
+  if (!cache_is_unit_interface(interface))
+    return;
+
+  ttl = cache_property_ttl(property);
+  if (0 == ttl || FAIL == cache_watch_path(path))
+    return;
+
+  zbx_snprintf(key, sizeof(key), "%s|%s|%s", path, interface, property);
+  cache_set(key, msg, value, time(NULL) + ttl);
+}
+
+static void cache_free_discovery(void *value)
+{
+  cached_discovery *d = (cached_discovery*) value;
+
+  zbx_free(d->json);
+  zbx_free(d);
+}
+
+/*
+ * cache_request_key fills the given buffer with a key which identifies the
+ * given item key and its parameters.
+ */
+static void cache_request_key(char *s, size_t n, AGENT_REQUEST *request)
+{
+  size_t  offset = 0;
+  int     i;
+
+  offset = zbx_snprintf(s, n, "%s", request->key);
+  for (i = 0; i < request->nparam && offset < n; i++)
+    offset += zbx_snprintf(s + offset, n - offset, "\x1f%s", request->params[i]);
+}
+
+/*
+ * cache_get_discovery returns a copy of the cached discovery result of the
+ * given item request, or NULL if it is not cached, has expired or systemd
+ * signalled a change to the set of units since it was rendered.
+ *
+ * It is the callers responsibility to free the returned string.
+ */
+char *cache_get_discovery(AGENT_REQUEST *request)
+{
+  cached_discovery  *d = NULL;
+  zbx_uint64_t      generation = 0;
+  char              key[4096];
+
+  if (0 == discovery_cache_ttl)
+    return NULL;
+
+  cache_request_key(key, sizeof(key), request);
+  if (NULL == discoveries || NULL == (d = map_get(discoveries, key))) {
+    stats_record_cache(STATS_CACHE_DISCOVERY, 0);
+    return NULL;
+  }
+
+  if (FAIL == systemd_get_generation(&generation) ||
+      d->generation != generation ||
+      d->expires <= time(NULL)) {
+    stats_record_cache(STATS_CACHE_DISCOVERY, 0);
+    map_delete(discoveries, key);
+    return NULL;
+  }
+
+  stats_record_cache(STATS_CACHE_DISCOVERY, 1);
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cache hit: %s", request->key);
+  return zbx_strdup(NULL, d->json);
+}
+
+/*
+ * cache_begin_discovery fills the given counter with the systemd generation
+ * before a discovery result is rendered, so that changes signalled while it is
+ * rendered invalidate the result.
+ *
+ * Returns FAIL if the result may not be cached.
+ */
+int cache_begin_discovery(zbx_uint64_t *generation)
+{
+  if (0 == discovery_cache_ttl)
+    return FAIL;
+
+  // the result may only be reused if changes can be tracked
+  return systemd_get_generation(generation);
+}
+
+/*
+ * cache_put_discovery caches a copy of the given discovery result of the given
+ * item request, rendered in the given generation.
+ */
+void cache_put_discovery(AGENT_REQUEST *request, const char *json, zbx_uint64_t generation)
+{
+  cached_discovery  *d = NULL;
+  char              key[4096];
+
+  if (0 == discovery_cache_ttl)
+    return;
+
+  if (NULL == discoveries)
+    discoveries = map_create(cache_free_discovery);
+
+  d = zbx_malloc(d, sizeof(cached_discovery));
+  d->json = zbx_strdup(NULL, json);
+  d->generation = generation;
+  d->expires = time(NULL) + discovery_cache_ttl;
+
+  cache_request_key(key, sizeof(key), request);
+  map_set(discoveries, key, d);
+}
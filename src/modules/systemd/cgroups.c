@@ -1,14 +1,24 @@
 #include "libzbxsystemd.h"
 
+#include <sys/syscall.h>
+
 // cgroup directories
 char *cgroup_dir = NULL, *cpu_cgroup = NULL;
 
+// cgroup hierarchy in use: 1 for per-controller hierarchies, 2 for the unified
+// hierarchy, in which one directory per unit holds the files of all controllers
+int cgroup_version = 0;
+
 /******************************************************************************
  *                                                                            *
  * Function: cgroup_init                                                      *
  *                                                                            *
  * Purpose: it should find cgroup metric directory                            *
  *                                                                            *
+ * Comments: per-controller (v1) hierarchies are preferred, so hosts with a   *
+ *           hybrid layout keep using the v1 controllers. The unified (v2)    *
+ *           hierarchy is used if no v1 controllers are mounted.              *
+ *                                                                            *
  * Return value: SYSINFO_RET_FAIL - cgroup directory was not found            *
  *               SYSINFO_RET_OK - cgroup directory was found                  *
  *                                                                            *
@@ -19,8 +29,8 @@ int     cgroup_init()
 {
         zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "in cgroup_dir_detect()");
 
-        char path[512];
-        char *temp1, *temp2, *cgroup, *ddir;
+        char path[512], mount_dir[512], fs_type[64];
+        char *temp1, *temp2, *cgroup, *ddir, *cgroup2_dir = NULL;
         FILE *fp;
         DIR *dir;
         size_t ddir_size;
@@ -33,6 +43,13 @@ int     cgroup_init()
 
         while (fgets(path, 512, fp) != NULL)
         {
+            if (2 == sscanf(path, "%*s %511s %63s", mount_dir, fs_type) && 0 == strcmp(fs_type, "cgroup2"))
+            {
+                if (NULL == cgroup2_dir)
+                    cgroup2_dir = zbx_dsprintf(NULL, "%s/", mount_dir);
+                continue;
+            }
+
             if ((strstr(path, "cpuset cgroup")) != NULL)
             {
                 temp1 = string_replace(path, "cgroup ", "");
@@ -59,295 +76,2238 @@ int     cgroup_init()
                 }
 
                 free(ddir);
-                pclose(fp);
+                zbx_free(cgroup2_dir);
+                fclose(fp);
+                cgroup_version = 1;
                 return SYSINFO_RET_OK;
             }
         }
-        pclose(fp);
+        fclose(fp);
+
+        if (NULL != cgroup2_dir)
+        {
+            cgroup_dir = cgroup2_dir;
+            cgroup_version = 2;
+            zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "detected cgroup2 unified hierarchy: %s", cgroup_dir);
+            return SYSINFO_RET_OK;
+        }
+
         zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cannot detect cgroup mount directory");
         return SYSINFO_RET_FAIL;
 }
 
-/******************************************************************************
- *                                                                            *
- * Function: SYSTEMD_CGROUP_MEM                                               *
- *                                                                            *
- * Purpose: cgroup memory metrics                                             *
- *                                                                            *
- * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
- *                                 as not supported by zabbix                 *
- *               SYSINFO_RET_OK - success                                     *
- *                                                                            *
- * Author: Jan Garaj <info@monitoringartist.com>                              *
- *                                                                            *
- * Notes: https://www.kernel.org/doc/Documentation/cgroups/memory.txt         *
- ******************************************************************************/
-int     SYSTEMD_CGROUP_MEM(AGENT_REQUEST *request, AGENT_RESULT *result)
+/*
+ * cgroup file cache
+ *
+ * Stat files are kept open per agent process and re-read from offset 0 with
+ * pread into a buffer that is reused across calls, so a poll costs a single
+ * read syscall instead of a path walk, an open and stdio buffering.
+ *
+ * When a unit restarts, systemd removes its cgroup and creates a new one with
+ * the same path. Reads of the files of a removed cgroup fail with ENODEV, in
+ * which case the file is reopened once.
+ */
+
+// most files kept open per process. All files are closed when exceeded.
+#define CGROUP_FILES_MAX    256
+
+// open stat files keyed by path
+static Map      *cgroup_files = NULL;
+
+// read buffer shared by all files
+static char     *cgroup_buf = NULL;
+static size_t   cgroup_buf_size = 0;
+
+static void cgroup_close_file(void *value)
 {
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "in cgroup_mem(()");
-        char    *unit, *metric;
-        int     ret = SYSINFO_RET_FAIL;
+    close((int) (intptr_t) value);
+}
 
-        if (2 != request->nparam)
-        {
-                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
-                SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
-                return SYSINFO_RET_FAIL;
-        }
+/*
+ * cgroup_open_file returns the cached descriptor of the given file, opening
+ * it if required, or -1 with errno set.
+ */
+static int cgroup_open_file(const char *filename)
+{
+    void    *value;
+    int     fd;
 
-        if (cgroup_dir == NULL)
-        {
-                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "systemd.cgroup.mem metrics are not available at the moment - no cgroup directory");
-                SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.mem metrics are not available at the moment - no cgroup directory"));
-                return SYSINFO_RET_FAIL;
-        }
+    if (NULL == cgroup_files)
+        cgroup_files = map_create(cgroup_close_file);
 
-        unit = get_rparam(request, 0);
-        metric = get_rparam(request, 1);
-        char    *stat_file = "/memory.stat";
-        char    *cgroup = "memory/system.slice/";
-        size_t  filename_size = strlen(cgroup) + strlen(unit) + strlen(cgroup_dir) + strlen(stat_file) + 2;
-        char    *filename = malloc(filename_size);
-        zbx_strlcpy(filename, cgroup_dir, filename_size);  // /sys/fs/cgroup/
-        zbx_strlcat(filename, cgroup, filename_size);      // /sys/fs/cgroup/memory/system.slice/
-        zbx_strlcat(filename, unit, filename_size);        // /sys/fs/cgroup/memory/system.slice/dbus.service
-        zbx_strlcat(filename, stat_file, filename_size);   // /sys/fs/cgroup/memory/system.slice/dbus.service/memory.stat
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "metric source file: %s", filename);
-        FILE    *file;
-        if (NULL == (file = fopen(filename, "r")))
-        {
-                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot open metric file: '%s'", filename);
-                free(filename);
-                SET_MSG_RESULT(result, strdup("Cannot open memory.stat file"));
-                return SYSINFO_RET_FAIL;
-        }
+    if (NULL != (value = map_get(cgroup_files, filename)))
+        return (int) (intptr_t) value - 1;
 
-        char    line[MAX_STRING_LEN];
-        char    *metric2 = malloc(strlen(metric)+3);
-        memcpy(metric2, metric, strlen(metric));
-        memcpy(metric2 + strlen(metric), " ", 2);
-        zbx_uint64_t    value = 0;
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in memory.stat file", metric);
-        while (NULL != fgets(line, sizeof(line), file))
-        {
-                if (0 != strncmp(line, metric2, strlen(metric2)))
-                        continue;
-                if (1 != sscanf(line, "%*s " ZBX_FS_UI64, &value))
-                {
-                        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "sscanf failed for matched metric line");
-                        continue;
-                }
-                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; metric: %s; value: %d", unit, metric, value);
-                SET_UI64_RESULT(result, value);
-                ret = SYSINFO_RET_OK;
-                break;
-        }
-        zbx_fclose(file);
-        free(filename);
-        free(metric2);
+    if (-1 == (fd = open(filename, O_RDONLY | O_CLOEXEC)))
+        return -1;
 
-        if (SYSINFO_RET_FAIL == ret)
-                SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in memory.stat file"));
-        return ret;
+    if (CGROUP_FILES_MAX <= cgroup_files->length) {
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "more than %i cgroup files open, closing all", CGROUP_FILES_MAX);
+        map_reset(cgroup_files);
+    }
+
+    // descriptors are stored off by one so that 0 is not stored as NULL
+    map_set(cgroup_files, filename, (void *) (intptr_t) (fd + 1));
+
+    return fd;
 }
 
-/******************************************************************************
- *                                                                            *
- * Function: SYSTEMD_CGROUP_CPU                                               *
- *                                                                            *
- * Purpose: cpu metrics                                                       *
- *                                                                            *
- * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
- *                                 as not supported by zabbix                 *
- *               SYSINFO_RET_OK - success                                     *
- *                                                                            *
- *                                                                            *
- * Author: Jan Garaj <info@monitoringartist.com>                              *
- *                                                                            *
- * Notes: https://www.kernel.org/doc/Documentation/cgroups/cpuacct.txt        *
- ******************************************************************************/
-int     SYSTEMD_CGROUP_CPU(AGENT_REQUEST *request, AGENT_RESULT *result)
+/*
+ * cgroup_read_fd reads the given open file from offset 0 into the shared read
+ * buffer, terminating it. Returns the size of the file or -1 with errno set.
+ */
+static ssize_t cgroup_read_fd(int fd)
 {
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "in cgroup_cpu()");
+    ssize_t n;
 
-        char    *unit, *metric;
-        int     ret = SYSINFO_RET_FAIL;
+    if (NULL == cgroup_buf) {
+        cgroup_buf_size = 4096;
+        cgroup_buf = zbx_malloc(cgroup_buf, cgroup_buf_size);
+    }
 
-        if (2 != request->nparam)
-        {
-                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
-                SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
-                return SYSINFO_RET_FAIL;
-        }
+    // grow the buffer until the whole file fits
+    while (0 < (n = pread(fd, cgroup_buf, cgroup_buf_size - 1, 0)) && (size_t) n == cgroup_buf_size - 1) {
+        cgroup_buf_size *= 2;
+        cgroup_buf = zbx_realloc(cgroup_buf, cgroup_buf_size);
+    }
 
-        if (cgroup_dir == NULL)
-        {
-                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "systemd.cgroup.cpu metrics are not available at the moment - no cgroup directory");
-                SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.cpu metrics are not available at the moment - no cgroup directory"));
-                return SYSINFO_RET_FAIL;
-        }
+    if (0 <= n)
+        cgroup_buf[n] = '\0';
 
-        unit = get_rparam(request, 0);
-        metric = get_rparam(request, 1);
-        char    *cgroup = NULL, *stat_file = NULL;
-        if(strcmp(metric, "user") == 0 || strcmp(metric, "system") == 0 || strcmp(metric, "total") == 0) {
-            stat_file = "/cpuacct.stat";
-            cgroup = cpu_cgroup;
-        } else {
-            stat_file = "/cpu.stat";
-            if (strchr(cpu_cgroup, ',') != NULL) {
-                cgroup = cpu_cgroup;
-            } else {
-                cgroup = "cpu/system.slice/";
-            }
-        }
-        size_t  filename_size = strlen(cgroup) + strlen(unit) + strlen(cgroup_dir) + strlen(stat_file) + 2;
-        char    *filename = malloc(filename_size);
-        zbx_strlcpy(filename, cgroup_dir, filename_size);
-        zbx_strlcat(filename, cgroup, filename_size);
-        zbx_strlcat(filename, unit, filename_size);
-        zbx_strlcat(filename, stat_file, filename_size);
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "metric source file: %s", filename);
-        FILE    *file;
-        if (NULL == (file = fopen(filename, "r")))
-        {
-                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot open metric file: '%s'", filename);
-                free(filename);
-                SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot open %s file", ++stat_file));
-                return SYSINFO_RET_FAIL;
-        }
+    return n;
+}
 
-        char    line[MAX_STRING_LEN];
-        char    *metric2 = malloc(strlen(metric)+3);
-        zbx_uint64_t cpu_num;
-        memcpy(metric2, metric, strlen(metric));
-        memcpy(metric2 + strlen(metric), " ", 2);
-        zbx_uint64_t    value = 0;
-        zbx_uint64_t    result_value = 0;
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in cpuacct.stat/cpu.stat file", metric);
-        while (NULL != fgets(line, sizeof(line), file))
-        {
-                if (0 != strcmp("total", metric) && 0 != strncmp(line, metric2, strlen(metric2))) {
-                        continue;
-                }
-                if (1 != sscanf(line, "%*s " ZBX_FS_UI64, &value))
-                {
-                        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "sscanf failed for matched metric line");
-                        continue;
-                }
-                result_value += value;
-                ret = SYSINFO_RET_OK;
-        }
+/*
+ * cgroup_read_file returns the content of the given file as a string which is
+ * valid, and may be modified, until the next call. Returns NULL with errno set
+ * if the file cannot be read. The size of the file is returned in len if len
+ * is not NULL.
+ */
+char *cgroup_read_file(const char *filename, size_t *len)
+{
+    ssize_t n = 0;
+    int     fd, err, retry = 1;
 
-        zbx_fclose(file);
-        free(filename);
-        free(metric2);
+    while (1) {
+        if (-1 == (fd = cgroup_open_file(filename)))
+            return NULL;
 
-        if (SYSINFO_RET_FAIL == ret) {
-                SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in cpuacct.stat/cpu.stat file"));
-        } else {
-                // normalize CPU usage by using number of online CPUs - only tick metrics
-                if ((strcmp(metric, "user") == 0 || strcmp(metric, "system") == 0 || strcmp(metric, "total") == 0) && (1 < (cpu_num = sysconf(_SC_NPROCESSORS_ONLN))))
-                {
-                        result_value /= cpu_num;
-                }
+        if (0 <= (n = cgroup_read_fd(fd)))
+            break;
 
-                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; metric: %s; value: %d", unit, metric, result_value);
-                SET_UI64_RESULT(result, result_value);
-        }
+        // the cgroup was removed, possibly recreated by a unit restart
+        err = errno;
+        map_delete(cgroup_files, filename);
+        errno = err;
+        if (!retry-- || (ENODEV != err && ENOENT != err && ESTALE != err))
+            return NULL;
 
-        return ret;
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "reopening cgroup file: %s", filename);
+    }
+
+    if (NULL != len)
+        *len = n;
+
+    return cgroup_buf;
 }
 
-/******************************************************************************
- *                                                                            *
- * Function: SYSTEMD_CGROUP_DEV                                               *
- *                                                                            *
- * Purpose: device blkio metrics                                              *
- *                                                                            *
- * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
- *                                 as not supported by zabbix                 *
- *               SYSINFO_RET_OK - success                                     *
- *                                                                            *
- *                                                                            *
- * Author: Jan Garaj <info@monitoringartist.com>                              *
- *                                                                            *
- * Notes: https://www.kernel.org/doc/Documentation/cgroups/blkio-controller.txt
- ******************************************************************************/
-int     SYSTEMD_CGROUP_DEV(AGENT_REQUEST *request, AGENT_RESULT *result)
+/*
+ * cgroup_next_line returns the line at the given position of a buffer read by
+ * cgroup_read_file, terminated in place, and advances the position to the
+ * next line. Returns NULL at the end of the buffer.
+ */
+static char *cgroup_next_line(char **cursor)
 {
-    char           *unit, *stat_file, *metric;
-    char           filename[MAX_STRING_LEN], line[MAX_STRING_LEN];
-    int            metric_len, ret = SYSINFO_RET_FAIL;
-    FILE           *file = NULL;
-    zbx_uint64_t   value = 0;
+    char    *line = *cursor, *eol;
 
-    if (3 != request->nparam) {
-        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
-        SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
-        return ret;
+    if (NULL == line || '\0' == *line)
+        return NULL;
+
+    if (NULL != (eol = strchr(line, '\n'))) {
+        *eol = '\0';
+        *cursor = eol + 1;
+    } else {
+        *cursor = NULL;
     }
 
-    if (cgroup_dir == NULL) {
-        SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.dev metrics are not available at the moment - no cgroup directory"));
-        return ret;
+    return line;
+}
+
+/*
+ * Stat file parser
+ *
+ * Flat keyed stat files ("key value" lines) are tokenized in a single pass
+ * over the buffer read by cgroup_read_file. Keys are terminated in place and
+ * indexed in an open addressing table, so a file is parsed without allocating
+ * and any number of its values can be looked up afterwards. The key of a line
+ * is everything before its last field, e.g. "8:0 Read" in v1 blkio files.
+ *
+ * The hash is seeded with CGROUP_STAT_SEED, which maps all names listed in
+ * cgroup_stat_names to distinct slots, so lookups of known metrics do not
+ * probe. Other keys work the same, with linear probing on collisions.
+ */
+
+// seed of cgroup_stat_hash. Search a new seed with 'statparse -s' whenever
+// cgroup_stat_names is changed.
+#define CGROUP_STAT_SEED    0x0000005b
+
+// names of memory.stat (v1 and v2), cpu.stat (v1 and v2), cpuacct.stat and
+// blkio files
+const char *cgroup_stat_names[] = {
+    // memory.stat v1
+    "cache", "rss", "rss_huge", "shmem", "mapped_file", "dirty", "writeback",
+    "swap", "pgpgin", "pgpgout", "pgfault", "pgmajfault", "inactive_anon",
+    "active_anon", "inactive_file", "active_file", "unevictable",
+    "hierarchical_memory_limit", "hierarchical_memsw_limit",
+    "total_cache", "total_rss", "total_rss_huge", "total_shmem",
+    "total_mapped_file", "total_dirty", "total_writeback", "total_swap",
+    "total_pgpgin", "total_pgpgout", "total_pgfault", "total_pgmajfault",
+    "total_inactive_anon", "total_active_anon", "total_inactive_file",
+    "total_active_file", "total_unevictable",
+    "workingset_refault", "workingset_activate", "workingset_restore",
+    "workingset_nodereclaim",
+
+    // memory.stat v2
+    "anon", "file", "kernel", "kernel_stack", "pagetables", "sec_pagetables",
+    "percpu", "sock", "vmalloc", "zswap", "zswapped", "file_mapped",
+    "file_dirty", "file_writeback", "swapcached", "anon_thp", "file_thp",
+    "shmem_thp", "slab_reclaimable", "slab_unreclaimable", "slab",
+    "workingset_refault_anon", "workingset_refault_file",
+    "workingset_activate_anon", "workingset_activate_file",
+    "workingset_restore_anon", "workingset_restore_file", "pgscan", "pgsteal",
+    "pgscan_kswapd", "pgscan_direct", "pgsteal_kswapd", "pgsteal_direct",
+    "pgrefill", "pgactivate", "pgdeactivate", "pglazyfree", "pglazyfreed",
+    "thp_fault_alloc", "thp_collapse_alloc",
+
+    // cpu.stat v1 and v2, cpuacct.stat
+    "nr_periods", "nr_throttled", "throttled_time", "usage_usec", "user_usec",
+    "system_usec", "throttled_usec", "nr_bursts", "burst_usec", "user",
+    "system",
+
+    // blkio
+    "Total",
+    NULL
+};
+
+/*
+ * cgroup_stat_hash returns the hash of the given key, seeded with the given
+ * seed. Stat names are mostly distinct in their length and their first or last
+ * eight bytes, so only these are hashed, at a constant cost per key. Keys that
+ * differ in the middle only collide and are told apart by probing.
+ */
+unsigned int cgroup_stat_hash(const char *key, size_t len, unsigned int seed)
+{
+    zbx_uint64_t    head = 0, tail = 0, h;
+    size_t          n = 8 < len ? 8 : len;
+
+    memcpy(&head, key, n);
+    memcpy(&tail, key + len - n, n);
+
+    h = (head ^ seed) * __UINT64_C(0x9e3779b97f4a7c15);
+    h ^= (tail + len) * __UINT64_C(0xc2b2ae3d27d4eb4f);
+    h ^= h >> 29;
+
+    return (unsigned int) (h ^ (h >> 32));
+}
+
+/*
+ * cgroup_decode_uint64 decodes the unsigned decimal number at the given
+ * position. Returns a pointer past its last digit, or NULL if there is no
+ * digit at the position.
+ */
+static const char *cgroup_decode_uint64(const char *s, zbx_uint64_t *value)
+{
+    const char      *start = s;
+    zbx_uint64_t    v = 0;
+
+    while ((unsigned char) (*s - '0') < 10)
+        v = v * 10 + (zbx_uint64_t) (*s++ - '0');
+
+    if (s == start)
+        return NULL;
+
+    *value = v;
+    return s;
+}
+
+/*
+ * cgroup_stat_parse parses the given buffer into the given index, terminating
+ * the keys in place. Lines without a numeric last field are skipped. Returns
+ * the number of values parsed.
+ */
+int cgroup_stat_parse(cgroup_stat *stat, char *buf)
+{
+    char                *line, *c, *sep;
+    const char          *end;
+    cgroup_stat_entry   *e;
+    zbx_uint64_t        value;
+    unsigned int        slot;
+
+    memset(stat->slots, 0, sizeof(stat->slots));
+    stat->nentries = 0;
+
+    for (line = buf; '\0' != *line && CGROUP_STAT_MAX > stat->nentries; line = c) {
+        // find the end of the line and its last field
+        if (NULL == (c = strchr(line, '\n')))
+            c = line + strlen(line);
+
+        for (sep = c - 1; sep > line && ' ' != *sep; sep--);
+        end = sep > line ? cgroup_decode_uint64(sep + 1, &value) : NULL;
+
+        if ('\n' == *c)
+            c++;
+
+        if (NULL == end || ('\n' != *end && '\0' != *end))
+            continue;
+
+        *sep = '\0';
+        e = &stat->entries[stat->nentries++];
+        e->key = line;
+        e->len = sep - line;
+        e->value = value;
+
+        slot = cgroup_stat_hash(e->key, e->len, CGROUP_STAT_SEED) & (CGROUP_STAT_SLOTS - 1);
+        while (0 != stat->slots[slot])
+            slot = (slot + 1) & (CGROUP_STAT_SLOTS - 1);
+
+        stat->slots[slot] = stat->nentries;
     }
 
-    unit = get_rparam(request, 0);
-    if (NULL == unit || '\0' == *unit) {
-        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid unit name"));
-        return ret;
+    return stat->nentries;
+}
+
+/*
+ * cgroup_stat_get looks up the value of the given key in the given index. If a
+ * key occurs more than once, the first value is returned.
+ */
+int cgroup_stat_get(const cgroup_stat *stat, const char *key, zbx_uint64_t *value)
+{
+    const cgroup_stat_entry *e;
+    size_t                  len = strlen(key);
+    unsigned int            slot;
+
+    slot = cgroup_stat_hash(key, len, CGROUP_STAT_SEED) & (CGROUP_STAT_SLOTS - 1);
+    for (; 0 != stat->slots[slot]; slot = (slot + 1) & (CGROUP_STAT_SLOTS - 1)) {
+        e = &stat->entries[stat->slots[slot] - 1];
+        if (e->len == len && 0 == memcmp(e->key, key, len)) {
+            *value = e->value;
+            return SUCCEED;
+        }
     }
 
-    stat_file = get_rparam(request, 1);
-    if (NULL == stat_file || '\0' == *stat_file) {
-        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid file name"));
-        return ret;
+    return FAIL;
+}
+
+// index of the last file parsed by cgroup_parse_unit_file
+static cgroup_stat  cgroup_stats;
+
+/*
+ * Unified (v2) hierarchy
+ *
+ * The existing keys name v1 metrics. cgroup2_metric maps them onto the files
+ * and keys of the unified hierarchy. A NULL key names a file that holds a
+ * single value. Metrics that are not mapped are looked up by their own name,
+ * so v2 names can be used directly.
+ */
+typedef struct {
+    const char  *metric;
+    const char  *file;
+    const char  *key;
+} cgroup2_metric;
+
+static const cgroup2_metric cgroup2_mem_metrics[] = {
+    { "rss",                        "memory.stat",          "anon" },
+    { "cache",                      "memory.stat",          "file" },
+    { "mapped_file",                "memory.stat",          "file_mapped" },
+    { "dirty",                      "memory.stat",          "file_dirty" },
+    { "writeback",                  "memory.stat",          "file_writeback" },
+    { "swap",                       "memory.swap.current",  NULL },
+    { "current",                    "memory.current",       NULL },
+    { "hierarchical_memory_limit",  "memory.max",           NULL },
+    { NULL }
+};
+
+// operations of the v1 blkio files that map onto io.stat and their io.stat
+// keys for bytes and operations
+static const char *cgroup2_io_ops[] = { "Read", "Write", "Discard", NULL };
+static const char *cgroup2_io_bytes[] = { "rbytes", "wbytes", "dbytes", NULL };
+static const char *cgroup2_io_ios[] = { "rios", "wios", "dios", NULL };
+
+static const cgroup2_metric cgroup2_cpu_metrics[] = {
+    { "user",                       "cpu.stat",             "user_usec" },
+    { "system",                     "cpu.stat",             "system_usec" },
+    { "total",                      "cpu.stat",             "usage_usec" },
+    { "throttled_time",             "cpu.stat",             "throttled_usec" },
+    { NULL }
+};
+
+/*
+ * cgroup2_find_metric returns the mapping of the given v1 metric name or NULL.
+ */
+static const cgroup2_metric *cgroup2_find_metric(const cgroup2_metric *metrics, const char *metric)
+{
+    for (; NULL != metrics->metric; metrics++)
+        if (0 == strcmp(metrics->metric, metric))
+            return metrics;
+
+    return NULL;
+}
+
+/*
+ * Unit cgroups
+ *
+ * The cgroup of a unit is resolved from its ControlGroup property, so units in
+ * any slice are found, e.g. in user.slice or nested slices such as
+ * app.slice/app-web.slice. Resolved cgroups are cached per unit until systemd
+ * signals that it unloads the unit or reloads, or until the files of the
+ * cgroup cannot be read anymore, e.g. after the unit was restarted in another
+ * slice. Signals are applied whenever the process next talks to systemd, so
+ * cached lookups do not touch the bus. Units that cannot be resolved over
+ * D-Bus are assumed to be in system.slice, slices in the cgroup derived from
+ * their name. Such guesses are not cached, so that the unit is resolved again
+ * once systemd responds or loads it.
+ */
+typedef struct {
+    char    *cgroup;    // relative to the hierarchy, e.g. "system.slice/dbus.service/"
+    char    *path;      // object path of the unit
+} cgroup_unit;
+
+// resolved cgroups keyed by unit name
+static Map  *cgroup_units = NULL;
+
+// non-zero if cgroup_signal_filter was added to the current connection
+static int  cgroup_watching = 0;
+
+// interfaces of the unit types that have a ControlGroup property
+static const char *cgroup_unit_interfaces[][2] = {
+    { ".service",   SYSTEMD_SERVICE_INTERFACE },
+    { ".socket",    SYSTEMD_SERVICE_NAME ".Socket" },
+    { ".slice",     SYSTEMD_SERVICE_NAME ".Slice" },
+    { ".scope",     SYSTEMD_SERVICE_NAME ".Scope" },
+    { ".mount",     SYSTEMD_SERVICE_NAME ".Mount" },
+    { ".swap",      SYSTEMD_SERVICE_NAME ".Swap" },
+    { NULL }
+};
+
+static void cgroup_free_unit(void *value)
+{
+    cgroup_unit *u = (cgroup_unit *) value;
+
+    zbx_free(u->cgroup);
+    zbx_free(u->path);
+    zbx_free(u);
+}
+
+/*
+ * cgroup_unit_has_path returns non-zero if the given cached unit has the given
+ * object path. Used to forget all aliases of a unit.
+ */
+static int cgroup_unit_has_path(const char *key, void *value, void *path)
+{
+    return 0 == strcmp(((cgroup_unit *) value)->path, (const char *) path);
+}
+
+/*
+ * cgroup_signal_filter forgets the cgroup of a unit when systemd unloads it,
+ * and all cgroups when systemd is about to reload.
+ */
+static DBusHandlerResult cgroup_signal_filter(DBusConnection *c, DBusMessage *msg, void *data)
+{
+    const char  *id = NULL, *path = NULL;
+
+    if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "UnitRemoved")) {
+        if (dbus_message_get_args(msg, NULL,
+                DBUS_TYPE_STRING, &id,
+                DBUS_TYPE_OBJECT_PATH, &path,
+                DBUS_TYPE_INVALID))
+            map_delete_if(cgroup_units, cgroup_unit_has_path, (void *) path);
+    } else if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "Reloading")) {
+        map_reset(cgroup_units);
     }
 
-    metric = get_rparam(request, 2);
-    if (NULL == metric || '\0' == *metric) {
-        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid metric name"));
-        return ret;
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/*
+ * cgroup_watch_units adds cgroup_signal_filter to the current connection, once.
+ * Cached cgroups are then only checked against the cgroup files if systemd
+ * does not emit signals.
+ */
+static void cgroup_watch_units()
+{
+    if (cgroup_watching || FAIL == systemd_subscribe())
+        return;
+
+    if (!dbus_connection_add_filter(conn, cgroup_signal_filter, NULL, NULL)) {
+        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom adding signal filter");
+        return;
     }
-    metric_len = strlen(metric);
 
-    zbx_snprintf(filename, sizeof(filename), "%sblkio/system.slice/%s/%s", cgroup_dir, unit, stat_file);
-    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "metric source file: %s", filename);
-    if (NULL == (file = fopen(filename, "r"))) {
-        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot open metric file: '%s': %s", filename, zbx_strerror(errno));
-        SET_MSG_RESULT(result, strdup("cannot open stat file, probably CONFIG_DEBUG_BLK_CGROUP is not enabled"));
-        return ret;
+    cgroup_watching = 1;
+}
+
+/*
+ * cgroup_reset forgets all resolved cgroups after the connection was replaced,
+ * as signals may have been missed.
+ */
+void cgroup_reset()
+{
+    cgroup_watching = 0;
+    if (NULL != cgroup_units)
+        map_reset(cgroup_units);
+}
+
+/*
+ * cgroup_unit_interface returns the interface of the given unit that has its
+ * ControlGroup property. Units without an extension are services.
+ */
+static const char *cgroup_unit_interface(const char *unit)
+{
+    const char  *ext;
+    int         i;
+
+    if (NULL == (ext = strrchr(unit, '.')))
+        return SYSTEMD_SERVICE_INTERFACE;
+
+    for (i = 0; NULL != cgroup_unit_interfaces[i][0]; i++)
+        if (0 == strcmp(ext, cgroup_unit_interfaces[i][0]))
+            return cgroup_unit_interfaces[i][1];
+
+    return NULL;
+}
+
+/*
+ * cgroup_slice_path fills the given buffer with the cgroup of the given slice
+ * as derived by systemd from its name, e.g. "app.slice/app-web.slice/" for
+ * app-web.slice.
+ */
+static void cgroup_slice_path(const char *slice, char *s, size_t n)
+{
+    const char  *dash, *ext = strrchr(slice, '.');
+    size_t      offset = 0;
+
+    // -.slice is the root cgroup
+    if ('-' == *slice && ext == slice + 1) {
+        *s = '\0';
+        return;
     }
 
-    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in blkio file", metric);
-    while (NULL != fgets(line, sizeof(line), file)) {
-        if (0 != strncmp(line, metric, metric_len))
-            continue;
-        
-        if (' ' != line[metric_len])
-            continue;
+    for (dash = strchr(slice, '-'); NULL != dash && dash < ext && offset < n; dash = strchr(dash + 1, '-'))
+        offset += zbx_snprintf(s + offset, n - offset, "%.*s.slice/", (int) (dash - slice), slice);
 
-        if (1 != sscanf(line, "%*s " ZBX_FS_UI64, &value)) {
-            // maybe per blk device metric, e.g. '8:0 Read'
-            if (1 != sscanf(line, "%*s %*s " ZBX_FS_UI64, &value)) {
-                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "sscanf failed for matched metric line");
-                break;
-            }
-        }
-    
-        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; stat file: %s, metric: %s; value: %d", unit, stat_file, metric, value);
-        SET_UI64_RESULT(result, value);
-        ret = SYSINFO_RET_OK;
-        break;
+    if (offset < n)
+        zbx_snprintf(s + offset, n - offset, "%s/", slice);
+}
+
+/*
+ * cgroup_resolve_unit fills the given buffer with the cgroup of the given unit
+ * as read from its ControlGroup property, relative to the hierarchy and with a
+ * trailing slash, and the given path buffer with the object path of the unit.
+ * Units that cannot be resolved are assumed to be in system.slice, slices in
+ * the cgroup derived from their name, and the path is left empty.
+ *
+ * Returns FAIL if the unit has no cgroup, e.g. because it is not running.
+ */
+static int cgroup_resolve_unit(const char *unit, char *s, size_t n, char *path, size_t path_len, AGENT_RESULT *result)
+{
+    char        cgroup[MAX_STRING_LEN];
+    const char  *interface;
+
+    if (NULL == (interface = cgroup_unit_interface(unit))) {
+        if (NULL != result)
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Unit %s has no control group", unit));
+        return FAIL;
     }
-    
-    zbx_fclose(file);
 
-    if (SYSINFO_RET_FAIL == ret)
-        SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in blkio file"));
-    
-    // TODO: fix blkio metrics that are known but are not available until > 0
+    *path = '\0';
+    if (FAIL == dbus_connect() || FAIL == systemd_get_unit(path, path_len, unit)) {
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cannot resolve the cgroup of %s, assuming system.slice", unit);
+        if (0 == strcmp(interface, SYSTEMD_SERVICE_NAME ".Slice"))
+            cgroup_slice_path(unit, s, n);
+        else
+            zbx_snprintf(s, n, "system.slice/%s/", unit);
 
-    return ret;
+        return SUCCEED;
+    }
+
+    cgroup_watch_units();
+
+    if (FAIL == dbus_get_property_string(cgroup, sizeof(cgroup), SYSTEMD_SERVICE_NAME, path, interface, "ControlGroup") ||
+            '/' != *cgroup) {
+        if (NULL != result)
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Unit %s has no control group, it is probably not running", unit));
+        return FAIL;
+    }
+
+    // "/" is the root cgroup of -.slice
+    zbx_snprintf(s, n, "%s%s", cgroup + 1, '\0' == cgroup[1] ? "" : "/");
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cgroup of %s: %s", unit, cgroup);
+
+    return SUCCEED;
+}
+
+/*
+ * cgroup_unit_path fills the given buffer with the cached cgroup of the given
+ * unit, resolving it if it is not cached. Sets cached to non-zero if the
+ * cgroup was cached.
+ */
+static int cgroup_unit_path(const char *unit, char *s, size_t n, int *cached, AGENT_RESULT *result)
+{
+    cgroup_unit *u = NULL;
+    char        path[MAX_STRING_LEN];
+
+    if (NULL == cgroup_units)
+        cgroup_units = map_create(cgroup_free_unit);
+
+    if (NULL != (u = map_get(cgroup_units, unit))) {
+        zbx_strlcpy(s, u->cgroup, n);
+        *cached = 1;
+        return SUCCEED;
+    }
+
+    *cached = 0;
+    if (FAIL == cgroup_resolve_unit(unit, s, n, path, sizeof(path), result))
+        return FAIL;
+
+    // the cgroup was guessed
+    if ('\0' == *path)
+        return SUCCEED;
+
+    u = zbx_malloc(NULL, sizeof(cgroup_unit));
+    u->cgroup = zbx_strdup(NULL, s);
+    u->path = zbx_strdup(NULL, path);
+    map_set(cgroup_units, unit, u);
+
+    return SUCCEED;
+}
+
+/*
+ * cgroup_read_unit_file reads the given stat file of the given unit with
+ * cgroup_read_file. On v1 hierarchies, the file is read from the given
+ * controller hierarchy, e.g. "memory". Controllers are ignored on the unified
+ * hierarchy. If result is NULL, failures are not reported.
+ */
+static char *cgroup_read_unit_file(const char *controller, const char *unit, const char *file, size_t *len, AGENT_RESULT *result)
+{
+    char    filename[MAX_STRING_LEN], dir[MAX_STRING_LEN], cgroup[MAX_STRING_LEN], *buf;
+    int     cached;
+
+    while (1) {
+        if (FAIL == cgroup_unit_path(unit, cgroup, sizeof(cgroup), &cached, result))
+            return NULL;
+
+        if (2 == cgroup_version)
+            zbx_snprintf(filename, sizeof(filename), "%s%s%s", cgroup_dir, cgroup, file);
+        else
+            zbx_snprintf(filename, sizeof(filename), "%s%s/%s%s", cgroup_dir, controller, cgroup, file);
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "metric source file: %s", filename);
+
+        if (NULL != (buf = cgroup_read_file(filename, len)))
+            return buf;
+
+        // the unit may have been restarted in another cgroup, if its cgroup is
+        // gone rather than the file
+        if (!cached || ENOENT != errno)
+            break;
+
+        zbx_strlcpy(dir, filename, strrchr(filename, '/') - filename + 1);
+        if (0 == access(dir, F_OK)) {
+            errno = ENOENT;
+            break;
+        }
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "cgroup of %s is gone: %s", unit, dir);
+        map_delete(cgroup_units, unit);
+    }
+
+    if (NULL != result) {
+        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot open metric file: '%s': %s", filename, zbx_strerror(errno));
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot open %s file", file));
+    }
+
+    return NULL;
+}
+
+/*
+ * cgroup_parse_unit_file reads the given stat file of the given unit like
+ * cgroup_read_unit_file and parses it into an index which is valid until the
+ * next call. Returns NULL if the file cannot be read.
+ */
+static cgroup_stat *cgroup_parse_unit_file(const char *controller, const char *unit, const char *file, AGENT_RESULT *result)
+{
+    char            *buf;
+    size_t          bytes = 0;
+    zbx_uint64_t    start = stats_clock_us();
+
+    if (NULL == (buf = cgroup_read_unit_file(controller, unit, file, &bytes, result))) {
+        stats_record_cgroup(start, 0, 1);
+        return NULL;
+    }
+
+    cgroup_stat_parse(&cgroup_stats, buf);
+    stats_record_cgroup(start, bytes, 0);
+
+    return &cgroup_stats;
+}
+
+/*
+ * cgroup2_io_keys returns the io.stat keys that the operations of the given v1
+ * blkio file map onto, or NULL if it has no equivalent.
+ */
+static const char **cgroup2_io_keys(const char *stat_file)
+{
+    if (0 == strcmp(stat_file, "blkio.io_service_bytes") || 0 == strcmp(stat_file, "blkio.throttle.io_service_bytes"))
+        return cgroup2_io_bytes;
+
+    if (0 == strcmp(stat_file, "blkio.io_serviced") || 0 == strcmp(stat_file, "blkio.throttle.io_serviced"))
+        return cgroup2_io_ios;
+
+    return NULL;
+}
+
+/*
+ * cgroup2_read_value reads the value of the given key of a flat keyed file
+ * ("key value" lines), or the single value of the file if key is NULL. The
+ * value "max" of limit files is read as ZBX_MAX_UINT64.
+ */
+static int cgroup2_read_value(const char *unit, const char *file, const char *key, zbx_uint64_t *value, AGENT_RESULT *result)
+{
+    cgroup_stat     *stat;
+    char            *buf;
+    int             ret = FAIL;
+    size_t          bytes = 0;
+    zbx_uint64_t    start;
+
+    if (NULL != key) {
+        if (NULL == (stat = cgroup_parse_unit_file(NULL, unit, file, result)))
+            return FAIL;
+
+        ret = cgroup_stat_get(stat, key, value);
+    } else {
+        start = stats_clock_us();
+        if (NULL == (buf = cgroup_read_unit_file(NULL, unit, file, &bytes, result))) {
+            stats_record_cgroup(start, 0, 1);
+            return FAIL;
+        }
+
+        if (0 == strncmp(buf, "max", 3)) {
+            *value = ZBX_MAX_UINT64;
+            ret = SUCCEED;
+        } else if (NULL != cgroup_decode_uint64(buf, value)) {
+            ret = SUCCEED;
+        }
+
+        stats_record_cgroup(start, bytes, SUCCEED != ret);
+    }
+
+    if (FAIL == ret && NULL != result)
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot find a line with requested metric in %s file", file));
+
+    return ret;
+}
+
+/*
+ * cgroup2_read_io sums the given io.stat keys over all devices, or over the
+ * given device ("major:minor") only.
+ */
+static int cgroup2_read_io(const char *unit, const char *device, const char **keys, zbx_uint64_t *value, AGENT_RESULT *result)
+{
+    char            *cursor, *line, *token, *saveptr, *eq;
+    int             i, ret = FAIL;
+    size_t          bytes = 0;
+    zbx_uint64_t    start = stats_clock_us(), n;
+
+    if (NULL == (cursor = cgroup_read_unit_file(NULL, unit, "io.stat", &bytes, result))) {
+        stats_record_cgroup(start, 0, 1);
+        return FAIL;
+    }
+
+    // io.stat lines: "8:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 ..."
+    *value = 0;
+    while (NULL != (line = cgroup_next_line(&cursor))) {
+        if (NULL == (token = strtok_r(line, " ", &saveptr)))
+            continue;
+
+        if (NULL != device && 0 != strcmp(token, device))
+            continue;
+
+        // a device without I/O is still a match
+        ret = SUCCEED;
+        while (NULL != (token = strtok_r(NULL, " ", &saveptr))) {
+            if (NULL == (eq = strchr(token, '=')))
+                continue;
+
+            *eq++ = '\0';
+            for (i = 0; NULL != keys[i]; i++)
+                if (0 == strcmp(token, keys[i]) && NULL != cgroup_decode_uint64(eq, &n))
+                    *value += n;
+        }
+    }
+
+    stats_record_cgroup(start, bytes, 0);
+
+    // a cgroup without I/O has an empty io.stat, which is no error
+    if (NULL == device)
+        ret = SUCCEED;
+
+    if (FAIL == ret)
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot find device %s in io.stat file", device));
+
+    return ret;
+}
+
+/*
+ * cgroup2_mem serves systemd.cgroup.mem from the unified hierarchy. v1 total_*
+ * metrics map to the same v2 metric, as v2 memory.stat is hierarchical.
+ *
+ * hierarchical_memory_limit is ZBX_MAX_UINT64 if memory.max is "max", rather
+ * than the page-aligned LONG_MAX that v1 reports for an unlimited cgroup.
+ */
+static int cgroup2_mem(const char *unit, const char *metric, AGENT_RESULT *result)
+{
+    const cgroup2_metric    *m;
+    zbx_uint64_t            value = 0;
+
+    if (0 == strncmp(metric, "total_", 6) && NULL != cgroup2_find_metric(cgroup2_mem_metrics, metric + 6))
+        metric += 6;
+
+    if (NULL != (m = cgroup2_find_metric(cgroup2_mem_metrics, metric))) {
+        if (FAIL == cgroup2_read_value(unit, m->file, m->key, &value, result))
+            return SYSINFO_RET_FAIL;
+    } else {
+        if (0 == strncmp(metric, "total_", 6))
+            metric += 6;
+
+        if (FAIL == cgroup2_read_value(unit, "memory.stat", metric, &value, result))
+            return SYSINFO_RET_FAIL;
+    }
+
+    SET_UI64_RESULT(result, value);
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * cgroup2_cpu serves systemd.cgroup.cpu from the unified hierarchy. cpu.stat
+ * counts microseconds, which are converted to the units of the v1 metrics:
+ * USER_HZ ticks per online CPU for user, system and total and nanoseconds for
+ * throttled_time.
+ */
+static int cgroup2_cpu(const char *unit, const char *metric, AGENT_RESULT *result)
+{
+    const cgroup2_metric    *m;
+    zbx_uint64_t            value = 0;
+    long                    cpu_num;
+
+    if (NULL == (m = cgroup2_find_metric(cgroup2_cpu_metrics, metric))) {
+        if (FAIL == cgroup2_read_value(unit, "cpu.stat", metric, &value, result))
+            return SYSINFO_RET_FAIL;
+
+        SET_UI64_RESULT(result, value);
+        return SYSINFO_RET_OK;
+    }
+
+    if (FAIL == cgroup2_read_value(unit, m->file, m->key, &value, result))
+        return SYSINFO_RET_FAIL;
+
+    if (0 == strcmp(metric, "throttled_time")) {
+        value *= 1000;
+    } else {
+        value = value * sysconf(_SC_CLK_TCK) / 1000000;
+        if (1 < (cpu_num = sysconf(_SC_NPROCESSORS_ONLN)))
+            value /= cpu_num;
+    }
+
+    SET_UI64_RESULT(result, value);
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * cgroup2_dev serves systemd.cgroup.dev from io.stat of the unified hierarchy.
+ * The v1 io_service_bytes and io_serviced files, including their throttle.*
+ * variants, map to bytes and operations. Their Read, Write, Discard and Total
+ * metrics may be prefixed with a device, e.g. '8:0 Read'. The io.stat file
+ * takes v2 keys, e.g. rbytes or '8:0 rbytes'.
+ */
+static int cgroup2_dev(const char *unit, const char *stat_file, const char *metric, AGENT_RESULT *result)
+{
+    const char          **file_keys, *keys[4] = { NULL };
+    char                device[64], *op;
+    zbx_uint64_t        value = 0;
+    int                 i;
+
+    // split an optional device from the metric
+    *device = '\0';
+    if (NULL != (op = strchr(metric, ' '))) {
+        zbx_snprintf(device, sizeof(device), "%.*s", (int) (op - metric), metric);
+        metric = op + 1;
+    }
+
+    if (0 == strcmp(stat_file, "io.stat")) {
+        keys[0] = metric;
+    } else {
+        if (NULL == (file_keys = cgroup2_io_keys(stat_file))) {
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "%s is not available in the cgroup2 unified hierarchy", stat_file));
+            return SYSINFO_RET_FAIL;
+        }
+
+        if (0 == strcmp(metric, "Total")) {
+            for (i = 0; NULL != cgroup2_io_ops[i]; i++)
+                keys[i] = file_keys[i];
+        } else {
+            for (i = 0; NULL != cgroup2_io_ops[i]; i++)
+                if (0 == strcmp(metric, cgroup2_io_ops[i]))
+                    keys[0] = file_keys[i];
+        }
+
+        if (NULL == keys[0]) {
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Unsupported metric %s", metric));
+            return SYSINFO_RET_FAIL;
+        }
+    }
+
+    if (FAIL == cgroup2_read_io(unit, '\0' == *device ? NULL : device, keys, &value, result))
+        return SYSINFO_RET_FAIL;
+
+    SET_UI64_RESULT(result, value);
+    return SYSINFO_RET_OK;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_MEM                                               *
+ *                                                                            *
+ * Purpose: cgroup memory metrics                                             *
+ *                                                                            *
+ * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
+ *                                 as not supported by zabbix                 *
+ *               SYSINFO_RET_OK - success                                     *
+ *                                                                            *
+ * Author: Jan Garaj <info@monitoringartist.com>                              *
+ *                                                                            *
+ * Notes: https://www.kernel.org/doc/Documentation/cgroups/memory.txt         *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_MEM(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "in cgroup_mem(()");
+        char            *unit, *metric;
+        cgroup_stat     *stat;
+        snapshot_unit   snapshot;
+        zbx_uint64_t    value = 0;
+
+        if (2 != request->nparam)
+        {
+                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
+                SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        if (cgroup_dir == NULL)
+        {
+                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "systemd.cgroup.mem metrics are not available at the moment - no cgroup directory");
+                SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.mem metrics are not available at the moment - no cgroup directory"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        unit = get_rparam(request, 0);
+        metric = get_rparam(request, 1);
+        if (2 == cgroup_version)
+        {
+                if (0 == strcmp(metric, "current") && SUCCEED == snapshot_get_unit(unit, &snapshot) &&
+                                0 != (snapshot.flags & SNAPSHOT_MEMORY))
+                {
+                        SET_UI64_RESULT(result, snapshot.memory_current);
+                        return SYSINFO_RET_OK;
+                }
+
+                return cgroup2_mem(unit, metric, result);
+        }
+
+        if (NULL == (stat = cgroup_parse_unit_file("memory", unit, "memory.stat", result)))
+                return SYSINFO_RET_FAIL;
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in memory.stat file", metric);
+        if (FAIL == cgroup_stat_get(stat, metric, &value))
+        {
+                SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in memory.stat file"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; metric: %s; value: " ZBX_FS_UI64, unit, metric, value);
+        SET_UI64_RESULT(result, value);
+        return SYSINFO_RET_OK;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_CPU                                               *
+ *                                                                            *
+ * Purpose: cpu metrics                                                       *
+ *                                                                            *
+ * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
+ *                                 as not supported by zabbix                 *
+ *               SYSINFO_RET_OK - success                                     *
+ *                                                                            *
+ *                                                                            *
+ * Author: Jan Garaj <info@monitoringartist.com>                              *
+ *                                                                            *
+ * Notes: https://www.kernel.org/doc/Documentation/cgroups/cpuacct.txt        *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_CPU(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "in cgroup_cpu()");
+
+        char            *unit, *metric;
+        const char      *controller, *stat_file;
+        cgroup_stat     *stat;
+        zbx_uint64_t    cpu_num, value = 0;
+        int             i, ticks;
+
+        if (2 != request->nparam)
+        {
+                zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
+                SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        if (cgroup_dir == NULL)
+        {
+                zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "systemd.cgroup.cpu metrics are not available at the moment - no cgroup directory");
+                SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.cpu metrics are not available at the moment - no cgroup directory"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        unit = get_rparam(request, 0);
+        metric = get_rparam(request, 1);
+        if (2 == cgroup_version)
+                return cgroup2_cpu(unit, metric, result);
+
+        // tick metrics are read from cpuacct.stat, see cgroup_init for the
+        // layout of the cpu controllers
+        ticks = (strcmp(metric, "user") == 0 || strcmp(metric, "system") == 0 || strcmp(metric, "total") == 0);
+        if (ticks) {
+            stat_file = "cpuacct.stat";
+            controller = strchr(cpu_cgroup, ',') != NULL ? "cpu,cpuacct" : "cpuacct";
+        } else {
+            stat_file = "cpu.stat";
+            controller = strchr(cpu_cgroup, ',') != NULL ? "cpu,cpuacct" : "cpu";
+        }
+
+        if (NULL == (stat = cgroup_parse_unit_file(controller, unit, stat_file, result)))
+                return SYSINFO_RET_FAIL;
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in cpuacct.stat/cpu.stat file", metric);
+        if (0 == strcmp("total", metric) && 0 < stat->nentries) {
+                for (i = 0; i < stat->nentries; i++)
+                        value += stat->entries[i].value;
+        } else if (FAIL == cgroup_stat_get(stat, metric, &value)) {
+                SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in cpuacct.stat/cpu.stat file"));
+                return SYSINFO_RET_FAIL;
+        }
+
+        // normalize CPU usage by using number of online CPUs - only tick metrics
+        if (ticks && (1 < (cpu_num = sysconf(_SC_NPROCESSORS_ONLN))))
+        {
+                value /= cpu_num;
+        }
+
+        zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; metric: %s; value: " ZBX_FS_UI64, unit, metric, value);
+        SET_UI64_RESULT(result, value);
+        return SYSINFO_RET_OK;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_DEV                                               *
+ *                                                                            *
+ * Purpose: device blkio metrics                                              *
+ *                                                                            *
+ * Return value: SYSINFO_RET_FAIL - function failed, item will be marked      *
+ *                                 as not supported by zabbix                 *
+ *               SYSINFO_RET_OK - success                                     *
+ *                                                                            *
+ *                                                                            *
+ * Author: Jan Garaj <info@monitoringartist.com>                              *
+ *                                                                            *
+ * Notes: https://www.kernel.org/doc/Documentation/cgroups/blkio-controller.txt
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_DEV(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    char           *unit, *stat_file, *metric;
+    cgroup_stat    *stat;
+    int            ret = SYSINFO_RET_FAIL;
+    zbx_uint64_t   value = 0;
+
+    if (3 != request->nparam) {
+        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "invalid number of parameters: %d",  request->nparam);
+        SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
+        return ret;
+    }
+
+    if (cgroup_dir == NULL) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "systemd.cgroup.dev metrics are not available at the moment - no cgroup directory"));
+        return ret;
+    }
+
+    unit = get_rparam(request, 0);
+    if (NULL == unit || '\0' == *unit) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid unit name"));
+        return ret;
+    }
+
+    stat_file = get_rparam(request, 1);
+    if (NULL == stat_file || '\0' == *stat_file) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid file name"));
+        return ret;
+    }
+
+    metric = get_rparam(request, 2);
+    if (NULL == metric || '\0' == *metric) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid metric name"));
+        return ret;
+    }
+
+    if (2 == cgroup_version)
+        return cgroup2_dev(unit, stat_file, metric, result);
+
+    if (NULL == (stat = cgroup_parse_unit_file("blkio", unit, stat_file, NULL))) {
+        zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot open %s of unit %s: %s", stat_file, unit, zbx_strerror(errno));
+        SET_MSG_RESULT(result, strdup("cannot open stat file, probably CONFIG_DEBUG_BLK_CGROUP is not enabled"));
+        return ret;
+    }
+
+    // per blk device metrics are keyed by device, e.g. '8:0 Read'
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "looking metric %s in blkio file", metric);
+    if (FAIL == cgroup_stat_get(stat, metric, &value)) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in blkio file"));
+        return ret;
+    }
+
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit: %s; stat file: %s, metric: %s; value: " ZBX_FS_UI64, unit, stat_file, metric, value);
+    SET_UI64_RESULT(result, value);
+
+    // TODO: fix blkio metrics that are known but are not available until > 0
+
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * Whole-file items
+ *
+ * These items parse a stat file once and return all of its values as a JSON
+ * object, as the master item of dependent items.
+ */
+
+/*
+ * cgroup_stat_json adds all values of the given index to the given JSON
+ * object, in file order.
+ */
+static void cgroup_stat_json(struct zbx_json *j, const cgroup_stat *stat)
+{
+    int i;
+
+    for (i = 0; i < stat->nentries; i++)
+        zbx_json_adduint64(j, stat->entries[i].key, stat->entries[i].value);
+}
+
+/*
+ * cgroup_all_unit returns the unit parameter of an item that takes the unit
+ * and up to max_params - 1 optional parameters, or NULL with the result
+ * message set.
+ */
+static const char *cgroup_all_unit(AGENT_REQUEST *request, int max_params, AGENT_RESULT *result)
+{
+    const char  *unit;
+
+    if (1 > request->nparam || max_params < request->nparam) {
+        SET_MSG_RESULT(result, strdup("Invalid number of parameters"));
+        return NULL;
+    }
+
+    if (NULL == cgroup_dir) {
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "%s metrics are not available at the moment - no cgroup directory", request->key));
+        return NULL;
+    }
+
+    unit = get_rparam(request, 0);
+    if (NULL == unit || '\0' == *unit) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "invalid unit name"));
+        return NULL;
+    }
+
+    return unit;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_MEM_ALL                                           *
+ *                                                                            *
+ * Purpose: all memory metrics of memory.stat as JSON                         *
+ *                                                                            *
+ * Comments: on cgroup v2, current is added from memory.current, which       *
+ *           memory.stat does not include.                                    *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_MEM_ALL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    struct zbx_json j;
+    const char      *unit;
+    cgroup_stat     *stat;
+    zbx_uint64_t    current = 0;
+    int             have_current = 0;
+
+    if (NULL == (unit = cgroup_all_unit(request, 1, result)))
+        return SYSINFO_RET_FAIL;
+
+    // read before memory.stat, which is parsed into the shared file buffer
+    if (2 == cgroup_version)
+        have_current = SUCCEED == cgroup2_read_value(unit, "memory.current", NULL, &current, NULL);
+
+    if (NULL == (stat = cgroup_parse_unit_file("memory", unit, "memory.stat", result)))
+        return SYSINFO_RET_FAIL;
+
+    zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+    cgroup_stat_json(&j, stat);
+    if (have_current)
+        zbx_json_adduint64(&j, "current", current);
+
+    zbx_json_close(&j);
+    SET_STR_RESULT(result, strdup(j.buffer));
+    zbx_json_free(&j);
+
+    return SYSINFO_RET_OK;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_CPU_ALL                                           *
+ *                                                                            *
+ * Purpose: all cpu metrics as JSON                                           *
+ *                                                                            *
+ * Comments: user, system and total are returned in the same units as         *
+ *           systemd.cgroup.cpu returns them, followed by all values of       *
+ *           cpu.stat. On v1 hierarchies, user and system are read from       *
+ *           cpuacct.stat and cpu.stat is optional.                           *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_CPU_ALL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    struct zbx_json j;
+    const char      *unit, *cpuacct, *cpu, *key;
+    cgroup_stat     *stat;
+    zbx_uint64_t    value, user = 0, system = 0, usage = 0;
+    long            cpu_num, ticks = sysconf(_SC_CLK_TCK);
+    int             i;
+
+    if (NULL == (unit = cgroup_all_unit(request, 1, result)))
+        return SYSINFO_RET_FAIL;
+
+    if (1 > (cpu_num = sysconf(_SC_NPROCESSORS_ONLN)))
+        cpu_num = 1;
+
+    if (2 == cgroup_version) {
+        if (NULL == (stat = cgroup_parse_unit_file(NULL, unit, "cpu.stat", result)))
+            return SYSINFO_RET_FAIL;
+
+        zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+        for (i = 0; i < stat->nentries; i++) {
+            key = stat->entries[i].key;
+            value = stat->entries[i].value;
+
+            if (0 == strcmp(key, "user_usec"))
+                user = value;
+            else if (0 == strcmp(key, "system_usec"))
+                system = value;
+            else if (0 == strcmp(key, "usage_usec"))
+                usage = value;
+            else if (0 == strcmp(key, "throttled_usec"))
+                zbx_json_adduint64(&j, "throttled_time", value * 1000);
+
+            zbx_json_adduint64(&j, key, value);
+        }
+
+        zbx_json_adduint64(&j, "user", user * ticks / 1000000 / cpu_num);
+        zbx_json_adduint64(&j, "system", system * ticks / 1000000 / cpu_num);
+        zbx_json_adduint64(&j, "total", usage * ticks / 1000000 / cpu_num);
+    } else {
+        // see cgroup_init for the layout of the cpu controllers
+        cpuacct = NULL != strchr(cpu_cgroup, ',') ? "cpu,cpuacct" : "cpuacct";
+        cpu = NULL != strchr(cpu_cgroup, ',') ? "cpu,cpuacct" : "cpu";
+
+        if (NULL == (stat = cgroup_parse_unit_file(cpuacct, unit, "cpuacct.stat", result)))
+            return SYSINFO_RET_FAIL;
+
+        cgroup_stat_get(stat, "user", &user);
+        cgroup_stat_get(stat, "system", &system);
+
+        zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+        zbx_json_adduint64(&j, "user", user / cpu_num);
+        zbx_json_adduint64(&j, "system", system / cpu_num);
+        zbx_json_adduint64(&j, "total", (user + system) / cpu_num);
+
+        if (NULL != (stat = cgroup_parse_unit_file(cpu, unit, "cpu.stat", NULL)))
+            cgroup_stat_json(&j, stat);
+    }
+
+    zbx_json_close(&j);
+    SET_STR_RESULT(result, strdup(j.buffer));
+    zbx_json_free(&j);
+
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * cgroup_dev_v1_json adds the values of a parsed v1 blkio file to the given
+ * JSON object. Keys are either "<major:minor> <op>", which are grouped by
+ * device, "<major:minor>" or "Total".
+ */
+static void cgroup_dev_v1_json(struct zbx_json *j, const cgroup_stat *stat)
+{
+    const cgroup_stat_entry *e;
+    const char              *op;
+    char                    device[64] = "", dev[64];
+    int                     i;
+
+    for (i = 0; i < stat->nentries; i++) {
+        e = &stat->entries[i];
+        if (NULL != (op = strchr(e->key, ' '))) {
+            zbx_snprintf(dev, sizeof(dev), "%.*s", (int) (op - e->key), e->key);
+            if (0 != strcmp(dev, device)) {
+                if ('\0' != *device)
+                    zbx_json_close(j);
+
+                zbx_strlcpy(device, dev, sizeof(device));
+                zbx_json_addobject(j, device);
+            }
+
+            zbx_json_adduint64(j, op + 1, e->value);
+        } else {
+            if ('\0' != *device) {
+                zbx_json_close(j);
+                *device = '\0';
+            }
+
+            zbx_json_adduint64(j, e->key, e->value);
+        }
+    }
+
+    if ('\0' != *device)
+        zbx_json_close(j);
+}
+
+/*
+ * cgroup_dev_v2_json adds the values of io.stat to the given JSON object, one
+ * object per device. If keys is not NULL, the values are named by the v1
+ * operations they map onto, with a per-device and an overall total as in v1
+ * blkio files.
+ */
+static void cgroup_dev_v2_json(struct zbx_json *j, char *cursor, const char **keys)
+{
+    char            *line, *token, *saveptr, *eq;
+    zbx_uint64_t    value, device_total, total = 0, values[3];
+    int             i;
+
+    while (NULL != (line = cgroup_next_line(&cursor))) {
+        if (NULL == (token = strtok_r(line, " ", &saveptr)))
+            continue;
+
+        zbx_json_addobject(j, token);
+        memset(values, 0, sizeof(values));
+
+        while (NULL != (token = strtok_r(NULL, " ", &saveptr))) {
+            if (NULL == (eq = strchr(token, '=')))
+                continue;
+
+            *eq++ = '\0';
+            if (NULL == cgroup_decode_uint64(eq, &value))
+                continue;
+
+            if (NULL == keys) {
+                zbx_json_adduint64(j, token, value);
+                continue;
+            }
+
+            for (i = 0; NULL != keys[i]; i++)
+                if (0 == strcmp(token, keys[i]))
+                    values[i] = value;
+        }
+
+        if (NULL != keys) {
+            for (device_total = 0, i = 0; NULL != cgroup2_io_ops[i]; i++) {
+                zbx_json_adduint64(j, cgroup2_io_ops[i], values[i]);
+                device_total += values[i];
+            }
+
+            zbx_json_adduint64(j, "Total", device_total);
+            total += device_total;
+        }
+
+        zbx_json_close(j);
+    }
+
+    if (NULL != keys)
+        zbx_json_adduint64(j, "Total", total);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_DEV_ALL                                           *
+ *                                                                            *
+ * Purpose: all metrics of a blkio file as JSON, per device                   *
+ *                                                                            *
+ * Comments: the file defaults to blkio.io_service_bytes on v1 hierarchies    *
+ *           and io.stat on the unified hierarchy.                            *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_DEV_ALL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    struct zbx_json j;
+    const char      *unit, *stat_file, **keys = NULL;
+    cgroup_stat     *stat = NULL;
+    char            *buf = NULL;
+    size_t          bytes = 0;
+    zbx_uint64_t    start = 0;
+
+    if (NULL == (unit = cgroup_all_unit(request, 2, result)))
+        return SYSINFO_RET_FAIL;
+
+    stat_file = get_rparam(request, 1);
+    if (NULL == stat_file || '\0' == *stat_file)
+        stat_file = 2 == cgroup_version ? "io.stat" : "blkio.io_service_bytes";
+
+    if (2 == cgroup_version && 0 != strcmp(stat_file, "io.stat")) {
+        if (NULL == (keys = cgroup2_io_keys(stat_file))) {
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "%s is not available in the cgroup2 unified hierarchy", stat_file));
+            return SYSINFO_RET_FAIL;
+        }
+    }
+
+    // io.stat is not a flat keyed file and is tokenized as it is rendered
+    if (2 == cgroup_version) {
+        start = stats_clock_us();
+        if (NULL == (buf = cgroup_read_unit_file(NULL, unit, NULL != keys ? "io.stat" : stat_file, &bytes, result))) {
+            stats_record_cgroup(start, 0, 1);
+            return SYSINFO_RET_FAIL;
+        }
+    } else if (NULL == (stat = cgroup_parse_unit_file("blkio", unit, stat_file, result))) {
+        return SYSINFO_RET_FAIL;
+    }
+
+    zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+    if (2 == cgroup_version) {
+        cgroup_dev_v2_json(&j, buf, keys);
+        stats_record_cgroup(start, bytes, 0);
+    } else {
+        cgroup_dev_v1_json(&j, stat);
+    }
+
+    zbx_json_close(&j);
+    SET_STR_RESULT(result, strdup(j.buffer));
+    zbx_json_free(&j);
+
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * CPU utilisation
+ *
+ * The nanosecond CPU counters of a unit are sampled on every poll and the
+ * utilisation is computed from the previous sample of the same metric, taken
+ * by the same agent process. The first poll of a metric only takes a sample
+ * and fails with no data, rather than blocking the poller for a second one.
+ */
+
+// most units sampled per process. The least recently sampled unit is dropped
+// when exceeded.
+#define CGROUP_CPU_UTIL_UNITS_MAX       4096
+
+typedef enum {
+    CGROUP_CPU_USER = 0,
+    CGROUP_CPU_SYSTEM,
+    CGROUP_CPU_TOTAL,
+    CGROUP_CPU_COUNT
+} cgroup_cpu_metric;
+
+static const char *cgroup_cpu_metrics[] = { "user", "system", "total", NULL };
+
+// the previous sample of each metric of a unit
+typedef struct {
+    zbx_uint64_t    usage[CGROUP_CPU_COUNT];    // nanoseconds
+    zbx_uint64_t    clock[CGROUP_CPU_COUNT];    // microseconds, 0 if not sampled
+} cgroup_cpu_sample;
+
+// previous samples keyed by unit name
+static Map  *cgroup_cpu_samples = NULL;
+
+// the least recently sampled entry of a map, found by cgroup_find_oldest
+typedef struct {
+    char            key[MAX_STRING_LEN];
+    zbx_uint64_t    clock;
+    zbx_uint64_t    (*clock_of)(void *value);
+} cgroup_oldest;
+
+static int cgroup_find_oldest(const char *key, void *value, void *data)
+{
+    cgroup_oldest   *oldest = (cgroup_oldest *) data;
+    zbx_uint64_t    clock = oldest->clock_of(value);
+
+    if ('\0' == *oldest->key || clock < oldest->clock) {
+        zbx_strlcpy(oldest->key, key, sizeof(oldest->key));
+        oldest->clock = clock;
+    }
+
+    return 0;
+}
+
+/*
+ * cgroup_evict_oldest deletes the entry of the given map with the lowest
+ * sample time, as returned by the given function, to make room for a new one.
+ */
+static void cgroup_evict_oldest(Map *m, zbx_uint64_t (*clock_of)(void *value))
+{
+    cgroup_oldest   oldest;
+
+    oldest.key[0] = '\0';
+    oldest.clock = 0;
+    oldest.clock_of = clock_of;
+    map_delete_if(m, cgroup_find_oldest, &oldest);
+
+    if ('\0' != *oldest.key)
+        map_delete(m, oldest.key);
+}
+
+// cgroup_cpu_sample_clock returns the time of the latest sample of a unit
+static zbx_uint64_t cgroup_cpu_sample_clock(void *value)
+{
+    cgroup_cpu_sample   *sample = (cgroup_cpu_sample *) value;
+    zbx_uint64_t        clock = 0;
+    int                 i;
+
+    for (i = 0; i < CGROUP_CPU_COUNT; i++)
+        if (sample->clock[i] > clock)
+            clock = sample->clock[i];
+
+    return clock;
+}
+
+/*
+ * cgroup_read_uint64 reads the single value of the given file of the given
+ * unit. If result is NULL, failures are not reported.
+ */
+static int cgroup_read_uint64(const char *controller, const char *unit, const char *file, zbx_uint64_t *value, AGENT_RESULT *result)
+{
+    char            *buf;
+    size_t          bytes = 0;
+    zbx_uint64_t    start = stats_clock_us();
+
+    if (NULL == (buf = cgroup_read_unit_file(controller, unit, file, &bytes, result))) {
+        stats_record_cgroup(start, 0, 1);
+        return FAIL;
+    }
+
+    if (NULL == cgroup_decode_uint64(buf, value)) {
+        stats_record_cgroup(start, bytes, 1);
+        if (NULL != result)
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot read a value from %s file", file));
+        return FAIL;
+    }
+
+    stats_record_cgroup(start, bytes, 0);
+    return SUCCEED;
+}
+
+/*
+ * cgroup_read_cpu_usage reads the CPU time of the given unit in nanoseconds.
+ * On v1 hierarchies, user and system time are read from cpuacct.usage_user and
+ * cpuacct.usage_sys, or from the USER_HZ ticks of cpuacct.stat on kernels
+ * without these files.
+ */
+static int cgroup_read_cpu_usage(const char *unit, cgroup_cpu_metric metric, zbx_uint64_t *usage, AGENT_RESULT *result)
+{
+    static const char   *v2_keys[] = { "user_usec", "system_usec", "usage_usec" };
+    static const char   *v1_files[] = { "cpuacct.usage_user", "cpuacct.usage_sys", "cpuacct.usage" };
+    const char          *cpuacct;
+    cgroup_stat         *stat;
+
+    if (2 == cgroup_version) {
+        if (FAIL == cgroup2_read_value(unit, "cpu.stat", v2_keys[metric], usage, result))
+            return FAIL;
+
+        *usage *= 1000;
+        return SUCCEED;
+    }
+
+    // see cgroup_init for the layout of the cpu controllers
+    cpuacct = NULL != strchr(cpu_cgroup, ',') ? "cpu,cpuacct" : "cpuacct";
+
+    if (CGROUP_CPU_TOTAL == metric)
+        return cgroup_read_uint64(cpuacct, unit, v1_files[metric], usage, result);
+
+    if (SUCCEED == cgroup_read_uint64(cpuacct, unit, v1_files[metric], usage, NULL))
+        return SUCCEED;
+
+    if (NULL == (stat = cgroup_parse_unit_file(cpuacct, unit, "cpuacct.stat", result)))
+        return FAIL;
+
+    if (FAIL == cgroup_stat_get(stat, cgroup_cpu_metrics[metric], usage)) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Cannot find a line with requested metric in cpuacct.stat file"));
+        return FAIL;
+    }
+
+    *usage = *usage * 1000000000 / sysconf(_SC_CLK_TCK);
+    return SUCCEED;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_CPU_UTIL                                          *
+ *                                                                            *
+ * Purpose: CPU utilisation of a unit in percent of all online CPUs           *
+ *                                                                            *
+ * Comments: the utilisation is averaged over the time since the previous     *
+ *           poll of the same metric, so no delta preprocessing is required.  *
+ *           The first poll fails with no data.                               *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_CPU_UTIL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    const char          *unit, *param;
+    cgroup_cpu_sample   *sample;
+    snapshot_unit       snapshot;
+    cgroup_cpu_metric   metric = CGROUP_CPU_TOTAL;
+    zbx_uint64_t        usage, clock, delta;
+    long                cpu_num;
+    int                 i;
+
+    if (NULL == (unit = cgroup_all_unit(request, 2, result)))
+        return SYSINFO_RET_FAIL;
+
+    param = get_rparam(request, 1);
+    if (NULL != param && '\0' != *param) {
+        for (i = 0; NULL != cgroup_cpu_metrics[i]; i++)
+            if (0 == strcmp(param, cgroup_cpu_metrics[i]))
+                break;
+
+        if (NULL == cgroup_cpu_metrics[i]) {
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Unsupported metric %s", param));
+            return SYSINFO_RET_FAIL;
+        }
+
+        metric = (cgroup_cpu_metric) i;
+    }
+
+    // the sampler rates the total over its last interval
+    if (CGROUP_CPU_TOTAL == metric && SUCCEED == snapshot_get_unit(unit, &snapshot) && 0 <= snapshot.cpu_util) {
+        SET_DBL_RESULT(result, snapshot.cpu_util);
+        return SYSINFO_RET_OK;
+    }
+
+    if (NULL == cgroup_cpu_samples)
+        cgroup_cpu_samples = map_create(free);
+
+    if (NULL == (sample = map_get(cgroup_cpu_samples, unit))) {
+        if (CGROUP_CPU_UTIL_UNITS_MAX <= cgroup_cpu_samples->length)
+            cgroup_evict_oldest(cgroup_cpu_samples, cgroup_cpu_sample_clock);
+
+        sample = zbx_malloc(NULL, sizeof(cgroup_cpu_sample));
+        memset(sample, 0, sizeof(cgroup_cpu_sample));
+        map_set(cgroup_cpu_samples, unit, sample);
+    }
+
+    // the first sample only starts the interval
+    if (0 == sample->clock[metric]) {
+        if (FAIL == cgroup_read_cpu_usage(unit, metric, &sample->usage[metric], result))
+            return SYSINFO_RET_FAIL;
+
+        sample->clock[metric] = stats_clock_us();
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "No data yet, the CPU time of %s was first sampled", unit));
+        return SYSINFO_RET_FAIL;
+    }
+
+    if (FAIL == cgroup_read_cpu_usage(unit, metric, &usage, result))
+        return SYSINFO_RET_FAIL;
+
+    clock = stats_clock_us();
+
+    // the counters restart from zero when the cgroup is recreated
+    delta = usage >= sample->usage[metric] ? usage - sample->usage[metric] : usage;
+
+    if (1 > (cpu_num = sysconf(_SC_NPROCESSORS_ONLN)))
+        cpu_num = 1;
+
+    SET_DBL_RESULT(result, clock > sample->clock[metric] ?
+        (double) delta / 10 / (clock - sample->clock[metric]) / cpu_num : 0);
+
+    sample->usage[metric] = usage;
+    sample->clock[metric] = clock;
+
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * Pressure stall information
+ *
+ * The <resource>.pressure files of a cgroup hold a "some" and a "full" line,
+ * e.g. "some avg10=0.12 avg60=0.04 avg300=0.01 total=123456". Averages are
+ * percentages, totals are microseconds. The files are only available in the
+ * unified hierarchy, which systemd mounts at <cgroup_dir>/unified on hosts
+ * with a hybrid layout.
+ */
+static const char *cgroup_psi_resources[] = { "cpu", "memory", "io", NULL };
+static const char *cgroup_psi_lines[] = { "some", "full", NULL };
+static const char *cgroup_psi_fields[] = { "avg10", "avg60", "avg300", "total", NULL };
+
+/*
+ * cgroup_find_name returns the index of the given name in the given list or
+ * -1.
+ */
+static int cgroup_find_name(const char **names, const char *name)
+{
+    int i;
+
+    for (i = 0; NULL != names[i]; i++)
+        if (0 == strcmp(names[i], name))
+            return i;
+
+    return -1;
+}
+
+/*
+ * cgroup_read_pressure reads the pressure file of the given resource of the
+ * given unit. If result is NULL, failures are not reported.
+ */
+static char *cgroup_read_pressure(const char *unit, const char *resource, AGENT_RESULT *result)
+{
+    char            file[32], *buf;
+    size_t          bytes = 0;
+    zbx_uint64_t    start = stats_clock_us();
+
+    zbx_snprintf(file, sizeof(file), "%s.pressure", resource);
+    buf = cgroup_read_unit_file("unified", unit, file, &bytes, result);
+    stats_record_cgroup(start, bytes, NULL == buf);
+
+    return buf;
+}
+
+/*
+ * cgroup_next_psi_field returns the next "key=value" field of a pressure file
+ * line split at the '=' or NULL at the end of the line.
+ */
+static char *cgroup_next_psi_field(char **saveptr, char **value)
+{
+    char    *token, *eq;
+
+    while (NULL != (token = strtok_r(NULL, " ", saveptr))) {
+        if (NULL == (eq = strchr(token, '=')))
+            continue;
+
+        *eq = '\0';
+        *value = eq + 1;
+        return token;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_PSI                                               *
+ *                                                                            *
+ * Purpose: pressure stall information of a unit                              *
+ *                                                                            *
+ * Comments: averages are returned as percentages, totals in microseconds.    *
+ *                                                                            *
+ * Notes: https://www.kernel.org/doc/Documentation/accounting/psi.rst         *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_PSI(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    const char      *unit, *resource, *kind = "some", *field = "avg10", *param;
+    char            *cursor, *line, *token, *saveptr, *key, *value;
+    zbx_uint64_t    total;
+
+    if (NULL == (unit = cgroup_all_unit(request, 4, result)))
+        return SYSINFO_RET_FAIL;
+
+    resource = get_rparam(request, 1);
+    if (NULL == resource || -1 == cgroup_find_name(cgroup_psi_resources, resource)) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Invalid resource, expected cpu, memory or io"));
+        return SYSINFO_RET_FAIL;
+    }
+
+    if (NULL != (param = get_rparam(request, 2)) && '\0' != *param)
+        kind = param;
+
+    if (-1 == cgroup_find_name(cgroup_psi_lines, kind)) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Invalid line, expected some or full"));
+        return SYSINFO_RET_FAIL;
+    }
+
+    if (NULL != (param = get_rparam(request, 3)) && '\0' != *param)
+        field = param;
+
+    if (-1 == cgroup_find_name(cgroup_psi_fields, field)) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Invalid field, expected avg10, avg60, avg300 or total"));
+        return SYSINFO_RET_FAIL;
+    }
+
+    if (NULL == (cursor = cgroup_read_pressure(unit, resource, result)))
+        return SYSINFO_RET_FAIL;
+
+    while (NULL != (line = cgroup_next_line(&cursor))) {
+        if (NULL == (token = strtok_r(line, " ", &saveptr)) || 0 != strcmp(token, kind))
+            continue;
+
+        while (NULL != (key = cgroup_next_psi_field(&saveptr, &value))) {
+            if (0 != strcmp(key, field))
+                continue;
+
+            if (0 == strcmp(key, "total")) {
+                if (NULL == cgroup_decode_uint64(value, &total))
+                    break;
+
+                SET_UI64_RESULT(result, total);
+            } else {
+                SET_DBL_RESULT(result, atof(value));
+            }
+
+            return SYSINFO_RET_OK;
+        }
+    }
+
+    SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot find %s %s in %s.pressure file", kind, field, resource));
+    return SYSINFO_RET_FAIL;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_PSI_ALL                                           *
+ *                                                                            *
+ * Purpose: pressure stall information of all resources of a unit as JSON     *
+ *                                                                            *
+ * Comments: resources without a pressure file are left out.                  *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_PSI_ALL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    struct zbx_json j;
+    const char      *unit;
+    char            *cursor, *line, *token, *saveptr, *key, *value;
+    int             i, found = 0;
+
+    if (NULL == (unit = cgroup_all_unit(request, 1, result)))
+        return SYSINFO_RET_FAIL;
+
+    zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+
+    for (i = 0; NULL != cgroup_psi_resources[i]; i++) {
+        if (NULL == (cursor = cgroup_read_pressure(unit, cgroup_psi_resources[i], NULL)))
+            continue;
+
+        found++;
+        zbx_json_addobject(&j, cgroup_psi_resources[i]);
+        while (NULL != (line = cgroup_next_line(&cursor))) {
+            if (NULL == (token = strtok_r(line, " ", &saveptr)))
+                continue;
+
+            // values are copied as numbers, as formatted by the kernel
+            zbx_json_addobject(&j, token);
+            while (NULL != (key = cgroup_next_psi_field(&saveptr, &value)))
+                zbx_json_addstring(&j, key, value, ZBX_JSON_TYPE_INT);
+
+            zbx_json_close(&j);
+        }
+
+        zbx_json_close(&j);
+    }
+
+    if (0 == found) {
+        zbx_json_free(&j);
+        SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot open pressure files of unit %s", unit));
+        return SYSINFO_RET_FAIL;
+    }
+
+    zbx_json_close(&j);
+    SET_STR_RESULT(result, strdup(j.buffer));
+    zbx_json_free(&j);
+
+    return SYSINFO_RET_OK;
+}
+
+/*
+ * Top units of a slice
+ *
+ * The child cgroups of a slice are listed with a single getdents64 sweep of
+ * the slice directory and the stat file of each child is read relative to the
+ * directory with openat, without caching a descriptor per child. The top N
+ * values are kept in a bounded min-heap. CPU and I/O are counters, so their
+ * rates are computed from the values of the previous scan of the same slice
+ * by the same agent process. The first scan of their rates fails with no
+ * data.
+ */
+
+// most units returned
+#define CGROUP_TOP_MAX      100
+
+// most slices scanned per process. The least recently scanned slice is
+// dropped when exceeded.
+#define CGROUP_TOP_SCANS_MAX    64
+
+typedef enum {
+    CGROUP_TOP_CPU = 0,
+    CGROUP_TOP_MEMORY,
+    CGROUP_TOP_IO,
+    CGROUP_TOP_COUNT
+} cgroup_top_metric;
+
+static const char *cgroup_top_metrics[] = { "cpu", "memory", "io", NULL };
+
+// v1 hierarchies and stat files of each metric, and their v2 files
+static const char *cgroup_top_controllers[] = { "cpuacct", "memory", "blkio" };
+static const char *cgroup_top_v1_files[] = { "cpuacct.usage", "memory.usage_in_bytes", "blkio.throttle.io_service_bytes" };
+static const char *cgroup_top_v2_files[] = { "cpu.stat", "memory.current", "io.stat" };
+
+// a unit in the heap of top units
+typedef struct {
+    char    name[256];
+    double  value;
+} cgroup_top_unit;
+
+// the counters of a previous scan of a slice
+typedef struct {
+    Map             *counters;  // zbx_uint64_t counters keyed by child name
+    zbx_uint64_t    clock;      // microseconds
+} cgroup_top_scan;
+
+// cgroup_top_scan_clock returns the time of the given scan
+static zbx_uint64_t cgroup_top_scan_clock(void *value)
+{
+    return ((cgroup_top_scan *) value)->clock;
+}
+
+// previous scans keyed by slice cgroup and metric
+static Map  *cgroup_top_scans = NULL;
+
+static void cgroup_free_top_scan(void *value)
+{
+    cgroup_top_scan *scan = (cgroup_top_scan *) value;
+
+    map_free(scan->counters);
+    zbx_free(scan);
+}
+
+/*
+ * cgroup_top_push adds the given unit to the given min-heap of at most max
+ * units, unless the heap is full and the unit's value is below all others.
+ */
+static void cgroup_top_push(cgroup_top_unit *heap, int *n, int max, const char *name, double value)
+{
+    cgroup_top_unit unit;
+    int             i, child;
+
+    if (*n == max && value <= heap[0].value)
+        return;
+
+    zbx_strlcpy(unit.name, name, sizeof(unit.name));
+    unit.value = value;
+
+    // sift up a new unit or sift down a replaced root
+    if (*n < max) {
+        for (i = (*n)++; 0 < i && heap[(i - 1) / 2].value > value; i = (i - 1) / 2)
+            heap[i] = heap[(i - 1) / 2];
+    } else {
+        for (i = 0; (child = 2 * i + 1) < *n; i = child) {
+            if (child + 1 < *n && heap[child + 1].value < heap[child].value)
+                child++;
+
+            if (heap[child].value >= value)
+                break;
+
+            heap[i] = heap[child];
+        }
+    }
+
+    heap[i] = unit;
+}
+
+static int cgroup_top_compare(const void *a, const void *b)
+{
+    double  x = ((const cgroup_top_unit *) a)->value, y = ((const cgroup_top_unit *) b)->value;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * cgroup_top_value extracts the value of the given metric from the given
+ * stat file: CPU time in nanoseconds, memory in bytes or I/O in bytes read
+ * and written.
+ */
+static int cgroup_top_value(cgroup_top_metric metric, char *buf, zbx_uint64_t *value)
+{
+    char            *line, *token, *saveptr, *eq;
+    zbx_uint64_t    n;
+
+    if (CGROUP_TOP_MEMORY == metric || (CGROUP_TOP_CPU == metric && 1 == cgroup_version))
+        return NULL != cgroup_decode_uint64(buf, value) ? SUCCEED : FAIL;
+
+    if (1 == cgroup_version) {
+        cgroup_stat_parse(&cgroup_stats, buf);
+        return cgroup_stat_get(&cgroup_stats, "Total", value);
+    }
+
+    if (CGROUP_TOP_CPU == metric) {
+        cgroup_stat_parse(&cgroup_stats, buf);
+        if (FAIL == cgroup_stat_get(&cgroup_stats, "usage_usec", value))
+            return FAIL;
+
+        *value *= 1000;
+        return SUCCEED;
+    }
+
+    // io.stat lines: "8:0 rbytes=1459200 wbytes=314773504 rios=192 ..."
+    for (*value = 0; NULL != (line = cgroup_next_line(&buf)); ) {
+        for (strtok_r(line, " ", &saveptr); NULL != (token = strtok_r(NULL, " ", &saveptr)); ) {
+            if (NULL == (eq = strchr(token, '=')))
+                continue;
+
+            *eq++ = '\0';
+            if ((0 == strcmp(token, "rbytes") || 0 == strcmp(token, "wbytes")) && NULL != cgroup_decode_uint64(eq, &n))
+                *value += n;
+        }
+    }
+
+    return SUCCEED;
+}
+
+/*
+ * cgroup_top_sweep reads the given metric of every child cgroup of the given
+ * directory and pushes the children onto the given heap. Counters are stored
+ * in next and rated against prev, which is NULL for a first scan. Gauges are
+ * pushed as read if next is NULL. Returns the number of children read or -1
+ * with errno set.
+ */
+static int cgroup_top_sweep(
+    const char          *dir,
+    cgroup_top_metric   metric,
+    Map                 *prev,
+    Map                 *next,
+    zbx_uint64_t        elapsed_us,
+    cgroup_top_unit     *heap,
+    int                 *nheap,
+    int                 max
+) {
+    struct {
+        zbx_uint64_t    d_ino;
+        zbx_int64_t     d_off;
+        unsigned short  d_reclen;
+        unsigned char   d_type;
+        char            d_name[];
+    }                   *d;
+    char                dents[8192], file[MAX_STRING_LEN];
+    const char          *stat_file;
+    zbx_uint64_t        value, *counter, bytes = 0, start = stats_clock_us();
+    double              rate;
+    long                cpu_num;
+    ssize_t             len;
+    long                n, offset;
+    int                 dirfd, fd, count = 0;
+
+    if (-1 == (dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+        return -1;
+
+    if (1 > (cpu_num = sysconf(_SC_NPROCESSORS_ONLN)))
+        cpu_num = 1;
+
+    stat_file = 2 == cgroup_version ? cgroup_top_v2_files[metric] : cgroup_top_v1_files[metric];
+
+    while (0 < (n = syscall(SYS_getdents64, dirfd, dents, sizeof(dents)))) {
+        for (offset = 0; offset < n; offset += d->d_reclen) {
+            d = (void *) (dents + offset);
+
+            // child cgroups are the directories named after their unit
+            if (DT_DIR != d->d_type || NULL == strchr(d->d_name, '.') || '.' == *d->d_name)
+                continue;
+
+            zbx_snprintf(file, sizeof(file), "%s/%s", d->d_name, stat_file);
+            if (-1 == (fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC)))
+                continue;
+
+            if (0 <= (len = cgroup_read_fd(fd)) && SUCCEED == cgroup_top_value(metric, cgroup_buf, &value)) {
+                bytes += len;
+                count++;
+
+                if (NULL == next) {
+                    cgroup_top_push(heap, nheap, max, d->d_name, (double) value);
+                } else {
+                    if (NULL != prev && NULL != (counter = map_get(prev, d->d_name)) && *counter <= value && 0 < elapsed_us) {
+                        if (CGROUP_TOP_CPU == metric)
+                            rate = (double) (value - *counter) / 10 / elapsed_us / cpu_num;
+                        else
+                            rate = (double) (value - *counter) * 1000000 / elapsed_us;
+
+                        cgroup_top_push(heap, nheap, max, d->d_name, rate);
+                    }
+
+                    counter = zbx_malloc(NULL, sizeof(zbx_uint64_t));
+                    *counter = value;
+                    map_set(next, d->d_name, counter);
+                }
+            }
+
+            close(fd);
+        }
+    }
+
+    close(dirfd);
+    stats_record_cgroup(start, bytes, 0);
+
+    return count;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: SYSTEMD_CGROUP_TOP                                               *
+ *                                                                            *
+ * Purpose: the units of a slice with the highest CPU, memory or I/O usage    *
+ *          as JSON                                                           *
+ *                                                                            *
+ * Comments: CPU is returned in percent of all online CPUs, memory in bytes   *
+ *           and I/O in bytes read and written per second.                    *
+ *                                                                            *
+ ******************************************************************************/
+int     SYSTEMD_CGROUP_TOP(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+    struct zbx_json     j;
+    const char          *slice, *param;
+    char                cgroup[MAX_STRING_LEN], dir[MAX_STRING_LEN], key[MAX_STRING_LEN], value[64];
+    cgroup_top_unit     *heap = NULL;
+    cgroup_top_scan     *scan;
+    cgroup_top_metric   metric;
+    Map                 *next = NULL;
+    zbx_uint64_t        clock;
+    int                 i, max = 10, nheap = 0, cached;
+
+    if (NULL == (slice = cgroup_all_unit(request, 3, result)))
+        return SYSINFO_RET_FAIL;
+
+    if (NULL == (param = get_rparam(request, 1)) || -1 == (i = cgroup_find_name(cgroup_top_metrics, param))) {
+        SET_MSG_RESULT(result, zbx_strdup(NULL, "Invalid metric, expected cpu, memory or io"));
+        return SYSINFO_RET_FAIL;
+    }
+    metric = (cgroup_top_metric) i;
+
+    if (NULL != (param = get_rparam(request, 2)) && '\0' != *param) {
+        if (1 > (max = atoi(param)) || CGROUP_TOP_MAX < max) {
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Invalid number of units, expected 1 to %i", CGROUP_TOP_MAX));
+            return SYSINFO_RET_FAIL;
+        }
+    }
+
+    if (FAIL == cgroup_unit_path(slice, cgroup, sizeof(cgroup), &cached, result))
+        return SYSINFO_RET_FAIL;
+
+    if (2 == cgroup_version)
+        zbx_snprintf(dir, sizeof(dir), "%s%s", cgroup_dir, cgroup);
+    else if (CGROUP_TOP_CPU == metric && NULL != strchr(cpu_cgroup, ','))
+        zbx_snprintf(dir, sizeof(dir), "%scpu,cpuacct/%s", cgroup_dir, cgroup);
+    else
+        zbx_snprintf(dir, sizeof(dir), "%s%s/%s", cgroup_dir, cgroup_top_controllers[metric], cgroup);
+
+    heap = zbx_malloc(NULL, sizeof(cgroup_top_unit) * max);
+
+    if (CGROUP_TOP_MEMORY == metric) {
+        if (-1 == cgroup_top_sweep(dir, metric, NULL, NULL, 0, heap, &nheap, max))
+            goto fail;
+    } else {
+        if (NULL == cgroup_top_scans)
+            cgroup_top_scans = map_create(cgroup_free_top_scan);
+
+        zbx_snprintf(key, sizeof(key), "%s|%s", dir, cgroup_top_metrics[metric]);
+        if (NULL == (scan = map_get(cgroup_top_scans, key))) {
+            if (CGROUP_TOP_SCANS_MAX <= cgroup_top_scans->length)
+                cgroup_evict_oldest(cgroup_top_scans, cgroup_top_scan_clock);
+
+            // the first scan only starts the interval
+            scan = zbx_malloc(NULL, sizeof(cgroup_top_scan));
+            scan->counters = map_create(free);
+            map_set(cgroup_top_scans, key, scan);
+
+            if (-1 == cgroup_top_sweep(dir, metric, NULL, scan->counters, 0, heap, &nheap, max)) {
+                map_delete(cgroup_top_scans, key);
+                goto fail;
+            }
+
+            scan->clock = stats_clock_us();
+            SET_MSG_RESULT(result, zbx_dsprintf(NULL, "No data yet, the cgroup of %s was first scanned", slice));
+            zbx_free(heap);
+
+            return SYSINFO_RET_FAIL;
+        }
+
+        next = map_create(free);
+        clock = stats_clock_us();
+        if (-1 == cgroup_top_sweep(dir, metric, scan->counters, next, clock - scan->clock, heap, &nheap, max)) {
+            map_free(next);
+            map_delete(cgroup_top_scans, key);
+            goto fail;
+        }
+
+        // children that are gone are forgotten
+        map_free(scan->counters);
+        scan->counters = next;
+        scan->clock = clock;
+    }
+
+    qsort(heap, nheap, sizeof(cgroup_top_unit), cgroup_top_compare);
+
+    zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+    zbx_json_addarray(&j, "data");
+    for (i = 0; i < nheap; i++) {
+        zbx_json_addobject(&j, NULL);
+        zbx_json_addstring(&j, "unit", heap[i].name, ZBX_JSON_TYPE_STRING);
+        if (CGROUP_TOP_MEMORY == metric) {
+            zbx_json_adduint64(&j, "value", (zbx_uint64_t) heap[i].value);
+        } else {
+            zbx_snprintf(value, sizeof(value), "%.2f", heap[i].value);
+            zbx_json_addstring(&j, "value", value, ZBX_JSON_TYPE_INT);
+        }
+        zbx_json_close(&j);
+    }
+
+    zbx_json_close(&j);
+    SET_STR_RESULT(result, strdup(j.buffer));
+    zbx_json_free(&j);
+    zbx_free(heap);
+
+    return SYSINFO_RET_OK;
+
+fail:
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot scan cgroup directory: '%s': %s", dir, zbx_strerror(errno));
+    SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Cannot scan the cgroup of %s", slice));
+    zbx_free(heap);
+
+    return SYSINFO_RET_FAIL;
+}
+
+/*
+ * cgroup_sample_unit reads the CPU time in nanoseconds of the given unit and,
+ * on the unified hierarchy, its current memory usage for the shared metrics
+ * snapshot. Failures are not reported. Returns the SNAPSHOT_* flags of the
+ * values read.
+ */
+int cgroup_sample_unit(const char *unit, zbx_uint64_t *memory, zbx_uint64_t *cpu)
+{
+    char    cgroup[MAX_STRING_LEN];
+    int     cached, flags = 0;
+
+    // units without a cgroup are not resolved again for each value
+    if (NULL == cgroup_dir || FAIL == cgroup_unit_path(unit, cgroup, sizeof(cgroup), &cached, NULL))
+        return 0;
+
+    if (SUCCEED == cgroup_read_cpu_usage(unit, CGROUP_CPU_TOTAL, cpu, NULL))
+        flags |= SNAPSHOT_CPU;
+
+    if (2 == cgroup_version && SUCCEED == cgroup2_read_value(unit, "memory.current", NULL, memory, NULL))
+        flags |= SNAPSHOT_MEMORY;
+
+    return flags;
 }
@@ -3,30 +3,461 @@
 // global dbus connection
 DBusConnection *conn = NULL;
 
+// path of the private socket of systemd, e.g. /run/systemd/private. If set,
+// the module connects directly to systemd instead of via the system bus.
+char *dbus_private_socket = NULL;
+
+// non-zero if conn is a direct connection to systemd
+static int direct = 0;
+
+// process that opened conn. Agent pollers are forked from the process that
+// initialised the module, and must not share its connection.
+static pid_t conn_pid = 0;
+
+// number of connections opened by this process, and of connections replaced
+// because the bus disconnected or because they were inherited from the parent.
+// Counters copied from the parent are reset with its connection.
+static zbx_uint64_t connects = 0, disconnects = 0, inherited = 0;
+
+// end of the time budget of the current item request in milliseconds of the
+// monotonic clock or 0 if no request was started
+static zbx_uint64_t deadline = 0;
+
+/*
+ * dbus_clock_ms returns the current time of the monotonic clock in
+ * milliseconds.
+ */
+static zbx_uint64_t dbus_clock_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zbx_uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * dbus_start_deadline gives the current item request a time budget of the
+ * item timeout set by the host agent. All D-Bus calls made on behalf of the
+ * request share the budget until dbus_end_deadline is called.
+ */
+void dbus_start_deadline()
+{
+  deadline = dbus_clock_ms() + timeout;
+}
+
 /*
- * dbus_connect establishes a connection to the d-bus system bus.
+ * dbus_end_deadline ends the time budget of the current item request, so
+ * that calls made outside of a request each get the whole item timeout.
+ */
+void dbus_end_deadline()
+{
+  deadline = 0;
+}
+
+/*
+ * dbus_deadline_remaining returns the number of milliseconds left until the
+ * deadline of the current item request or 0 if it has passed.
+ */
+int dbus_deadline_remaining()
+{
+  zbx_uint64_t now = dbus_clock_ms();
+
+  if (0 == deadline)
+    return timeout;
+
+  return deadline > now ? (int) (deadline - now) : 0;
+}
+
+/*
+ * Circuit breaker
  *
- * Returns FAIL on error.
+ * While systemd or the bus do not respond, e.g. during a daemon-reload or if
+ * PID 1 is stuck, every call would block for the whole item timeout and the
+ * agent pollers would pile up. After dbus_breaker_threshold consecutive calls
+ * of a process failed without a reply, its breaker opens and all calls fail
+ * immediately. Once dbus_breaker_backoff seconds have passed, the breaker is
+ * half-open and lets the next call through as a probe. Other calls are
+ * rejected until the probe was answered. A reply closes the breaker, another
+ * failure opens it again for twice as long, up to DBUS_BREAKER_BACKOFF_MAX
+ * seconds.
+ *
+ * Error replies, e.g. for unknown units, show that systemd is responsive and
+ * are not counted as failures.
  */
-int dbus_connect()
+
+// consecutive failed calls that open the breaker. 0 disables the breaker.
+int dbus_breaker_threshold = 3;
+
+// seconds the breaker stays open when it opens first
+int dbus_breaker_backoff = 5;
+
+// most seconds the breaker stays open, unless dbus_breaker_backoff is longer
+#define DBUS_BREAKER_BACKOFF_MAX      300
+
+static const char *dbus_breaker_states[] = { "closed", "open", "half-open" };
+
+static struct {
+  dbus_breaker_state  state;
+  int                 failures;   // consecutive failed calls
+  int                 backoff;    // seconds the breaker stays open
+  zbx_uint64_t        until;      // end of the open state in milliseconds
+  zbx_uint64_t        opened;     // number of times the breaker opened
+  zbx_uint64_t        rejected;   // number of calls failed immediately
+  int                 probing;    // non-zero while the probe is in flight
+} breaker = { DBUS_BREAKER_CLOSED, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * dbus_breaker_get_state returns the state of the breaker as seen by the next
+ * call. An open breaker whose backoff has passed lets the next call through.
+ */
+static dbus_breaker_state dbus_breaker_get_state()
 {
-  if (NULL != conn)
-    return SUCCEED;
+  if (DBUS_BREAKER_OPEN == breaker.state && dbus_clock_ms() >= breaker.until)
+    return DBUS_BREAKER_HALF_OPEN;
 
-  DBusError err;  
-  dbus_error_init(&err);
+  return breaker.state;
+}
 
-  // connect to system bus
-  conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
-  if (dbus_error_is_set(&err)) {
-    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "failed to get d-bus session: %s",
-      err.message);
+/*
+ * dbus_breaker_allow returns non-zero if a call may be made, in which case
+ * its outcome must be recorded with dbus_breaker_record, or the call must be
+ * given up with dbus_breaker_abandon. The first call after the backoff is a
+ * probe.
+ */
+static int dbus_breaker_allow()
+{
+  if (DBUS_BREAKER_CLOSED == breaker.state)
+    return 1;
+
+  if (breaker.probing || (DBUS_BREAKER_OPEN == breaker.state && dbus_clock_ms() < breaker.until)) {
+    breaker.rejected++;
+    return 0;
+  }
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "probing systemd after %is", breaker.backoff);
+  breaker.state = DBUS_BREAKER_HALF_OPEN;
+  breaker.probing = 1;
+
+  return 1;
+}
+
+/*
+ * dbus_breaker_abandon gives up a call that was allowed but not answered,
+ * e.g. because it could not be sent or was cancelled at the deadline. If it
+ * was the probe, the next call probes again.
+ */
+static void dbus_breaker_abandon()
+{
+  breaker.probing = 0;
+}
+
+/*
+ * dbus_breaker_record records the outcome of a call. A call failed if it was
+ * not answered, either by a reply or by an error from the remote service.
+ */
+static void dbus_breaker_record(int failed)
+{
+  breaker.probing = 0;
+  if (0 == dbus_breaker_threshold)
+    return;
+
+  if (!failed) {
+    if (DBUS_BREAKER_CLOSED != breaker.state)
+      zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "systemd is responding again, resuming D-Bus calls");
+
+    breaker.state = DBUS_BREAKER_CLOSED;
+    breaker.failures = 0;
+    breaker.backoff = 0;
+    return;
+  }
+
+  breaker.failures++;
+  if (DBUS_BREAKER_HALF_OPEN == breaker.state)
+    breaker.backoff = MIN(breaker.backoff * 2, MAX(DBUS_BREAKER_BACKOFF_MAX, dbus_breaker_backoff));
+  else if (DBUS_BREAKER_CLOSED == breaker.state && breaker.failures >= dbus_breaker_threshold)
+    breaker.backoff = dbus_breaker_backoff;
+  else
+    return;
+
+  breaker.state = DBUS_BREAKER_OPEN;
+  breaker.until = dbus_clock_ms() + (zbx_uint64_t) breaker.backoff * 1000;
+  breaker.opened++;
+
+  zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "systemd is not responding after %i failed calls, suspending D-Bus calls for %is",
+    breaker.failures, breaker.backoff);
+}
+
+// errors which show that the remote service did not answer
+static const char *dbus_unanswered_errors[] = {
+  DBUS_ERROR_NO_REPLY, DBUS_ERROR_TIMEOUT, DBUS_ERROR_TIMED_OUT,
+  DBUS_ERROR_DISCONNECTED, DBUS_ERROR_NO_SERVER, DBUS_ERROR_SERVICE_UNKNOWN,
+  DBUS_ERROR_NAME_HAS_NO_OWNER,
+  NULL
+};
+
+/*
+ * dbus_reply_failed returns non-zero if the given reply, as returned by
+ * dbus_pending_call_steal_reply, shows that the remote service did not answer.
+ */
+static int dbus_reply_failed(DBusMessage *msg)
+{
+  if (NULL == msg)
+    return 1;
+
+  if (DBUS_MESSAGE_TYPE_ERROR != dbus_message_get_type(msg))
+    return 0;
+
+  for (int i = 0; dbus_unanswered_errors[i]; i++)
+    if (dbus_message_is_error(msg, dbus_unanswered_errors[i]))
+      return 1;
+
+  return 0;
+}
+
+/*
+ * dbus_error_is_reply returns non-zero if the given error, as set by
+ * dbus_exchange_message_err, was answered by the remote service. Calls that
+ * timed out, were not sent or were rejected by the circuit breaker, which uses
+ * DBUS_ERROR_FAILED, may succeed when tried again.
+ */
+int dbus_error_is_reply(const DBusError *err)
+{
+  if (!dbus_error_is_set(err) || dbus_error_has_name(err, DBUS_ERROR_FAILED))
+    return 0;
+
+  for (int i = 0; dbus_unanswered_errors[i]; i++)
+    if (dbus_error_has_name(err, dbus_unanswered_errors[i]))
+      return 0;
+
+  return 1;
+}
+
+/*
+ * dbus_connect_error returns a new message for an item request that failed
+ * because dbus_connect failed.
+ */
+char *dbus_connect_error()
+{
+  zbx_uint64_t now = dbus_clock_ms();
+
+  if (DBUS_BREAKER_OPEN == dbus_breaker_get_state())
+    return zbx_dsprintf(NULL, "systemd is not responding, D-Bus calls are suspended for %is",
+      (int) ((breaker.until - now + 999) / 1000));
+
+  return zbx_strdup(NULL, "Failed to connect to D-Bus.");
+}
+
+/*
+ * dbus_breaker_json appends the state of the breaker to the given json
+ * document.
+ */
+void dbus_breaker_json(struct zbx_json *j)
+{
+  zbx_uint64_t now = dbus_clock_ms();
+
+  zbx_json_addobject(j, "breaker");
+  zbx_json_addstring(j, "state", dbus_breaker_states[dbus_breaker_get_state()], ZBX_JSON_TYPE_STRING);
+  zbx_json_adduint64(j, "failures", breaker.failures);
+  zbx_json_adduint64(j, "opened", breaker.opened);
+  zbx_json_adduint64(j, "rejected", breaker.rejected);
+  zbx_json_adduint64(j, "retry_ms", DBUS_BREAKER_OPEN == dbus_breaker_get_state() ? breaker.until - now : 0);
+  zbx_json_close(j);
+}
+
+// systemd.breaker[<state|failures|opened|rejected|retry>]
+int SYSTEMD_BREAKER(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  const char    *param;
+  zbx_uint64_t  now = dbus_clock_ms();
+
+  if (1 < request->nparam) {
+    SET_MSG_RESULT(result, strdup("Invalid number of parameters."));
+    return SYSINFO_RET_FAIL;
+  }
+
+  param = get_rparam(request, 0);
+  if (NULL == param || '\0' == *param || 0 == strcmp(param, "state"))
+    SET_UI64_RESULT(result, dbus_breaker_get_state());
+  else if (0 == strcmp(param, "failures"))
+    SET_UI64_RESULT(result, breaker.failures);
+  else if (0 == strcmp(param, "opened"))
+    SET_UI64_RESULT(result, breaker.opened);
+  else if (0 == strcmp(param, "rejected"))
+    SET_UI64_RESULT(result, breaker.rejected);
+  else if (0 == strcmp(param, "retry"))
+    SET_DBL_RESULT(result, DBUS_BREAKER_OPEN == dbus_breaker_get_state() ?
+      (double) (breaker.until - now) / 1000 : 0);
+  else {
+    SET_MSG_RESULT(result, zbx_dsprintf(NULL, "Unsupported param: %s", param));
+    return SYSINFO_RET_FAIL;
+  }
+
+  return SYSINFO_RET_OK;
+}
+
+/*
+ * dbus_disconnect closes the connection of this process. A connection
+ * inherited from the parent process is abandoned instead, as closing it would
+ * disturb the parent.
+ */
+void dbus_disconnect()
+{
+  if (NULL == conn)
+    return;
+
+  if (conn_pid == getpid()) {
+    dbus_connection_close(conn);
+    dbus_connection_unref(conn);
+  }
+
+  conn = NULL;
+  conn_pid = 0;
+  direct = 0;
+}
+
+/*
+ * dbus_is_owned returns non-zero if conn is open, was opened by this process
+ * and has not seen a hang up, so that signals may be matched and read on it.
+ * Unlike dbus_connect, it never connects.
+ */
+int dbus_is_owned()
+{
+  return NULL != conn && conn_pid == getpid() && dbus_connection_get_is_connected(conn);
+}
+
+/*
+ * dbus_is_connected returns non-zero if conn was opened by this process and is
+ * still connected. Reading without blocking lets libdbus notice a hang up of
+ * the bus before the next call is sent.
+ */
+static int dbus_is_connected()
+{
+  if (conn_pid != getpid()) {
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "replacing the d-bus connection of process %i",
+      (int) conn_pid);
+    connects = disconnects = 0;
+    inherited++;
+    return 0;
+  }
+
+  if (!dbus_connection_read_write(conn, 0) || !dbus_connection_get_is_connected(conn)) {
+    zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "disconnected from d-bus, reconnecting");
+    disconnects++;
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * dbus_connection_json appends the connection counters of this process to the
+ * given json document.
+ */
+void dbus_connection_json(struct zbx_json *j)
+{
+  zbx_json_addobject(j, "connection");
+  zbx_json_addstring(j, "connected", NULL != conn && conn_pid == getpid() &&
+    dbus_connection_get_is_connected(conn) ? "true" : "false", ZBX_JSON_TYPE_INT);
+  zbx_json_addstring(j, "direct", direct ? "true" : "false", ZBX_JSON_TYPE_INT);
+  zbx_json_adduint64(j, "connects", connects);
+  zbx_json_adduint64(j, "reconnects", 0 == connects ? 0 : connects - 1);
+  zbx_json_adduint64(j, "disconnects", disconnects);
+  zbx_json_adduint64(j, "inherited", inherited);
+  zbx_json_close(j);
+}
+
+/*
+ * dbus_connect_direct opens a peer to peer connection to the private socket of
+ * systemd, as systemctl does when run as root. Calls skip the round trips
+ * through dbus-daemon, and systemd sends its signals to all direct connections
+ * without match rules.
+ *
+ * Returns NULL if the socket cannot be used, e.g. because the agent does not
+ * run as root, in which case the system bus should be used.
+ */
+static DBusConnection *dbus_connect_direct()
+{
+  static int      warned = 0;
+  DBusConnection  *c = NULL;
+  DBusError       err;
+  char            address[MAX_STRING_LEN];
+
+  dbus_error_init(&err);
+  zbx_snprintf(address, sizeof(address), "unix:path=%s", dbus_private_socket);
+  if (NULL == (c = dbus_connection_open_private(address, &err))) {
+    zabbix_log(warned ? LOG_LEVEL_DEBUG : LOG_LEVEL_WARNING,
+      LOG_PREFIX "failed to connect to %s, using the system bus: %s", dbus_private_socket, err.message);
     dbus_error_free(&err);
+    warned = 1;
+    return NULL;
+  }
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "connected to systemd at %s", dbus_private_socket);
+
+  return c;
+}
+
+/*
+ * dbus_connect establishes a connection to the d-bus system bus, or directly
+ * to systemd if dbus_private_socket is set and usable.
+ *
+ * Item handlers call dbus_connect before any other D-Bus call. While the
+ * circuit breaker is open, it fails immediately and dbus_connect_error
+ * explains why.
+ *
+ * Each process opens its own private connection. If the bus disconnected, e.g.
+ * because dbus-daemon restarted, or the connection was inherited from the
+ * parent process, a new connection is opened. Signal subscriptions and data
+ * cached by signals of the old connection are reset, as signals may have been
+ * missed.
+ *
+ * Returns FAIL on error.
+ */
+int dbus_connect()
+{
+  DBusError err;
+
+  if (DBUS_BREAKER_OPEN == dbus_breaker_get_state()) {
+    breaker.rejected++;
     return FAIL;
   }
 
-  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "connected to d-bus with unique name: %s",
-    dbus_bus_get_unique_name(conn));
+  if (NULL != conn) {
+    if (dbus_is_connected())
+      return SUCCEED;
+
+    dbus_disconnect();
+    systemd_reset();
+    cache_reset();
+    cgroup_reset();
+  }
+
+  if (NULL != dbus_private_socket && '\0' != *dbus_private_socket &&
+      NULL != (conn = dbus_connect_direct())) {
+    direct = 1;
+  } else {
+    dbus_error_init(&err);
+
+    // connect to system bus
+    conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+    if (dbus_error_is_set(&err)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "failed to get d-bus session: %s",
+        err.message);
+      dbus_error_free(&err);
+      conn = NULL;
+      return FAIL;
+    }
+
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "connected to d-bus with unique name: %s",
+      dbus_bus_get_unique_name(conn));
+  }
+
+  conn_pid = getpid();
+  connects++;
+
+  // signals are dispatched by dbus_dispatch_signals. Don't let libdbus exit
+  // the agent when it dispatches a disconnect.
+  dbus_connection_set_exit_on_disconnect(conn, FALSE);
 
   // TODO: check for SYSTEMD_SERVICE?
   
@@ -75,23 +506,66 @@ int dbus_message_iter_next_n(DBusMessageIter *iter, int n)
  * message or NULL if an error occurs.
  */
 DBusMessage *dbus_exchange_message(DBusMessage *msg) {
+  DBusError err;
+  dbus_error_init(&err);
+
+  if (NULL == (msg = dbus_exchange_message_err(msg, &err))) {
+    if (dbus_error_is_set(&err)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "%s: %s", err.name, err.message);
+      dbus_error_free(&err);
+    }
+  }
+
+  return msg;
+}
+
+/*
+ * dbus_exchange_message_err is dbus_exchange_message for callers which handle
+ * error replies themselves. If the remote service returns an error, the error
+ * is copied to err without being logged and NULL is returned.
+ */
+DBusMessage *dbus_exchange_message_err(DBusMessage *msg, DBusError *err) {
   DBusPendingCall *pending = NULL;
+  zbx_uint64_t    start = stats_clock_us();
+  int             remaining = 0, method = -1;
 
   if (NULL == msg) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message is null");
+    return NULL;
+  }
+
+  method = stats_method(dbus_message_get_member(msg));
+
+  // the call may only use what is left of the budget of the item request
+  if (0 == (remaining = dbus_deadline_remaining())) {
+    dbus_set_error(err, DBUS_ERROR_TIMEOUT, "item timeout exceeded before calling %s",
+      dbus_message_get_member(msg));
+    stats_record_method(method, start, 1);
     dbus_message_unref(msg);
     return NULL;
   }
-  
+
+  if (!dbus_breaker_allow()) {
+    dbus_set_error(err, DBUS_ERROR_FAILED, "systemd is not responding, %s was not called",
+      dbus_message_get_member(msg));
+    stats_record_method(method, start, 1);
+    dbus_message_unref(msg);
+    return NULL;
+  }
+
   // send message
-  if (!dbus_connection_send_with_reply (conn, msg, &pending, timeout)) {
+  if (!dbus_connection_send_with_reply (conn, msg, &pending, remaining)) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom sending message");
+    dbus_breaker_abandon();
+    stats_record_method(method, start, 1);
     dbus_message_unref(msg);
     return NULL;
   }
   
   if (NULL == pending) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "pending message is null");
+    dbus_breaker_abandon();
+    stats_record_method(method, start, 1);
     dbus_message_unref(msg);
     return NULL;
   }
@@ -102,35 +576,226 @@ DBusMessage *dbus_exchange_message(DBusMessage *msg) {
   // get reply
   dbus_pending_call_block(pending);
   msg = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+  dbus_breaker_record(dbus_reply_failed(msg));
   if (NULL == msg) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "returned message is null");
-    dbus_message_unref(msg);
+    stats_record_method(method, start, 1);
     return NULL;
   }
-  dbus_pending_call_unref(pending);
 
   // check for errors
-  if (dbus_check_error(msg)){
-      dbus_message_unref(msg);
-      return NULL;
+  if (dbus_set_error_from_message(err, msg)) {
+    stats_record_method(method, start, 1);
+    dbus_message_unref(msg);
+    return NULL;
   }
 
+  stats_record_method(method, start, 0);
+
+  // handle any signals received while waiting
+  dbus_dispatch_signals();
+
   return msg;
 }
 
 /*
- * dbus_get_property returns a pointer to an iterator containing the values of
- * the given property or NULL if an error occurs.
+ * dbus_add_signal_match asks the bus to route signals matching the given rule
+ * to this connection. Matched signals are passed to any filters added with
+ * dbus_connection_add_filter when dbus_dispatch_signals is called. Direct
+ * connections receive all signals of systemd without match rules.
+ *
+ * Returns FAIL on error.
  */
-DBusMessageIter* dbus_get_property(
-  const char *service,
-  const char *path,
-  const char *interface,
-  const char *property
+int dbus_add_signal_match(const char *rule)
+{
+  DBusError err;
+  dbus_error_init(&err);
+
+  if (direct)
+    return SUCCEED;
+
+  if (!dbus_is_owned())
+    return FAIL;
+
+  dbus_bus_add_match(conn, rule, &err);
+  if (dbus_error_is_set(&err)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "failed to add match rule \"%s\": %s",
+      rule, err.message);
+    dbus_error_free(&err);
+    return FAIL;
+  }
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "added match rule: %s", rule);
+
+  return SUCCEED;
+}
+
+/*
+ * dbus_remove_signal_match asks the bus to stop routing signals matching the
+ * given rule to this connection. It does not wait for a reply, so it may be
+ * called from a connection filter.
+ */
+void dbus_remove_signal_match(const char *rule)
+{
+  if (direct || NULL == conn)
+    return;
+
+  dbus_bus_remove_match(conn, rule, NULL);
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "removed match rule: %s", rule);
+}
+
+/*
+ * dbus_dispatch_signals passes all signals that have already been received on
+ * the connection to the connection filters, without blocking.
+ */
+void dbus_dispatch_signals()
+{
+  if (!dbus_is_owned())
+    return;
+
+  dbus_connection_read_write(conn, 0);
+  while (DBUS_DISPATCH_DATA_REMAINS == dbus_connection_dispatch(conn))
+    ;
+}
+
+/*
+ * dbus_exchange_pipelined sends n method calls, created on demand by the given
+ * request function, and passes each reply to the given handler in the order
+ * the calls were created.
+ *
+ * Unlike dbus_exchange_message, it does not wait for a reply before sending
+ * the next call. Up to DBUS_PIPELINE_WINDOW calls are kept in flight, so the
+ * total latency is bound by the throughput of the remote service instead of
+ * n times the bus round trip.
+ *
+ * The handler receives NULL for calls that could not be created or returned
+ * an error. Replies are unref'd once the handler returns.
+ *
+ * All calls share the deadline of the item request. Once it has passed, no
+ * more calls are sent, calls still in flight are cancelled and their handlers
+ * are not called, so callers can return the partial results gathered so far.
+ *
+ * Returns the number of calls passed to the handler, which is less than n if
+ * the deadline passed.
+ */
+int dbus_exchange_pipelined(
+  int                   n,
+  dbus_request_func     request,
+  dbus_reply_func       handler,
+  void                  *data
+) {
+  DBusPendingCall *window[DBUS_PIPELINE_WINDOW];
+  DBusPendingCall *pending = NULL;
+  DBusMessage     *msg = NULL;
+  zbx_uint64_t    started[DBUS_PIPELINE_WINDOW];
+  int             methods[DBUS_PIPELINE_WINDOW];
+  int             sent = 0, done = 0, remaining = 0, slot = 0;
+
+  while (done < n) {
+    // fill the window with new calls, while there is time left
+    while (sent < n && DBUS_PIPELINE_WINDOW > sent - done &&
+           0 < (remaining = dbus_deadline_remaining()) && dbus_breaker_allow()) {
+      pending = NULL;
+      slot = sent % DBUS_PIPELINE_WINDOW;
+      started[slot] = stats_clock_us();
+      methods[slot] = -1;
+      if (NULL != (msg = request(sent, data))) {
+        methods[slot] = stats_method(dbus_message_get_member(msg));
+        if (!dbus_connection_send_with_reply(conn, msg, &pending, remaining))
+          zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom sending message");
+        dbus_message_unref(msg);
+      }
+
+      if (NULL == pending)
+        dbus_breaker_abandon();
+
+      window[slot] = pending;
+      sent++;
+    }
+
+    // deadline passed before the next call was sent
+    if (done == sent)
+      break;
+
+    dbus_connection_flush(conn);
+
+    // collect the oldest reply
+    msg = NULL;
+    slot = done % DBUS_PIPELINE_WINDOW;
+    if (NULL != (pending = window[slot])) {
+      if (0 == dbus_deadline_remaining() && !dbus_pending_call_get_completed(pending))
+        break;
+
+      dbus_pending_call_block(pending);
+      msg = dbus_pending_call_steal_reply(pending);
+
+      dbus_breaker_record(dbus_reply_failed(msg));
+
+      // calls timed out by the deadline are cancelled below
+      if (NULL != msg && 0 == dbus_deadline_remaining() &&
+          dbus_message_is_error(msg, DBUS_ERROR_NO_REPLY)) {
+        dbus_message_unref(msg);
+        break;
+      }
+
+      dbus_pending_call_unref(pending);
+      window[slot] = NULL;
+
+      // dbus_check_error unrefs error messages
+      if (NULL != msg && FAIL == dbus_check_error(msg))
+        msg = NULL;
+    }
+
+    stats_record_method(methods[slot], started[slot], NULL == msg);
+
+    handler(done, msg, data);
+    if (NULL != msg)
+      dbus_message_unref(msg);
+
+    done++;
+  }
+
+  // cancel calls still in flight
+  for (int i = done; i < sent; i++) {
+    slot = i % DBUS_PIPELINE_WINDOW;
+    stats_record_method(methods[slot], started[slot], 1);
+    if (NULL != (pending = window[slot])) {
+      dbus_pending_call_cancel(pending);
+      dbus_pending_call_unref(pending);
+      dbus_breaker_abandon();
+    }
+  }
+
+  if (done < n)
+    zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "%s after %i of %i calls",
+      DBUS_BREAKER_OPEN == breaker.state ? "systemd is not responding" : "item timeout exceeded", done, n);
+
+  return done;
+}
+
+/*
+ * dbus_get_property fills the given handle, usually on the stack of the
+ * caller, with the value of the given property. The handle owns a reference to
+ * the reply that its value iterator points into, and must be released with
+ * dbus_property_release. On failure the handle is left empty.
+ *
+ * If the property cache is enabled, cached values are returned without a
+ * round trip.
+ *
+ * Returns FAIL on error.
+ */
+int dbus_get_property(
+  dbus_property *prop,
+  const char    *service,
+  const char    *path,
+  const char    *interface,
+  const char    *property
 ) {
   DBusMessage     *msg = NULL;
   DBusMessageIter args;
-  DBusMessageIter *iter = NULL;
+
+  prop->msg = NULL;
 
   zabbix_log(LOG_LEVEL_DEBUG, 
                     LOG_PREFIX "getting property:\n"
@@ -143,6 +808,9 @@ DBusMessageIter* dbus_get_property(
                     interface,
                     property);
 
+  if (SUCCEED == cache_get_property(prop, service, path, interface, property))
+    return SUCCEED;
+
   // create method call
   msg = dbus_message_new_method_call(
     service,
@@ -152,49 +820,82 @@ DBusMessageIter* dbus_get_property(
   
   if (NULL == msg) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message is null");
-    return NULL;
+    return FAIL;
   }
 
   dbus_message_iter_init_append(msg, &args);
   if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &interface)){
     dbus_message_unref(msg);
-    return NULL;
+    return FAIL;
   }
 
   if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &property)){
     dbus_message_unref(msg);
-    return NULL;
+    return FAIL;
   }
 
   if (NULL == (msg = dbus_exchange_message(msg))){
-    dbus_message_unref(msg);
-    return NULL;
+    return FAIL;
   }
 
   // check type
   if (!dbus_message_iter_init(msg, &args)) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message has no arguments");
-    return NULL;
+    dbus_message_unref(msg);
+    return FAIL;
   }
   
   if (DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&args)) {
     zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "argument is not a variant");
-    return NULL;
+    dbus_message_unref(msg);
+    return FAIL;
   }
   
-  // return value iterator
-  iter = zbx_malloc(iter, sizeof(DBusMessageIter));
-  dbus_message_iter_recurse(&args, iter);
-  dbus_message_unref(msg);
+  // the handle takes over the reference to the reply
+  dbus_message_iter_recurse(&args, &prop->value);
+  prop->msg = msg;
+  cache_put_property(service, path, interface, property, msg, &prop->value);
 
-  return iter;
+  return SUCCEED;
 }
 
 /*
- * convert DBUS_TYPE_BOOLEAN to yes/no string
+ * dbus_property_release drops the reply held by the given property handle.
+ * Releasing an empty or already released handle does nothing.
  */
-const char* yes_no(char* b) {
-  return b ? "yes" : "no";
+void dbus_property_release(dbus_property *prop)
+{
+  if (NULL == prop->msg)
+    return;
+
+  dbus_message_unref(prop->msg);
+  prop->msg = NULL;
+}
+
+/*
+ * dbus_iter_string fills the given buffer with the string representation of
+ * the basic value at the given iterator.
+ *
+ * Returns FAIL if the value is not a string or boolean.
+ */
+static int dbus_iter_string(char *s, const size_t n, DBusMessageIter *iter)
+{
+  DBusBasicValue  value;
+
+  switch (dbus_message_iter_get_arg_type(iter)) {
+  case DBUS_TYPE_STRING:
+  case DBUS_TYPE_OBJECT_PATH:
+    dbus_message_iter_get_basic(iter, &value);
+    zbx_strlcpy(s, value.str, n);
+    return SUCCEED;
+
+  case DBUS_TYPE_BOOLEAN:
+    dbus_message_iter_get_basic(iter, &value);
+    zbx_strlcpy(s, value.bool_val ? "yes" : "no", n);
+    return SUCCEED;
+  }
+
+  return FAIL;
 }
 
 /*
@@ -209,101 +910,351 @@ int dbus_get_property_string(
   const char    *interface,
   const char    *property
 ) {
-  DBusMessageIter *iter = NULL;
-  char            *value = NULL;
-  int             type = 0;
+  dbus_property prop;
+  int           res = FAIL;
 
-  iter = dbus_get_property(
-                      service,
-                      path,
-                      interface,
-                      property);
-  
-  if (NULL == iter){
-    zbx_free(iter);
+  if (FAIL == dbus_get_property(&prop, service, path, interface, property))
     return FAIL;
+
+  res = dbus_iter_string(s, n, &prop.value);
+  dbus_property_release(&prop);
+
+  return res;
+}
+
+/*
+ * dbus_new_get_all_message returns a new call to
+ * org.freedesktop.DBus.Properties.GetAll for the given interface or NULL if an
+ * error occurs.
+ */
+DBusMessage *dbus_new_get_all_message(
+  const char *service,
+  const char *path,
+  const char *interface
+) {
+  DBusMessage     *msg = NULL;
+  DBusMessageIter args;
+
+  zabbix_log(LOG_LEVEL_DEBUG, 
+                    LOG_PREFIX "getting all properties:\n"
+                    "\tservice: %s\n"
+                    "\tobject path: %s\n"
+                    "\tinterface: %s",
+                    service,
+                    path,
+                    interface);
+
+  msg = dbus_message_new_method_call(
+    service,
+    path,
+    DBUS_PROPERTIES_INTERFACE,
+    "GetAll");
+
+  if (NULL == msg) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message is null");
+    return NULL;
   }
 
-  type = dbus_message_iter_get_arg_type(iter);
+  dbus_message_iter_init_append(msg, &args);
+  if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &interface)){
+    dbus_message_unref(msg);
+    return NULL;
+  }
+
+  return msg;
+}
+
+/*
+ * dbus_get_all_properties returns the reply message of a call to
+ * org.freedesktop.DBus.Properties.GetAll for the given interface or NULL if an
+ * error occurs. The reply contains a single a{sv} dictionary.
+ *
+ * It is the callers responsibility to unref the returned message.
+ */
+DBusMessage *dbus_get_all_properties(
+  const char *service,
+  const char *path,
+  const char *interface
+) {
+  DBusMessage *msg = NULL;
+
+  if (NULL == (msg = dbus_new_get_all_message(service, path, interface)))
+    return NULL;
+
+  return dbus_exchange_message(msg);
+}
+
+/*
+ * dbus_properties_json decodes the a{sv} dictionary in the given GetAll reply
+ * in a single pass and appends the value of each mapped property as a key/val
+ * pair to the given discovery json document. Pairs are appended in the order
+ * of the map, which must be terminated by a NULL entry.
+ *
+ * Empty values and properties missing from the reply are omitted.
+ */
+int dbus_properties_json(
+              struct zbx_json         *j,
+              DBusMessage             *msg,
+              const dbus_property_map *map
+) {
+  DBusMessageIter args, arr, entry, values[DBUS_PROPERTY_MAP_MAX];
+  const char      *name = NULL;
+  char            buf[1024];
+  int             i, n, found[DBUS_PROPERTY_MAP_MAX];
+
+  for (n = 0; map[n].key; n++);
+
+  if (DBUS_PROPERTY_MAP_MAX < n) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "property map too long: %i", n);
+    return FAIL;
+  }
+
+  memset(found, 0, sizeof(found));
+
+  if (!dbus_message_iter_init(msg, &args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message has no arguments");
+    return FAIL;
+  }
+
+  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "argument is not an array");
+    return FAIL;
+  }
+
+  // index the values of mapped properties
+  dbus_message_iter_recurse(&args, &arr);
+  while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&arr)) {
+    dbus_message_iter_recurse(&arr, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    dbus_message_iter_next(&entry);
+
+    for (i = 0; i < n; i++) {
+      if (0 == strcmp(name, map[i].property)) {
+        dbus_message_iter_recurse(&entry, &values[i]);
+        found[i] = 1;
+        break;
+      }
+    }
+
+    dbus_message_iter_next(&arr);
+  }
+
+  // append values in map order
+  for (i = 0; i < n; i++) {
+    if (!found[i])
+      continue;
+
+    buf[0] = '\0';
+    if (SUCCEED == dbus_iter_string(buf, sizeof(buf), &values[i]) && '\0' != buf[0])
+      zbx_json_addstring(j, map[i].key, buf, ZBX_JSON_TYPE_STRING);
+  }
+
+  return SUCCEED;
+}
+
+/*
+ * dbus_get_properties_json appends the values of all mapped properties of the
+ * given object interface to the given discovery json document, using a single
+ * GetAll call instead of one Get call per property.
+ */
+int dbus_get_properties_json(
+              struct zbx_json         *j,
+              const char              *path,
+              const char              *interface,
+              const dbus_property_map *map
+) {
+  DBusMessage *msg = NULL;
+  int         res = FAIL;
+
+  if (NULL == (msg = dbus_get_all_properties(SYSTEMD_SERVICE_NAME, path, interface)))
+    return FAIL;
+
+  res = dbus_properties_json(j, msg, map);
+  dbus_message_unref(msg);
+
+  return res;
+}
+
+/*
+ * dbus_iter_json appends the value at the given iterator to the given json
+ * document as a typed json value. Arrays and structs are appended as json
+ * arrays and dictionaries as json objects, so complex properties such as
+ * Service.ExecStart are preserved.
+ *
+ * The name may be NULL when appending to an array.
+ */
+static void dbus_iter_json(
+              struct zbx_json *j,
+              const char      *name,
+              DBusMessageIter *iter
+) {
+  DBusMessageIter sub, entry;
+  DBusBasicValue  value;
+  char            buf[64], key[1024];
+  int             type = dbus_message_iter_get_arg_type(iter);
+
   switch (type) {
+  case DBUS_TYPE_VARIANT:
+    dbus_message_iter_recurse(iter, &sub);
+    dbus_iter_json(j, name, &sub);
+    return;
+
+  case DBUS_TYPE_ARRAY:
+    dbus_message_iter_recurse(iter, &sub);
+    if (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_element_type(iter)) {
+      zbx_json_addobject(j, name);
+      while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&sub)) {
+        dbus_message_iter_recurse(&sub, &entry);
+        key[0] = '\0';
+        dbus_iter_string(key, sizeof(key), &entry);
+        dbus_message_iter_next(&entry);
+        dbus_iter_json(j, key, &entry);
+        dbus_message_iter_next(&sub);
+      }
+      zbx_json_close(j);
+      return;
+    }
+
+    zbx_json_addarray(j, name);
+    while (DBUS_TYPE_INVALID != dbus_message_iter_get_arg_type(&sub)) {
+      dbus_iter_json(j, NULL, &sub);
+      dbus_message_iter_next(&sub);
+    }
+    zbx_json_close(j);
+    return;
+
+  case DBUS_TYPE_STRUCT:
+    dbus_message_iter_recurse(iter, &sub);
+    zbx_json_addarray(j, name);
+    while (DBUS_TYPE_INVALID != dbus_message_iter_get_arg_type(&sub)) {
+      dbus_iter_json(j, NULL, &sub);
+      dbus_message_iter_next(&sub);
+    }
+    zbx_json_close(j);
+    return;
+
   case DBUS_TYPE_STRING:
+  case DBUS_TYPE_OBJECT_PATH:
+  case DBUS_TYPE_SIGNATURE:
     dbus_message_iter_get_basic(iter, &value);
-    zbx_strlcpy(s, value, n);
-    zbx_free(iter);
-    return SUCCEED;
+    zbx_json_addstring(j, name, value.str, ZBX_JSON_TYPE_STRING);
+    return;
+  }
 
+  // numeric and boolean values are appended unquoted
+  dbus_message_iter_get_basic(iter, &value);
+  switch (type) {
   case DBUS_TYPE_BOOLEAN:
-    dbus_message_iter_get_basic(iter, &value);
-    zbx_strlcpy(s, yes_no(value), n);
-    zbx_free(iter);
-    return SUCCEED;
-  }
+    zbx_strlcpy(buf, value.bool_val ? "true" : "false", sizeof(buf));
+    break;
 
-  zbx_free(iter);
+  case DBUS_TYPE_BYTE:
+    zbx_snprintf(buf, sizeof(buf), "%u", (unsigned int) value.byt);
+    break;
 
-  return FAIL;
+  case DBUS_TYPE_INT16:
+    zbx_snprintf(buf, sizeof(buf), "%d", (int) value.i16);
+    break;
+
+  case DBUS_TYPE_UINT16:
+    zbx_snprintf(buf, sizeof(buf), "%u", (unsigned int) value.u16);
+    break;
+
+  case DBUS_TYPE_INT32:
+    zbx_snprintf(buf, sizeof(buf), "%d", value.i32);
+    break;
+
+  case DBUS_TYPE_UINT32:
+    zbx_snprintf(buf, sizeof(buf), "%u", value.u32);
+    break;
+
+  case DBUS_TYPE_INT64:
+    zbx_snprintf(buf, sizeof(buf), ZBX_FS_I64, (zbx_int64_t) value.i64);
+    break;
+
+  case DBUS_TYPE_UINT64:
+    zbx_snprintf(buf, sizeof(buf), ZBX_FS_UI64, (zbx_uint64_t) value.u64);
+    break;
+
+  case DBUS_TYPE_DOUBLE:
+    // json has no literal for NaN or infinity
+    if (!isfinite(value.dbl)) {
+      zbx_json_addstring(j, name, NULL, ZBX_JSON_TYPE_NULL);
+      return;
+    }
+    zbx_snprintf(buf, sizeof(buf), ZBX_FS_DBL, value.dbl);
+    break;
+
+  default:
+    // file descriptors and unknown types
+    zbx_json_addstring(j, name, NULL, ZBX_JSON_TYPE_NULL);
+    return;
+  }
+
+  zbx_json_addstring(j, name, buf, ZBX_JSON_TYPE_INT);
 }
 
 /*
- * dbus_get_property_json appends the value of the given property as a key/val
- * pair to the given discovery json document.
+ * dbus_properties_json_all decodes the a{sv} dictionary in the given GetAll
+ * reply in a single pass and appends each of the given NULL terminated list of
+ * properties to the given json object as a typed value. All properties are
+ * appended if the list is NULL.
+ *
+ * Properties are appended in the order of the reply. Requested properties
+ * which are missing from the reply are omitted.
  */
-int dbus_get_property_json(
+int dbus_properties_json_all(
               struct zbx_json *j,
-              const char      *key,
-              const char      *path,
-              const char      *interface,
-              const char      *property
+              DBusMessage     *msg,
+              const char      **properties
 ) {
-  char buf[1024];
-  buf[0] = '\0';
-  if (SUCCEED == dbus_get_property_string(
-    buf,
-    sizeof(buf),
-    SYSTEMD_SERVICE_NAME,
-    path,
-    interface,
-    property
-  )) {
-    if ('\0' != buf[0])
-      zbx_json_addstring(j, key, buf, ZBX_JSON_TYPE_STRING);
-    return SUCCEED;
+  DBusMessageIter args, arr, entry;
+  const char      *name = NULL;
+  int             i;
+
+  if (!dbus_message_iter_init(msg, &args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "message has no arguments");
+    return FAIL;
   }
 
-  return FAIL;
+  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "argument is not an array");
+    return FAIL;
+  }
+
+  dbus_message_iter_recurse(&args, &arr);
+  while (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&arr)) {
+    dbus_message_iter_recurse(&arr, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    dbus_message_iter_next(&entry);
+
+    for (i = 0; properties && properties[i]; i++)
+      if (0 == strcmp(name, properties[i]))
+        break;
+
+    if (NULL == properties || NULL != properties[i])
+      dbus_iter_json(j, name, &entry);
+
+    dbus_message_iter_next(&arr);
+  }
+
+  return SUCCEED;
 }
 
 /*
- * dbus_marshall_property gets the value of a d-bus property and marshalls it
- * into a Zabbix AGENT_RESULT struct.
+ * dbus_marshall_value marshalls the property value at the given iterator into
+ * a Zabbix AGENT_RESULT struct.
  *
  * Returns SYSINFO_RET_FAIL on error.
  */
-int dbus_marshall_property(
-  AGENT_RESULT  *result,
-  const char    *service,
-  const char    *path,
-  const char    *interface,
-  const char    *property
-) {
+static int dbus_marshall_value(AGENT_RESULT *result, DBusMessageIter *iter)
+{
   int             type = 0;
-  DBusMessageIter *iter = NULL, arr;
+  DBusMessageIter arr;
   DBusBasicValue  value;
   char            *s = NULL;
   StringBuilder   *sb = NULL;
 
-  iter = dbus_get_property(
-                      service,
-                      path,
-                      interface,
-                      property);
-
-  if (NULL == iter) {
-    SET_MSG_RESULT(result, strdup("failed to get property"));
-    zbx_free(iter);
-    return SYSINFO_RET_FAIL;
-  }
-  
   type = dbus_message_iter_get_arg_type(iter);
 
   // marshal string array
@@ -351,7 +1302,33 @@ int dbus_marshall_property(
     return SYSINFO_RET_OK;
   }
 
-  zbx_free(iter);
   SET_MSG_RESULT(result, zbx_dsprintf(NULL, "unsupported value type: %c", type));
   return SYSINFO_RET_FAIL;
 }
+
+/*
+ * dbus_marshall_property gets the value of a d-bus property and marshalls it
+ * into a Zabbix AGENT_RESULT struct.
+ *
+ * Returns SYSINFO_RET_FAIL on error.
+ */
+int dbus_marshall_property(
+  AGENT_RESULT  *result,
+  const char    *service,
+  const char    *path,
+  const char    *interface,
+  const char    *property
+) {
+  dbus_property prop;
+  int           res;
+
+  if (FAIL == dbus_get_property(&prop, service, path, interface, property)) {
+    SET_MSG_RESULT(result, strdup("failed to get property"));
+    return SYSINFO_RET_FAIL;
+  }
+
+  res = dbus_marshall_value(result, &prop.value);
+  dbus_property_release(&prop);
+
+  return res;
+}
@@ -7,32 +7,63 @@ int mainpid = 0;
 static int SYSTEMD_MODVER(AGENT_REQUEST*, AGENT_RESULT*);
 static int SYSTEMD_MANAGER(AGENT_REQUEST *request, AGENT_RESULT *result);
 static int SYSTEMD_UNIT(AGENT_REQUEST*, AGENT_RESULT*);
+static int SYSTEMD_UNIT_GET(AGENT_REQUEST*, AGENT_RESULT*);
 static int SYSTEMD_UNIT_DISCOVERY(AGENT_REQUEST*, AGENT_RESULT*);
+static int SYSTEMD_UNITS_COUNT(AGENT_REQUEST*, AGENT_RESULT*);
+static int SYSTEMD_UNITS_COUNT_ALL(AGENT_REQUEST*, AGENT_RESULT*);
 static int SYSTEMD_SERVICE_INFO(AGENT_REQUEST*, AGENT_RESULT*);
 static int SYSTEMD_SERVICE_DISCOVERY(AGENT_REQUEST*, AGENT_RESULT*);
 
+// items in dbus.c
+int SYSTEMD_BREAKER(AGENT_REQUEST*, AGENT_RESULT*);
+
+// items in stats.c
+int SYSTEMD_MODULE_STATS(AGENT_REQUEST*, AGENT_RESULT*);
+
 // items in cgroups.c
 int cgroup_init();
 int SYSTEMD_CGROUP_CPU(AGENT_REQUEST*, AGENT_RESULT*);
 int SYSTEMD_CGROUP_DEV(AGENT_REQUEST*, AGENT_RESULT*);
 int SYSTEMD_CGROUP_MEM(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_CPU_ALL(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_DEV_ALL(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_MEM_ALL(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_CPU_UTIL(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_PSI(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_PSI_ALL(AGENT_REQUEST*, AGENT_RESULT*);
+int SYSTEMD_CGROUP_TOP(AGENT_REQUEST*, AGENT_RESULT*);
 
 ZBX_METRIC *zbx_module_item_list()
 {
   static ZBX_METRIC keys[] =
   {
     { "systemd.modver",             0,              SYSTEMD_MODVER,             NULL },
+    { "systemd.module.stats",       0,              SYSTEMD_MODULE_STATS,       NULL },
+    { "systemd.breaker",            CF_HAVEPARAMS,  SYSTEMD_BREAKER,            "state" },
     { "systemd",                    CF_HAVEPARAMS,  SYSTEMD_MANAGER,            "Version" },
     { "systemd.unit",               CF_HAVEPARAMS,  SYSTEMD_UNIT,               "dbus.service,Service,Result" },
+    { "systemd.unit.get",           CF_HAVEPARAMS,  SYSTEMD_UNIT_GET,           "dbus.service,Unit,ActiveState,SubState" },
     { "systemd.unit.discovery",     CF_HAVEPARAMS,  SYSTEMD_UNIT_DISCOVERY,     NULL },
+    { "systemd.units.count",        CF_HAVEPARAMS,  SYSTEMD_UNITS_COUNT,        "service,failed" },
+    { "systemd.units.count.all",    0,              SYSTEMD_UNITS_COUNT_ALL,    NULL },
     { "systemd.service.info",       CF_HAVEPARAMS,  SYSTEMD_SERVICE_INFO,       "dbus.service" },
     { "systemd.service.discovery",  CF_HAVEPARAMS,  SYSTEMD_SERVICE_DISCOVERY,  NULL },
     { "systemd.cgroup.cpu",         CF_HAVEPARAMS,  SYSTEMD_CGROUP_CPU,         "dbus.service,total" },
     { "systemd.cgroup.dev",         CF_HAVEPARAMS,  SYSTEMD_CGROUP_DEV,         "dbus.service,blkio.io_queued,Total" },
     { "systemd.cgroup.mem",         CF_HAVEPARAMS,  SYSTEMD_CGROUP_MEM,         "dbus.service,rss" },
+    { "systemd.cgroup.cpu.all",     CF_HAVEPARAMS,  SYSTEMD_CGROUP_CPU_ALL,     "dbus.service" },
+    { "systemd.cgroup.dev.all",     CF_HAVEPARAMS,  SYSTEMD_CGROUP_DEV_ALL,     "dbus.service" },
+    { "systemd.cgroup.mem.all",     CF_HAVEPARAMS,  SYSTEMD_CGROUP_MEM_ALL,     "dbus.service" },
+    { "systemd.cgroup.cpu.util",    CF_HAVEPARAMS,  SYSTEMD_CGROUP_CPU_UTIL,    "dbus.service,total" },
+    { "systemd.cgroup.psi",         CF_HAVEPARAMS,  SYSTEMD_CGROUP_PSI,         "dbus.service,cpu,some,avg10" },
+    { "systemd.cgroup.psi.all",     CF_HAVEPARAMS,  SYSTEMD_CGROUP_PSI_ALL,     "dbus.service" },
+    { "systemd.cgroup.top",         CF_HAVEPARAMS,  SYSTEMD_CGROUP_TOP,         "system.slice,memory,10" },
     { NULL }
   };
 
+  // record the latency of all items
+  stats_wrap_items(keys);
+
   return keys;
 }
 
@@ -40,18 +71,50 @@ int zbx_module_api_version() {
   return ZBX_MODULE_API_VERSION;
 }
 
+/*
+ * systemd_load_config reads the optional module configuration file.
+ */
+static int systemd_load_config()
+{
+  struct cfg_line cfg[] =
+  {
+    /* PARAMETER,                     VAR,                              TYPE,     MANDATORY,  MIN,  MAX */
+    { "PropertyCacheTTL",             &property_cache_ttl,              TYPE_INT, PARM_OPT,   0,    SEC_PER_DAY },
+    { "PropertyCacheUnsignalledTTL",  &property_cache_unsignalled_ttl,  TYPE_INT, PARM_OPT,   0,    SEC_PER_DAY },
+    { "DiscoveryCacheTTL",            &discovery_cache_ttl,             TYPE_INT, PARM_OPT,   0,    SEC_PER_DAY },
+    { "SnapshotInterval",             &snapshot_interval,               TYPE_INT, PARM_OPT,   0,    SEC_PER_HOUR },
+    { "BreakerThreshold",             &dbus_breaker_threshold,          TYPE_INT, PARM_OPT,   0,    1000 },
+    { "BreakerBackoff",               &dbus_breaker_backoff,            TYPE_INT, PARM_OPT,   1,    SEC_PER_HOUR },
+    { "SystemdPrivateSocket",         &dbus_private_socket,             TYPE_STRING, PARM_OPT, 0,   0 },
+    { NULL }
+  };
+
+  return parse_cfg_file(MODULE_CONFIG_FILE, cfg, ZBX_CFG_FILE_OPTIONAL, ZBX_CFG_STRICT);
+}
+
 int zbx_module_init()
 {
     zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "starting v%s, compiled: %s %s", PACKAGE_VERSION, __DATE__, __TIME__);
     mainpid = getpid();
+
+    if (SUCCEED != systemd_load_config()) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "failed to load %s", MODULE_CONFIG_FILE);
+      return ZBX_MODULE_FAIL;
+    }
+
     cgroup_init();
+
+    // items are served live if the sampler cannot be started
+    if (SUCCEED != snapshot_init())
+      zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "metrics snapshot disabled");
+
     return ZBX_MODULE_OK;
 }
 
 int zbx_module_uninit()
 {
-  if (NULL != conn)
-    dbus_connection_unref(conn);
+  snapshot_uninit();
+  dbus_disconnect();
   return ZBX_MODULE_OK;
 }
 
@@ -84,7 +147,7 @@ static int SYSTEMD_MANAGER(AGENT_REQUEST *request, AGENT_RESULT *result)
     property = "Version";
 
   if (FAIL == dbus_connect()) {
-    SET_MSG_RESULT(result, strdup("Failed to connect to D-Bus."));
+    SET_MSG_RESULT(result, dbus_connect_error());
     return SYSINFO_RET_FAIL;
   }
 
@@ -98,29 +161,47 @@ static int SYSTEMD_MANAGER(AGENT_REQUEST *request, AGENT_RESULT *result)
   );
 }
 
+/*
+ * unit_snapshot_state returns a copy of the given state property of the given
+ * unit from the shared metrics snapshot, or NULL if the property is not a
+ * unit state or the unit is not in a fresh snapshot.
+ */
+static char *unit_snapshot_state(const char *unit, const char *interface, const char *property)
+{
+  snapshot_unit u;
+  const char    *state;
+
+  if (0 != strcmp(interface, SYSTEMD_UNIT_INTERFACE))
+    return NULL;
+
+  if (0 == strcmp(property, "ActiveState"))
+    state = u.active_state;
+  else if (0 == strcmp(property, "SubState"))
+    state = u.sub_state;
+  else if (0 == strcmp(property, "LoadState"))
+    state = u.load_state;
+  else
+    return NULL;
+
+  if (FAIL == snapshot_get_unit(unit, &u))
+    return NULL;
+
+  return strdup(state);
+}
+
 // systemd.unit[unit_name,<interface=Unit>,<property=ActiveState>]
 static int SYSTEMD_UNIT(AGENT_REQUEST *request, AGENT_RESULT *result)
 {
   const char      *unit, *interface, *property;
-  char            path[4096], buf[DBUS_MAXIMUM_NAME_LENGTH+1];
+  char            path[4096], buf[DBUS_MAXIMUM_NAME_LENGTH+1], *state;
   int             res = SYSINFO_RET_FAIL;
 
   if (1 > request->nparam || 3 < request->nparam) {
     SET_MSG_RESULT(result, strdup("Invalid number of parameters."));
     return SYSINFO_RET_FAIL;
   }
-  
-  if (FAIL == dbus_connect()) {
-    SET_MSG_RESULT(result, strdup("Failed to connect to D-Bus."));
-    return SYSINFO_RET_FAIL;
-  }
-  
-  // resolve unit name to object path
+
   unit = get_rparam(request, 0);
-  if (FAIL == systemd_get_unit(path, sizeof(path), unit)) {
-    SET_MSG_RESULT(result, strdup("unit not found"));
-    return res;
-  }
 
   // resolve full interface name (default: org.freedesktop.systemd1.Unit)
   interface = get_rparam(request, 1);
@@ -136,6 +217,22 @@ static int SYSTEMD_UNIT(AGENT_REQUEST *request, AGENT_RESULT *result)
   if (NULL == property || '\0' == *property)
     property = "ActiveState";
 
+  if (NULL != (state = unit_snapshot_state(unit, interface, property))) {
+    SET_STR_RESULT(result, state);
+    return SYSINFO_RET_OK;
+  }
+
+  if (FAIL == dbus_connect()) {
+    SET_MSG_RESULT(result, dbus_connect_error());
+    return SYSINFO_RET_FAIL;
+  }
+
+  // resolve unit name to object path
+  if (FAIL == systemd_get_unit(path, sizeof(path), unit)) {
+    SET_MSG_RESULT(result, strdup("unit not found"));
+    return res;
+  }
+
   // get value
   return dbus_marshall_property(
     result,
@@ -146,116 +243,392 @@ static int SYSTEMD_UNIT(AGENT_REQUEST *request, AGENT_RESULT *result)
   );
 }
 
-// systemd.unit.discovery[]
-static int SYSTEMD_UNIT_DISCOVERY(AGENT_REQUEST *request, AGENT_RESULT *result)
+// systemd.unit.get[unit_name,<interface=Unit|*>,<property>,...|*]
+static int SYSTEMD_UNIT_GET(AGENT_REQUEST *request, AGENT_RESULT *result)
 {
   DBusMessage     *msg = NULL;
-  DBusMessageIter args, arr, unit;
-  DBusBasicValue  value;
   struct zbx_json j;
-  const char      *filter;
-  int             res = SYSINFO_RET_FAIL;
-  int             type = 0, i = 0;
+  const char      *unit, *interface, **properties = NULL;
+  char            path[4096], buf[DBUS_MAXIMUM_NAME_LENGTH+1];
+  int             i, n = 0;
 
-  if (1 < request->nparam) {
+  if (1 > request->nparam) {
     SET_MSG_RESULT(result, strdup("Invalid number of parameters."));
     return SYSINFO_RET_FAIL;
   }
 
-  filter = get_rparam(request, 0);
-
   if (FAIL == dbus_connect()) {
-    SET_MSG_RESULT(result, strdup("Failed to connect to D-Bus."));
+    SET_MSG_RESULT(result, dbus_connect_error());
     return SYSINFO_RET_FAIL;
   }
 
-  // send method call
-  msg = dbus_message_new_method_call(
-    SYSTEMD_SERVICE_NAME,
-    SYSTEMD_ROOT_NODE,
-    SYSTEMD_MANAGER_INTERFACE,
-    "ListUnits");
+  // resolve unit name to object path
+  unit = get_rparam(request, 0);
+  if (FAIL == systemd_get_unit(path, sizeof(path), unit)) {
+    SET_MSG_RESULT(result, strdup("unit not found"));
+    return SYSINFO_RET_FAIL;
+  }
 
-  if (NULL == (msg = dbus_exchange_message(msg))) {
-    SET_MSG_RESULT(result, strdup("failed to list units"));
-    dbus_message_unref(msg);
-    return res;
+  // resolve full interface name (default: org.freedesktop.systemd1.Unit). The
+  // properties of all interfaces are returned by systemd for the empty name.
+  interface = get_rparam(request, 1);
+  if (NULL == interface || '\0' == *interface) {
+    interface = SYSTEMD_UNIT_INTERFACE;
+  } else if (0 == strcmp(interface, "*")) {
+    interface = "";
+  } else {
+    zbx_snprintf(buf, sizeof(buf), SYSTEMD_SERVICE_NAME ".%s", interface);
+    interface = &buf[0];
   }
 
-  // check result message
-  if (!dbus_message_iter_init(msg, &args)) {
-    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "no value returned");
-    dbus_message_unref(msg);
-    return res;
+  // resolve property names (default: all)
+  if (2 < request->nparam) {
+    properties = zbx_malloc(properties, (request->nparam - 1) * sizeof(char*));
+    for (i = 2; i < request->nparam; i++) {
+      properties[n] = get_rparam(request, i);
+      if (NULL == properties[n] || '\0' == *properties[n])
+        continue;
+
+      if (0 == strcmp(properties[n], "*")) {
+        zbx_free(properties);
+        break;
+      }
+
+      n++;
+    }
+
+    // only empty names given, e.g. systemd.unit.get[sshd,Unit,]
+    if (0 == n)
+      zbx_free(properties);
+
+    if (NULL != properties)
+      properties[n] = NULL;
   }
-  
-  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args)) {
-    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "returned value is not an array");
+
+  // get all values at once
+  if (NULL == (msg = dbus_get_all_properties(SYSTEMD_SERVICE_NAME, path, interface))) {
+    zbx_free(properties);
+    SET_MSG_RESULT(result, strdup("failed to get properties"));
+    return SYSINFO_RET_FAIL;
+  }
+
+  zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+  if (FAIL == dbus_properties_json_all(&j, msg, properties)) {
+    zbx_free(properties);
     dbus_message_unref(msg);
+    zbx_json_free(&j);
+    SET_MSG_RESULT(result, strdup("failed to decode properties"));
+    return SYSINFO_RET_FAIL;
+  }
+
+  zbx_free(properties);
+  dbus_message_unref(msg);
+  zbx_json_close(&j);
+  SET_STR_RESULT(result, strdup(j.buffer));
+  zbx_json_free(&j);
+
+  return SYSINFO_RET_OK;
+}
+
+// additional unit properties fetched by systemd.unit.discovery
+static const dbus_property_map unit_discovery_properties[] = {
+  { "{#UNIT.FRAGMENTPATH}",       "FragmentPath" },
+  { "{#UNIT.UNITFILESTATE}",      "UnitFileState" },
+  { "{#UNIT.FOLLOWING}",          "Following" },
+  { "{#UNIT.CONDITIONRESULT}",    "ConditionResult" },
+  { NULL }
+};
+
+// state shared by the request and reply functions of a pipelined discovery
+typedef struct {
+  struct zbx_json *j;
+  systemd_unit    *units;
+} discovery_context;
+
+// discovery_request creates the GetAll call for the i'th discovered unit
+static DBusMessage *discovery_request(int i, void *data)
+{
+  discovery_context *ctx = (discovery_context*) data;
+
+  return dbus_new_get_all_message(
+    SYSTEMD_SERVICE_NAME,
+    ctx->units[i].path,
+    SYSTEMD_UNIT_INTERFACE);
+}
+
+// unit_discovery_reply appends the i'th discovered unit to the discovery json
+static void unit_discovery_reply(int i, DBusMessage *reply, void *data)
+{
+  discovery_context *ctx = (discovery_context*) data;
+  systemd_unit      *unit = &ctx->units[i];
+
+  zbx_json_addobject(ctx->j, NULL);
+  zbx_json_addstring(ctx->j, "{#UNIT.NAME}", unit->name, ZBX_JSON_TYPE_STRING);
+  zbx_json_addstring(ctx->j, "{#UNIT.DESCRIPTION}", unit->description, ZBX_JSON_TYPE_STRING);
+  zbx_json_addstring(ctx->j, "{#UNIT.LOADSTATE}", unit->load_state, ZBX_JSON_TYPE_STRING);
+  zbx_json_addstring(ctx->j, "{#UNIT.ACTIVESTATE}", unit->active_state, ZBX_JSON_TYPE_STRING);
+  zbx_json_addstring(ctx->j, "{#UNIT.SUBSTATE}", unit->sub_state, ZBX_JSON_TYPE_STRING);
+  zbx_json_addstring(ctx->j, "{#UNIT.OBJECTPATH}", unit->path, ZBX_JSON_TYPE_STRING);
+  if (NULL != reply)
+    dbus_properties_json(ctx->j, reply, unit_discovery_properties);
+  zbx_json_close(ctx->j);
+}
+
+/*
+ * discovery_partial marks the given discovery json document, with its data
+ * array already closed, as incomplete because only the given number of units
+ * could be discovered before the item timeout.
+ */
+static void discovery_partial(struct zbx_json *j, int done, int n)
+{
+  char buf[128];
+
+  zbx_snprintf(buf, sizeof(buf), "item timeout exceeded after %i of %i units", done, n);
+  zbx_json_addstring(j, "error", buf, ZBX_JSON_TYPE_STRING);
+}
+
+/*
+ * discovery_states returns a new NULL terminated list of the non-empty request
+ * parameters from the given index onwards. It is the callers responsibility to
+ * free the list.
+ */
+static const char **discovery_states(AGENT_REQUEST *request, int first)
+{
+  const char  **states = NULL;
+  const char  *state;
+  int         i, n = 0;
+
+  states = zbx_malloc(states, (MAX(0, request->nparam - first) + 1) * sizeof(char*));
+  for (i = first; i < request->nparam; i++)
+    if (NULL != (state = get_rparam(request, i)) && '\0' != *state)
+      states[n++] = state;
+
+  states[n] = NULL;
+  return states;
+}
+
+// systemd.unit.discovery[<type=all>,<pattern>,<state>,...]
+static int SYSTEMD_UNIT_DISCOVERY(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  DBusMessage       *msg = NULL;
+  systemd_unit      *units = NULL;
+  struct zbx_json   j;
+  discovery_context ctx;
+  const char        *type, *patterns[2] = { NULL, NULL }, **states = NULL;
+  char              *json = NULL;
+  int               res = SYSINFO_RET_FAIL;
+  int               n = 0, done = 0, cacheable;
+  zbx_uint64_t      generation = 0;
+
+  // serve a recent result if the set of units did not change since
+  if (NULL != (json = cache_get_discovery(request))) {
+    SET_STR_RESULT(result, json);
+    return SYSINFO_RET_OK;
+  }
+
+  // filter by unit type (default: all)
+  type = get_rparam(request, 0);
+  if (NULL == type || '\0' == *type || 0 == strcmp(type, "all"))
+    type = NULL;
+
+  // filter by unit name glob
+  patterns[0] = get_rparam(request, 1);
+  if (NULL != patterns[0] && '\0' == *patterns[0])
+    patterns[0] = NULL;
+
+  if (FAIL == dbus_connect()) {
+    SET_MSG_RESULT(result, dbus_connect_error());
+    return SYSINFO_RET_FAIL;
+  }
+
+  // changes signalled while the result is rendered must invalidate it
+  cacheable = cache_begin_discovery(&generation);
+
+  // list matching units
+  states = discovery_states(request, 2);
+  n = systemd_list_units(&msg, &units, type, patterns, states);
+  zbx_free(states);
+
+  if (-1 == n) {
+    SET_MSG_RESULT(result, strdup("failed to list units"));
     return res;
   }
-  
+
   zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
   zbx_json_addarray(&j, ZBX_PROTO_TAG_DATA);
 
-  // loop through returned units
-  dbus_message_iter_recurse(&args, &arr);
-  while ((type = dbus_message_iter_get_arg_type (&arr)) != DBUS_TYPE_INVALID) {
-    dbus_message_iter_recurse(&arr, &unit);
-
-    // loop through values
-    i = 0;
-    while((type = dbus_message_iter_get_arg_type(&unit)) != DBUS_TYPE_INVALID) {
-      dbus_message_iter_get_basic(&unit, &value);
-
-      switch (i) {
-      case 0:
-        // filter by unit type
-        if(NULL != filter || '\0' != filter)
-          if(0 == systemd_cmptype(value.str, filter))
-            goto next_unit;
-
-        zbx_json_addobject(&j, NULL);
-        zbx_json_addstring(&j, "{#UNIT.NAME}", value.str, ZBX_JSON_TYPE_STRING);
-        break;
+  // lookup additional properties of all units at once
+  ctx.j = &j;
+  ctx.units = units;
+  done = dbus_exchange_pipelined(n, discovery_request, unit_discovery_reply, &ctx);
 
-      case 1:
-        zbx_json_addstring(&j, "{#UNIT.DESCRIPTION}", value.str, ZBX_JSON_TYPE_STRING);
-        break;
+  zbx_free(units);
+  dbus_message_unref(msg);
+  zbx_json_close(&j);
 
-      case 2:
-        zbx_json_addstring(&j, "{#UNIT.LOADSTATE}", value.str, ZBX_JSON_TYPE_STRING);
-        break;
+  // return the units discovered before the item timeout, marked as partial
+  if (done < n)
+    discovery_partial(&j, done, n);
+  else if (SUCCEED == cacheable)
+    cache_put_discovery(request, j.buffer, generation);
 
-      case 3:
-        zbx_json_addstring(&j, "{#UNIT.ACTIVESTATE}", value.str, ZBX_JSON_TYPE_STRING);
-        break;
-      
-      case 4:
-        zbx_json_addstring(&j, "{#UNIT.SUBSTATE}", value.str, ZBX_JSON_TYPE_STRING);
-        break;
-      
-      case 6:
-        zbx_json_addstring(&j, "{#UNIT.OBJECTPATH}", value.str, ZBX_JSON_TYPE_STRING);
-        
-        // while we know the object path, lookup additional properties
-        dbus_get_property_json(&j, "{#UNIT.FRAGMENTPATH}", value.str, SYSTEMD_UNIT_INTERFACE, "FragmentPath");
-        dbus_get_property_json(&j, "{#UNIT.UNITFILESTATE}", value.str, SYSTEMD_UNIT_INTERFACE, "UnitFileState");
-        dbus_get_property_json(&j, "{#UNIT.FOLLOWING}", value.str, SYSTEMD_UNIT_INTERFACE, "Following");
-        dbus_get_property_json(&j, "{#UNIT.CONDITIONRESULT}", value.str, SYSTEMD_UNIT_INTERFACE, "ConditionResult");
-        zbx_json_close(&j);
-        break;
-      }
+  SET_STR_RESULT(result, strdup(j.buffer));
+  zbx_json_free(&j);
 
-      dbus_message_iter_next (&unit);
-      i++;
-    }
+  return SYSINFO_RET_OK;
+}
+
+// unit types and active states counted by systemd.units.count.all
+static const char *count_types[] = {
+  "service", "socket", "target", "device", "mount", "automount", "swap",
+  "timer", "path", "slice", "scope",
+  NULL
+};
+
+static const char *count_states[] = {
+  "active", "reloading", "inactive", "failed", "activating", "deactivating",
+  NULL
+};
+
+// number of counted types and states, excluding the NULL terminators
+#define COUNT_TYPES   (sizeof(count_types) / sizeof(count_types[0]) - 1)
+#define COUNT_STATES  (sizeof(count_states) / sizeof(count_states[0]) - 1)
+
+/*
+ * count_index returns the index of the given string in the given NULL
+ * terminated list, or the index of the terminating NULL if not found.
+ */
+static int count_index(const char **list, const char *s)
+{
+  int i;
+
+  for (i = 0; list[i]; i++)
+    if (0 == strcmp(list[i], s))
+      break;
+
+  return i;
+}
+
+/*
+ * count_unit counts a unit of the given name and active state. Rows are types
+ * and columns are states. The last two rows and columns count unknown types
+ * and states, and totals.
+ */
+static void count_unit(zbx_uint64_t counts[COUNT_TYPES + 2][COUNT_STATES + 2], const char *name, const char *state)
+{
+  const char  *type = strrchr(name, '.');
+  int         t, k;
+
+  t = count_index(count_types, NULL == type ? "" : type + 1);
+  k = count_index(count_states, state);
+  counts[t][k]++;
+  counts[t][COUNT_STATES + 1]++;
+  counts[COUNT_TYPES + 1][k]++;
+  counts[COUNT_TYPES + 1][COUNT_STATES + 1]++;
+}
 
-  next_unit:
-    dbus_message_iter_next(&arr);
+// systemd.units.count[<type=all>,<activestate>]
+static int SYSTEMD_UNITS_COUNT(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  DBusMessage         *msg = NULL;
+  systemd_unit        *units = NULL;
+  const snapshot_unit *snapshot = NULL;
+  const char          *type, *states[2] = { NULL, NULL };
+  zbx_uint64_t        count = 0;
+  int                 i, n = 0;
+
+  if (2 < request->nparam) {
+    SET_MSG_RESULT(result, strdup("Invalid number of parameters."));
+    return SYSINFO_RET_FAIL;
+  }
+
+  type = get_rparam(request, 0);
+  if (NULL == type || '\0' == *type || 0 == strcmp(type, "all"))
+    type = NULL;
+
+  states[0] = get_rparam(request, 1);
+  if (NULL != states[0] && '\0' == *states[0])
+    states[0] = NULL;
+
+  if (-1 != (n = snapshot_list_units(&snapshot))) {
+    for (i = 0; i < n; i++)
+      if ((NULL == type || systemd_cmptype(snapshot[i].name, type)) &&
+          (NULL == states[0] || 0 == strcmp(states[0], snapshot[i].active_state)))
+        count++;
+
+    SET_UI64_RESULT(result, count);
+    return SYSINFO_RET_OK;
+  }
+
+  if (FAIL == dbus_connect()) {
+    SET_MSG_RESULT(result, dbus_connect_error());
+    return SYSINFO_RET_FAIL;
+  }
+
+  // systemd filters by any state, so active states are checked again below
+  if (-1 == (n = systemd_list_units(&msg, &units, type, NULL, states))) {
+    SET_MSG_RESULT(result, strdup("failed to list units"));
+    return SYSINFO_RET_FAIL;
   }
 
+  for (i = 0; i < n; i++)
+    if (NULL == states[0] || 0 == strcmp(states[0], units[i].active_state))
+      count++;
+
+  zbx_free(units);
   dbus_message_unref(msg);
+  SET_UI64_RESULT(result, count);
+
+  return SYSINFO_RET_OK;
+}
+
+// systemd.units.count.all[]
+static int SYSTEMD_UNITS_COUNT_ALL(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  DBusMessage         *msg = NULL;
+  systemd_unit        *units = NULL;
+  const snapshot_unit *snapshot = NULL;
+  struct zbx_json     j;
+  zbx_uint64_t        counts[COUNT_TYPES + 2][COUNT_STATES + 2];
+  int                 i, t, k, n = 0;
+
+  // count all units in a single pass
+  memset(counts, 0, sizeof(counts));
+  if (-1 != (n = snapshot_list_units(&snapshot))) {
+    for (i = 0; i < n; i++)
+      count_unit(counts, snapshot[i].name, snapshot[i].active_state);
+  } else {
+    if (FAIL == dbus_connect()) {
+      SET_MSG_RESULT(result, dbus_connect_error());
+      return SYSINFO_RET_FAIL;
+    }
+
+    if (-1 == (n = systemd_list_units(&msg, &units, NULL, NULL, NULL))) {
+      SET_MSG_RESULT(result, strdup("failed to list units"));
+      return SYSINFO_RET_FAIL;
+    }
+
+    for (i = 0; i < n; i++)
+      count_unit(counts, units[i].name, units[i].active_state);
+
+    zbx_free(units);
+    dbus_message_unref(msg);
+  }
+
+  // {"service":{"active":1,...,"total":2},...,"total":{...}}
+  zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+  for (t = 0; t < COUNT_TYPES + 2; t++) {
+    if (COUNT_TYPES == t)
+      continue;
+
+    zbx_json_addobject(&j, t < COUNT_TYPES ? count_types[t] : "total");
+    for (k = 0; k < COUNT_STATES + 2; k++) {
+      if (COUNT_STATES != k)
+        zbx_json_adduint64(&j, k < COUNT_STATES ? count_states[k] : "total", counts[t][k]);
+    }
+    zbx_json_close(&j);
+  }
+
   zbx_json_close(&j);
   SET_STR_RESULT(result, strdup(j.buffer));
   zbx_json_free(&j);
@@ -267,10 +640,11 @@ static int SYSTEMD_UNIT_DISCOVERY(AGENT_REQUEST *request, AGENT_RESULT *result)
 // https://support.zabbix.com/browse/ZBXNEXT-2871
 static int SYSTEMD_SERVICE_INFO(AGENT_REQUEST *request, AGENT_RESULT *result)
 {
-  int         status, paramId = 0;
-  char        path[4096], buf[64];
-  const char  *service, *param;
-  const char  *params[] = {
+  snapshot_unit snapshot;
+  int           status, paramId = 0;
+  char          path[4096], buf[64];
+  const char    *service, *param;
+  const char    *params[] = {
     "state", "displayname", "path", "user", "startup", "description",
     NULL
   };
@@ -298,8 +672,15 @@ static int SYSTEMD_SERVICE_INFO(AGENT_REQUEST *request, AGENT_RESULT *result)
     return SYSINFO_RET_FAIL;
   }
 
+  // the state is served from the shared metrics snapshot while it is fresh
+  if (0 == paramId && SUCCEED == snapshot_get_unit(service, &snapshot) && systemd_cmptype(snapshot.name, "service") &&
+      -1 != (status = systemd_service_state_code(snapshot.active_state))) {
+    SET_UI64_RESULT(result, status);
+    return SYSINFO_RET_OK;
+  }
+
   if (FAIL == dbus_connect()) {
-    SET_MSG_RESULT(result, strdup("Failed to connect to D-Bus."));
+    SET_MSG_RESULT(result, dbus_connect_error());
     return SYSINFO_RET_FAIL;
   }
 
@@ -398,84 +779,97 @@ static int SYSTEMD_SERVICE_INFO(AGENT_REQUEST *request, AGENT_RESULT *result)
   return SYSINFO_RET_FAIL;
 }
 
-// systemd.service.discovery[]
+// unit properties fetched by systemd.service.discovery
+static const dbus_property_map service_discovery_properties[] = {
+  { "{#SERVICE.NAME}",            "Id" },
+  { "{#SERVICE.DISPLAYNAME}",     "Description" },
+  { "{#SERVICE.PATH}",            "FragmentPath" },
+  { "{#SERVICE.STARTUPNAME}",     "UnitFileState" },
+  { "{#SERVICE.CONDITIONRESULT}", "ConditionResult" },
+  { NULL }
+};
+
+// service_discovery_reply appends the i'th discovered service to the
+// discovery json
+static void service_discovery_reply(int i, DBusMessage *reply, void *data)
+{
+  discovery_context *ctx = (discovery_context*) data;
+
+  zbx_json_addobject(ctx->j, NULL);
+  zbx_json_addstring(ctx->j, "{#SERVICE.TYPE}", "service", ZBX_JSON_TYPE_STRING);
+  if (NULL != reply)
+    dbus_properties_json(ctx->j, reply, service_discovery_properties);
+  zbx_json_close(ctx->j);
+}
+
+// systemd.service.discovery[<pattern>,<state>,...]
 static int SYSTEMD_SERVICE_DISCOVERY(AGENT_REQUEST *request, AGENT_RESULT *result)
 {
-  DBusMessage     *msg = NULL;
-  DBusMessageIter args, arr, unit;
-  struct zbx_json j; 
-  DBusBasicValue  value;
-  int             res = SYSINFO_RET_FAIL;
-  int             type = 0;
-  char            *path;
+  DBusMessage       *msg = NULL;
+  systemd_unit      *units = NULL;
+  struct zbx_json   j; 
+  discovery_context ctx;
+  const char        *pattern, *patterns[2] = { NULL, NULL }, **states = NULL;
+  char              *json = NULL;
+  char              buf[4096];
+  int               res = SYSINFO_RET_FAIL;
+  int               n = 0, done = 0, cacheable;
+  zbx_uint64_t      generation = 0;
+
+  // serve a recent result if the set of units did not change since
+  if (NULL != (json = cache_get_discovery(request))) {
+    SET_STR_RESULT(result, json);
+    return SYSINFO_RET_OK;
+  }
+
+  // filter by service name glob. As with systemd.service.info, .service is
+  // appended if no extension is given. "service" matches all services, as
+  // earlier versions documented systemd.service.discovery[service].
+  pattern = get_rparam(request, 0);
+  if (NULL != pattern && '\0' != *pattern && 0 != strcmp(pattern, "service")) {
+    if (NULL == strchr(pattern, '.')) {
+      zbx_snprintf(buf, sizeof(buf), "%s.service", pattern);
+      pattern = &buf[0];
+    }
+    patterns[0] = pattern;
+  }
 
   if (FAIL == dbus_connect()) {
-    SET_MSG_RESULT(result, strdup("Failed to connect to D-Bus."));
+    SET_MSG_RESULT(result, dbus_connect_error());
     return SYSINFO_RET_FAIL;
   }
 
-  // send method call
-  msg = dbus_message_new_method_call(
-    SYSTEMD_SERVICE_NAME,
-    SYSTEMD_ROOT_NODE,
-    SYSTEMD_MANAGER_INTERFACE,
-    "ListUnits");
+  // changes signalled while the result is rendered must invalidate it
+  cacheable = cache_begin_discovery(&generation);
+
+  // list matching services
+  states = discovery_states(request, 1);
+  n = systemd_list_units(&msg, &units, "service", patterns, states);
+  zbx_free(states);
 
-  if (NULL == (msg = dbus_exchange_message(msg))) {
+  if (-1 == n) {
     SET_MSG_RESULT(result, strdup("failed to list units"));
-    dbus_message_unref(msg);
     return res;
   }
 
-  // check result message
-  if (!dbus_message_iter_init(msg, &args)) {
-    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "no value returned");
-    dbus_message_unref(msg);
-    return res;
-  }
-  
-  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args)) {
-    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "returned value is not an array");
-    dbus_message_unref(msg);
-    return res;
-  }
-  
   zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
   zbx_json_addarray(&j, ZBX_PROTO_TAG_DATA);
 
-  // loop through returned units
-  dbus_message_iter_recurse(&args, &arr);
-  while ((type = dbus_message_iter_get_arg_type (&arr)) != DBUS_TYPE_INVALID) {
-    dbus_message_iter_recurse(&arr, &unit);
-
-    // get object path a(ssssssouso)[n][6]
-    dbus_message_iter_next_n(&unit, 6);
-    if (DBUS_TYPE_INVALID == (type = dbus_message_iter_get_arg_type(&unit))) {
-      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "unexpected value type");
-      dbus_message_unref(msg);
-      goto next_unit;
-    }
-
-    dbus_message_iter_get_basic(&unit, &value);
-    if (!systemd_unit_is_service(value.str))
-      goto next_unit;
-
-    // send property values
-    zbx_json_addobject(&j, NULL);
-    zbx_json_addstring(&j, "{#SERVICE.TYPE}", "service", ZBX_JSON_TYPE_STRING);
-    dbus_get_property_json(&j, "{#SERVICE.NAME}", value.str, SYSTEMD_UNIT_INTERFACE, "Id");
-    dbus_get_property_json(&j, "{#SERVICE.DISPLAYNAME}", value.str, SYSTEMD_UNIT_INTERFACE, "Description");
-    dbus_get_property_json(&j, "{#SERVICE.PATH}", value.str, SYSTEMD_UNIT_INTERFACE, "FragmentPath");
-    dbus_get_property_json(&j, "{#SERVICE.STARTUPNAME}", value.str, SYSTEMD_UNIT_INTERFACE, "UnitFileState");
-    dbus_get_property_json(&j, "{#SERVICE.CONDITIONRESULT}", value.str, SYSTEMD_UNIT_INTERFACE, "ConditionResult");
-    zbx_json_close(&j);
-
-next_unit:
-    dbus_message_iter_next(&arr);
-  }
+  // lookup service properties of all units at once
+  ctx.j = &j;
+  ctx.units = units;
+  done = dbus_exchange_pipelined(n, discovery_request, service_discovery_reply, &ctx);
 
+  zbx_free(units);
   dbus_message_unref(msg);
   zbx_json_close(&j);
+
+  // return the units discovered before the item timeout, marked as partial
+  if (done < n)
+    discovery_partial(&j, done, n);
+  else if (SUCCEED == cacheable)
+    cache_put_discovery(request, j.buffer, generation);
+
   SET_STR_RESULT(result, strdup(j.buffer));
   zbx_json_free(&j);
 
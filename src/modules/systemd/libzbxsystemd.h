@@ -5,10 +5,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
 
 // string builder
 #include "sb.h"
 
+// hash map
+#include "map.h"
+
 // Zabbix source headers
 #define HAVE_TIME_H 1
 #include <sysinc.h>
@@ -17,11 +22,16 @@
 #include <log.h>
 #include <zbxjson.h>
 #include <version.h>
+#include <cfg.h>
 
 #ifndef MAX
 #define MAX(a, b)     ( (a) < (b) ? (b) : (a) )
 #endif
 
+#ifndef MIN
+#define MIN(a, b)     ( (a) < (b) ? (a) : (b) )
+#endif
+
 // d-bus headers
 #include <dbus/dbus.h>
 
@@ -40,16 +50,57 @@ int timeout;
 // D-Bus api
 #define DBUS_PROPERTIES_INTERFACE     "org.freedesktop.DBus.Properties"
 
+// path of the private socket of systemd or NULL to use the system bus
+extern char *dbus_private_socket;
+
 int               dbus_connect();
+char              *dbus_connect_error();
+void              dbus_disconnect();
+int               dbus_is_owned();
+void              dbus_connection_json(struct zbx_json *j);
+void              dbus_start_deadline();
+void              dbus_end_deadline();
+int               dbus_deadline_remaining();
 int               dbus_check_error(DBusMessage*);
+int               dbus_error_is_reply(const DBusError *err);
 int               dbus_message_iter_next_n(DBusMessageIter *iter, int n);
 DBusMessage       *dbus_exchange_message(DBusMessage *msg);
-DBusMessageIter   *dbus_get_property(
+DBusMessage       *dbus_exchange_message_err(DBusMessage *msg, DBusError *err);
+int               dbus_add_signal_match(const char *rule);
+void              dbus_remove_signal_match(const char *rule);
+void              dbus_dispatch_signals();
+
+// create the i'th call of a pipelined exchange
+typedef DBusMessage *(*dbus_request_func)(int i, void *data);
+
+// handle the reply to the i'th call of a pipelined exchange
+typedef void (*dbus_reply_func)(int i, DBusMessage *reply, void *data);
+
+// maximum number of calls in flight during a pipelined exchange. The system
+// bus limits each connection to 128 pending replies by default.
+#define DBUS_PIPELINE_WINDOW          64
+
+int               dbus_exchange_pipelined(
+                                int,
+                                dbus_request_func,
+                                dbus_reply_func,
+                                void*);
+
+// a property value, owning a reference to the message its iterator points into
+typedef struct {
+  DBusMessage     *msg;
+  DBusMessageIter value;
+} dbus_property;
+
+int               dbus_get_property(
+                                dbus_property*,
                                 const char*,
                                 const char*,
                                 const char*,
                                 const char*);
 
+void              dbus_property_release(dbus_property*);
+
 int dbus_get_property_string(
                 char          *s,
                 const size_t  n,
@@ -58,12 +109,51 @@ int dbus_get_property_string(
                 const char    *interface,
                 const char    *property); 
 
-int dbus_get_property_json(
-                struct zbx_json *j,
-                const char      *key,
-                const char      *path,
-                const char      *interface,
-                const char      *property);
+// circuit breaker
+extern int dbus_breaker_threshold;
+extern int dbus_breaker_backoff;
+
+typedef enum {
+  DBUS_BREAKER_CLOSED = 0,
+  DBUS_BREAKER_OPEN,
+  DBUS_BREAKER_HALF_OPEN
+} dbus_breaker_state;
+
+void dbus_breaker_json(struct zbx_json *j);
+
+// maps a d-bus property name to a json key
+typedef struct {
+  const char  *key;
+  const char  *property;
+} dbus_property_map;
+
+#define DBUS_PROPERTY_MAP_MAX         32
+
+DBusMessage *dbus_new_get_all_message(
+                const char    *service,
+                const char    *path,
+                const char    *interface);
+
+DBusMessage *dbus_get_all_properties(
+                const char    *service,
+                const char    *path,
+                const char    *interface);
+
+int dbus_properties_json(
+                struct zbx_json         *j,
+                DBusMessage             *msg,
+                const dbus_property_map *map);
+
+int dbus_get_properties_json(
+                struct zbx_json         *j,
+                const char              *path,
+                const char              *interface,
+                const dbus_property_map *map);
+
+int dbus_properties_json_all(
+                struct zbx_json         *j,
+                DBusMessage             *msg,
+                const char              **properties);
 
 int dbus_marshall_property(
                 AGENT_RESULT*,
@@ -72,6 +162,102 @@ int dbus_marshall_property(
                 const char*,
                 const char*);
 
+// property cache
+extern int property_cache_ttl;
+extern int property_cache_unsignalled_ttl;
+
+int cache_get_property(
+                dbus_property   *prop,
+                const char      *service,
+                const char      *path,
+                const char      *interface,
+                const char      *property);
+
+void cache_reset();
+
+void cache_put_property(
+                const char      *service,
+                const char      *path,
+                const char      *interface,
+                const char      *property,
+                DBusMessage     *msg,
+                DBusMessageIter *value);
+
+// instrumentation
+typedef enum {
+  STATS_CACHE_UNIT_PATH = 0,
+  STATS_CACHE_PROPERTY,
+  STATS_CACHE_DISCOVERY,
+  STATS_CACHE_SNAPSHOT,
+  STATS_CACHE_COUNT
+} stats_cache;
+
+zbx_uint64_t stats_clock_us();
+void stats_wrap_items(ZBX_METRIC *keys);
+int stats_method(const char *member);
+void stats_record_method(int method, zbx_uint64_t start_us, int error);
+void stats_record_cgroup(zbx_uint64_t start_us, size_t bytes, int error);
+void stats_record_cache(stats_cache cache, int hit);
+
+// discovery cache
+extern int discovery_cache_ttl;
+
+char *cache_get_discovery(AGENT_REQUEST *request);
+int cache_begin_discovery(zbx_uint64_t *generation);
+void cache_put_discovery(AGENT_REQUEST *request, const char *json, zbx_uint64_t generation);
+
+// cgroup stat files
+#define CGROUP_STAT_MAX               512
+#define CGROUP_STAT_SLOTS             1024    // power of two above CGROUP_STAT_MAX
+
+// a value of a parsed stat file
+typedef struct {
+  const char    *key;       // terminated in place in the read buffer
+  size_t        len;
+  zbx_uint64_t  value;
+} cgroup_stat_entry;
+
+// the values of a parsed stat file, indexed by key
+typedef struct {
+  cgroup_stat_entry entries[CGROUP_STAT_MAX];   // in file order
+  int               nentries;
+  unsigned short    slots[CGROUP_STAT_SLOTS];   // entry index + 1, 0 if free
+} cgroup_stat;
+
+extern const char *cgroup_stat_names[];
+
+char *cgroup_read_file(const char *filename, size_t *len);
+unsigned int cgroup_stat_hash(const char *key, size_t len, unsigned int seed);
+int cgroup_stat_parse(cgroup_stat *stat, char *buf);
+int cgroup_stat_get(const cgroup_stat *stat, const char *key, zbx_uint64_t *value);
+void cgroup_reset();
+
+// shared metrics snapshot
+extern int snapshot_interval;
+
+// values of a snapshot unit that were read from its cgroup
+#define SNAPSHOT_MEMORY               0x01
+#define SNAPSHOT_CPU                  0x02
+
+// a unit in the shared metrics snapshot
+typedef struct {
+  char          name[256];
+  char          load_state[16];
+  char          active_state[16];
+  char          sub_state[32];
+  int           flags;            // SNAPSHOT_* values that are set
+  zbx_uint64_t  memory_current;   // bytes, unified hierarchy only
+  zbx_uint64_t  cpu_usage;        // nanoseconds
+  double        cpu_util;         // percent of all CPUs over the last interval or -1
+} snapshot_unit;
+
+int snapshot_init();
+void snapshot_uninit();
+int snapshot_get_unit(const char *unit, snapshot_unit *u);
+int snapshot_list_units(const snapshot_unit **units);
+void snapshot_stats_json(struct zbx_json *j);
+int cgroup_sample_unit(const char *unit, zbx_uint64_t *memory, zbx_uint64_t *cpu);
+
 // systemd api
 #define SYSTEMD_SERVICE_NAME          "org.freedesktop.systemd1"
 #define SYSTEMD_ROOT_NODE             "/org/freedesktop/systemd1"
@@ -81,6 +267,28 @@ int dbus_marshall_property(
 
 DBusConnection *conn;
 
+// a unit as listed by org.freedesktop.systemd1.Manager.ListUnits
+typedef struct {
+  const char  *name;
+  const char  *description;
+  const char  *load_state;
+  const char  *active_state;
+  const char  *sub_state;
+  const char  *following;
+  const char  *path;
+} systemd_unit;
+
+int systemd_parse_units(DBusMessage *msg, systemd_unit **units);
+int systemd_list_units(
+  DBusMessage   **reply,
+  systemd_unit  **units,
+  const char    *type,
+  const char    **patterns,
+  const char    **states);
+
+int systemd_subscribe();
+void systemd_reset();
+int systemd_get_generation(zbx_uint64_t *generation);
 int systemd_get_unit(char *s, size_t n, const char* unit);
 int systemd_unit_is_service(const char *path);
 int systemd_cmptype(const char *unit, const char *type);
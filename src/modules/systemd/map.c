@@ -0,0 +1,216 @@
+/*
+ * map.c is a simple, non-thread safe hash map with string keys. Keys are
+ * copied on insertion and values are owned by the map once set, so that they
+ * are released with the given free function when replaced or deleted.
+ *
+ * Collisions are chained and the bucket array doubles in size whenever the
+ * map is more than three quarters full.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "map.h"
+
+/*
+ * map_hash returns the 32-bit FNV-1a hash of the given string.
+ */
+static unsigned int map_hash(const char *key)
+{
+	unsigned int	hash = 2166136261u;
+
+	for (; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * map_free_entry frees the given entry, its key and its value.
+ */
+static void map_free_entry(Map *m, MapEntry *entry)
+{
+	if (NULL != m->free_value && NULL != entry->value)
+		m->free_value(entry->value);
+
+	free(entry->key);
+	free(entry);
+}
+
+/*
+ * map_grow doubles the number of buckets in the given map.
+ */
+static int map_grow(Map *m)
+{
+	MapEntry	**buckets = NULL, *entry = NULL, *next = NULL;
+	int			i, size = m->size * 2;
+
+	buckets = (MapEntry**) calloc(size, sizeof(MapEntry*));
+	if (NULL == buckets)
+		return MAP_FAILURE;
+
+	for (i = 0; i < m->size; i++) {
+		for (entry = m->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash % size];
+			buckets[entry->hash % size] = entry;
+		}
+	}
+
+	free(m->buckets);
+	m->buckets = buckets;
+	m->size = size;
+
+	return 0;
+}
+
+/*
+ * map_create returns a pointer to a new Map or NULL if memory is not
+ * available. Values are released with the given function, which may be NULL.
+ */
+Map *map_create(void (*free_value)(void *))
+{
+	Map *m = (Map*) calloc(sizeof(Map), 1);
+	if (NULL == m)
+		return NULL;
+
+	m->buckets = (MapEntry**) calloc(MAP_INITIAL_SIZE, sizeof(MapEntry*));
+	if (NULL == m->buckets) {
+		free(m);
+		return NULL;
+	}
+
+	m->size = MAP_INITIAL_SIZE;
+	m->free_value = free_value;
+
+	return m;
+}
+
+/*
+ * map_get returns the value of the given key or NULL if the key is not set.
+ */
+void *map_get(Map *m, const char *key)
+{
+	MapEntry		*entry = NULL;
+	unsigned int	hash = map_hash(key);
+
+	for (entry = m->buckets[hash % m->size]; entry; entry = entry->next)
+		if (entry->hash == hash && 0 == strcmp(entry->key, key))
+			return entry->value;
+
+	return NULL;
+}
+
+/*
+ * map_set sets the value of the given key, releasing any previous value. It
+ * returns the number of keys in the map, or MAP_FAILURE if memory is not
+ * available, in which case the value is released.
+ */
+int map_set(Map *m, const char *key, void *value)
+{
+	MapEntry		*entry = NULL;
+	unsigned int	hash = map_hash(key);
+
+	for (entry = m->buckets[hash % m->size]; entry; entry = entry->next) {
+		if (entry->hash == hash && 0 == strcmp(entry->key, key)) {
+			if (NULL != m->free_value && NULL != entry->value && entry->value != value)
+				m->free_value(entry->value);
+			entry->value = value;
+			return m->length;
+		}
+	}
+
+	if (m->length >= m->size - m->size / 4)
+		map_grow(m);
+
+	entry = (MapEntry*) malloc(sizeof(MapEntry));
+	if (NULL == entry || NULL == (entry->key = strdup(key))) {
+		free(entry);
+		if (NULL != m->free_value && NULL != value)
+			m->free_value(value);
+		return MAP_FAILURE;
+	}
+
+	entry->hash = hash;
+	entry->value = value;
+	entry->next = m->buckets[hash % m->size];
+	m->buckets[hash % m->size] = entry;
+
+	return ++m->length;
+}
+
+/*
+ * map_delete deletes the given key and returns non-zero if it was set.
+ */
+int map_delete(Map *m, const char *key)
+{
+	MapEntry		**prev = NULL, *entry = NULL;
+	unsigned int	hash = map_hash(key);
+
+	for (prev = &m->buckets[hash % m->size]; (entry = *prev); prev = &entry->next) {
+		if (entry->hash == hash && 0 == strcmp(entry->key, key)) {
+			*prev = entry->next;
+			map_free_entry(m, entry);
+			m->length--;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * map_delete_if calls the given function for every key in the map and deletes
+ * each key for which it returns non-zero. It returns the number of keys
+ * deleted.
+ */
+int map_delete_if(Map *m, map_func fn, void *data)
+{
+	MapEntry	**prev = NULL, *entry = NULL;
+	int			i, n = 0;
+
+	for (i = 0; i < m->size; i++) {
+		prev = &m->buckets[i];
+		while ((entry = *prev)) {
+			if (fn(entry->key, entry->value, data)) {
+				*prev = entry->next;
+				map_free_entry(m, entry);
+				m->length--;
+				n++;
+			} else {
+				prev = &entry->next;
+			}
+		}
+	}
+
+	return n;
+}
+
+/*
+ * map_reset deletes all keys in the given map.
+ */
+void map_reset(Map *m)
+{
+	MapEntry	*entry = NULL, *next = NULL;
+	int			i;
+
+	for (i = 0; i < m->size; i++) {
+		for (entry = m->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			map_free_entry(m, entry);
+		}
+		m->buckets[i] = NULL;
+	}
+
+	m->length = 0;
+}
+
+/*
+ * map_free frees the given map and all of its keys and values.
+ */
+void map_free(Map *m)
+{
+	map_reset(m);
+	free(m->buckets);
+	free(m);
+}
@@ -0,0 +1,37 @@
+/*
+ * map.c is a simple, non-thread safe hash map with string keys. Keys are
+ * copied on insertion and values are owned by the map once set, so that they
+ * are released with the given free function when replaced or deleted.
+ */
+
+#ifndef MAP_H
+#define MAP_H
+
+#define MAP_FAILURE				-1
+#define MAP_INITIAL_SIZE		64
+
+typedef struct _MapEntry {
+	struct _MapEntry	*next;
+	unsigned int		hash;
+	char				*key;
+	void				*value;
+} MapEntry;
+
+typedef struct _Map {
+	struct _MapEntry	**buckets;
+	int					size;
+	int					length;
+	void				(*free_value)(void *);
+} Map;
+
+typedef int (*map_func)(const char *key, void *value, void *data);
+
+Map				*map_create(void (*free_value)(void *));
+void			*map_get(Map *m, const char *key);
+int				map_set(Map *m, const char *key, void *value);
+int				map_delete(Map *m, const char *key);
+int				map_delete_if(Map *m, map_func fn, void *data);
+void			map_reset(Map *m);
+void			map_free(Map *m);
+
+#endif
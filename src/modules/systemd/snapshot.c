@@ -0,0 +1,412 @@
+#include "libzbxsystemd.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+/*
+ * Shared metrics snapshot.
+ *
+ * Agent pollers are forked processes, so each of them opens its own D-Bus
+ * connection and reads the same cgroup files. If SnapshotInterval is set, a
+ * sampler process is forked from zbx_module_init in the main agent process,
+ * before the pollers are forked. Every SnapshotInterval seconds it lists all
+ * units and reads the CPU and memory usage of their cgroups into an anonymous
+ * shared mapping, which all pollers inherit.
+ *
+ * The mapping is guarded by a sequence lock. The sampler, its only writer,
+ * makes the sequence odd while it copies a new sample in and even again
+ * afterwards. Readers copy what they need and retry if the sequence was odd or
+ * changed meanwhile, so they neither block the sampler nor make any syscall.
+ * Units are sorted by name and looked up by binary search.
+ *
+ * Items are served live, as without the snapshot, for units that are not in
+ * the snapshot or if the last sample is older than two intervals, e.g. while
+ * the sampler starts. Unit counts are served live if systemd listed more units
+ * than the snapshot holds.
+ */
+
+// seconds between two samples. 0 disables the sampler.
+int snapshot_interval = 0;
+
+// most units in the snapshot. Further units are served live.
+#define SNAPSHOT_UNITS_MAX      4096
+
+// attempts of a reader to copy a consistent sample
+#define SNAPSHOT_READ_ATTEMPTS  64
+
+typedef struct {
+  unsigned int  seq;          // odd while the sampler writes
+  pid_t         pid;          // of the sampler
+  zbx_uint64_t  clock;        // end of the last sample in microseconds or 0
+  zbx_uint64_t  samples;
+  zbx_uint64_t  errors;
+  zbx_uint64_t  sample_us;    // duration of the last sample
+  int           nunits;
+  int           nlisted;      // units listed by systemd, more than nunits if truncated
+  snapshot_unit units[SNAPSHOT_UNITS_MAX];
+} snapshot_segment;
+
+static snapshot_segment *segment = NULL;
+
+// pid of the sampler in the process that forked it
+static pid_t sampler = 0;
+
+// per-process copy of all units for snapshot_list_units
+static snapshot_unit *copy = NULL;
+static int           ncopy = 0;
+
+/*
+ * snapshot_write_begin and snapshot_write_end enclose all writes of the
+ * sampler to the segment.
+ */
+static void snapshot_write_begin()
+{
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void snapshot_write_end()
+{
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * snapshot_read_begin returns the sequence to pass to snapshot_read_retry
+ * after reading from the segment, or an odd sequence if a write is under way.
+ */
+static unsigned int snapshot_read_begin()
+{
+  return __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * snapshot_read_retry returns non-zero if the values read since the given
+ * sequence was returned by snapshot_read_begin may be torn.
+ */
+static int snapshot_read_retry(unsigned int seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return 0 != (seq & 1) || seq != __atomic_load_n(&segment->seq, __ATOMIC_RELAXED);
+}
+
+/*
+ * snapshot_is_fresh returns non-zero if a sample ending at the given time may
+ * be served.
+ */
+static int snapshot_is_fresh(zbx_uint64_t clock)
+{
+  return 0 != clock && stats_clock_us() - clock <= (zbx_uint64_t) snapshot_interval * 2000000;
+}
+
+static int snapshot_compare(const void *a, const void *b)
+{
+  return strcmp(((const snapshot_unit*) a)->name, ((const snapshot_unit*) b)->name);
+}
+
+/*
+ * snapshot_sample lists all units and reads their cgroups into the segment.
+ * The CPU time of each unit is kept in the given map to compute its
+ * utilisation in the next sample, which replaces the map.
+ *
+ * Each unit gets its own time budget for resolving its cgroup, so that a slow
+ * start does not fail the lookups of all remaining units.
+ */
+static void snapshot_sample(Map **cpu, zbx_uint64_t *cpu_clock)
+{
+  static snapshot_unit  *next = NULL;
+  DBusMessage           *msg = NULL;
+  systemd_unit          *units = NULL;
+  Map                   *usage;
+  zbx_uint64_t          start = stats_clock_us(), clock, *prev;
+  long                  cpu_num;
+  int                   i, n, listed;
+
+  if (FAIL == dbus_connect() || -1 == (n = systemd_list_units(&msg, &units, NULL, NULL, NULL))) {
+    snapshot_write_begin();
+    segment->errors++;
+    snapshot_write_end();
+    return;
+  }
+
+  if (NULL == next)
+    next = zbx_malloc(NULL, sizeof(snapshot_unit) * SNAPSHOT_UNITS_MAX);
+
+  listed = n;
+  if (SNAPSHOT_UNITS_MAX < n) {
+    zabbix_log(LOG_LEVEL_WARNING, LOG_PREFIX "snapshot limited to %i of %i units", SNAPSHOT_UNITS_MAX, n);
+    n = SNAPSHOT_UNITS_MAX;
+  }
+
+  if (1 > (cpu_num = sysconf(_SC_NPROCESSORS_ONLN)))
+    cpu_num = 1;
+
+  usage = map_create(free);
+  for (i = 0; i < n; i++) {
+    zbx_strlcpy(next[i].name, units[i].name, sizeof(next[i].name));
+    zbx_strlcpy(next[i].load_state, units[i].load_state, sizeof(next[i].load_state));
+    zbx_strlcpy(next[i].active_state, units[i].active_state, sizeof(next[i].active_state));
+    zbx_strlcpy(next[i].sub_state, units[i].sub_state, sizeof(next[i].sub_state));
+    next[i].flags = 0;
+    next[i].cpu_util = -1;
+
+    // units without processes have no cgroup
+    if (0 == strcmp(units[i].active_state, "inactive") || 0 == strcmp(units[i].active_state, "failed"))
+      continue;
+
+    dbus_start_deadline();
+    next[i].flags = cgroup_sample_unit(units[i].name, &next[i].memory_current, &next[i].cpu_usage);
+    if (0 == (next[i].flags & SNAPSHOT_CPU))
+      continue;
+
+    clock = stats_clock_us();
+    if (NULL != *cpu && NULL != (prev = map_get(*cpu, units[i].name)) && *prev <= next[i].cpu_usage && clock > *cpu_clock)
+      next[i].cpu_util = (double) (next[i].cpu_usage - *prev) / 10 / (clock - *cpu_clock) / cpu_num;
+
+    prev = zbx_malloc(NULL, sizeof(zbx_uint64_t));
+    *prev = next[i].cpu_usage;
+    map_set(usage, units[i].name, prev);
+  }
+
+  zbx_free(units);
+  dbus_message_unref(msg);
+
+  if (NULL != *cpu)
+    map_free(*cpu);
+
+  *cpu = usage;
+  *cpu_clock = stats_clock_us();
+
+  qsort(next, n, sizeof(snapshot_unit), snapshot_compare);
+
+  snapshot_write_begin();
+  memcpy(segment->units, next, sizeof(snapshot_unit) * n);
+  segment->nunits = n;
+  segment->nlisted = listed;
+  segment->clock = stats_clock_us();
+  segment->sample_us = segment->clock - start;
+  segment->samples++;
+  snapshot_write_end();
+}
+
+/*
+ * snapshot_run samples until the agent exits. The agent exits whenever one of
+ * its child processes exits, so the sampler never returns and only exits with
+ * the main agent process.
+ */
+static void snapshot_run()
+{
+  struct timespec ts;
+  Map             *cpu = NULL;
+  zbx_uint64_t    start, elapsed, cpu_clock = 0;
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGUSR1, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != mainpid)
+    _exit(EXIT_SUCCESS);
+
+  snapshot_write_begin();
+  segment->pid = getpid();
+  snapshot_write_end();
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "snapshot sampler started, interval %is", snapshot_interval);
+
+  while (1) {
+    start = stats_clock_us();
+    dbus_start_deadline();
+    snapshot_sample(&cpu, &cpu_clock);
+    dbus_end_deadline();
+
+    elapsed = stats_clock_us() - start;
+    if (elapsed < (zbx_uint64_t) snapshot_interval * 1000000) {
+      elapsed = (zbx_uint64_t) snapshot_interval * 1000000 - elapsed;
+      ts.tv_sec = elapsed / 1000000;
+      ts.tv_nsec = elapsed % 1000000 * 1000;
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+/*
+ * snapshot_init maps the shared segment and forks the sampler if
+ * snapshot_interval is set. It must be called in the main agent process,
+ * after cgroup_init and before any D-Bus connection is made.
+ *
+ * Returns FAIL on error, in which case all items are served live.
+ */
+int snapshot_init()
+{
+  void *p;
+
+  if (0 == snapshot_interval)
+    return SUCCEED;
+
+  p = mmap(NULL, sizeof(snapshot_segment), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == p) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot map the snapshot segment: %s", zbx_strerror(errno));
+    return FAIL;
+  }
+
+  segment = (snapshot_segment*) p;
+  if (-1 == (sampler = fork())) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "cannot fork the snapshot sampler: %s", zbx_strerror(errno));
+    munmap(segment, sizeof(snapshot_segment));
+    segment = NULL;
+    sampler = 0;
+    return FAIL;
+  }
+
+  if (0 == sampler)
+    snapshot_run();
+
+  return SUCCEED;
+}
+
+/*
+ * snapshot_uninit stops the sampler, if called by the process that forked it.
+ */
+void snapshot_uninit()
+{
+  if (0 == sampler || getpid() != mainpid)
+    return;
+
+  kill(sampler, SIGTERM);
+  waitpid(sampler, NULL, 0);
+  sampler = 0;
+}
+
+/*
+ * snapshot_get_unit copies the given unit from the latest sample. If no unit
+ * extension is given, .service is appended as by systemd_get_unit.
+ *
+ * Returns FAIL if the unit is not in a fresh sample, in which case the caller
+ * serves the item live.
+ */
+int snapshot_get_unit(const char *unit, snapshot_unit *u)
+{
+  char          name[sizeof(u->name)];
+  zbx_uint64_t  clock = 0;
+  unsigned int  seq;
+  int           i, lo, hi, mid, cmp, found = 0;
+
+  if (NULL == segment || NULL == unit)
+    return FAIL;
+
+  zbx_snprintf(name, sizeof(name), "%s%s", unit, NULL == strchr(unit, '.') ? ".service" : "");
+
+  for (i = 0; i < SNAPSHOT_READ_ATTEMPTS; i++) {
+    seq = snapshot_read_begin();
+    clock = segment->clock;
+
+    // the bounds are checked as the count may be torn
+    for (found = 0, lo = 0, hi = MIN(segment->nunits, SNAPSHOT_UNITS_MAX); lo < hi; ) {
+      mid = lo + (hi - lo) / 2;
+      if (0 == (cmp = strncmp(name, segment->units[mid].name, sizeof(name)))) {
+        memcpy(u, &segment->units[mid], sizeof(snapshot_unit));
+        found = 1;
+        break;
+      }
+
+      if (0 > cmp)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    if (!snapshot_read_retry(seq))
+      break;
+  }
+
+  found = found && SNAPSHOT_READ_ATTEMPTS != i && snapshot_is_fresh(clock);
+  stats_record_cache(STATS_CACHE_SNAPSHOT, found);
+
+  return found ? SUCCEED : FAIL;
+}
+
+/*
+ * snapshot_list_units points the given pointer at a copy of all units of the
+ * latest sample, which is valid until the next call, and returns their number.
+ *
+ * Returns -1 if there is no fresh sample or it does not hold all units, in
+ * which case the caller serves the item live.
+ */
+int snapshot_list_units(const snapshot_unit **units)
+{
+  zbx_uint64_t  clock = 0;
+  unsigned int  seq;
+  int           i, n = 0, listed = 0;
+
+  if (NULL == segment)
+    return -1;
+
+  for (i = 0; i < SNAPSHOT_READ_ATTEMPTS; i++) {
+    seq = snapshot_read_begin();
+    clock = segment->clock;
+    n = MIN(segment->nunits, SNAPSHOT_UNITS_MAX);
+    listed = segment->nlisted;
+
+    if (ncopy < n) {
+      copy = zbx_realloc(copy, sizeof(snapshot_unit) * n);
+      ncopy = n;
+    }
+
+    memcpy(copy, segment->units, sizeof(snapshot_unit) * n);
+
+    if (!snapshot_read_retry(seq))
+      break;
+  }
+
+  if (SNAPSHOT_READ_ATTEMPTS == i || !snapshot_is_fresh(clock) || listed > n) {
+    stats_record_cache(STATS_CACHE_SNAPSHOT, 0);
+    return -1;
+  }
+
+  stats_record_cache(STATS_CACHE_SNAPSHOT, 1);
+  *units = copy;
+
+  return n;
+}
+
+/*
+ * snapshot_stats_json appends the state of the sampler to the given json
+ * document, if it is enabled.
+ */
+void snapshot_stats_json(struct zbx_json *j)
+{
+  zbx_uint64_t  clock = 0, samples = 0, errors = 0, sample_us = 0;
+  unsigned int  seq;
+  pid_t         pid = 0;
+  int           i, nunits = 0, nlisted = 0;
+
+  if (NULL == segment)
+    return;
+
+  for (i = 0; i < SNAPSHOT_READ_ATTEMPTS; i++) {
+    seq = snapshot_read_begin();
+    pid = segment->pid;
+    clock = segment->clock;
+    samples = segment->samples;
+    errors = segment->errors;
+    sample_us = segment->sample_us;
+    nunits = segment->nunits;
+    nlisted = segment->nlisted;
+    if (!snapshot_read_retry(seq))
+      break;
+  }
+
+  zbx_json_addobject(j, "snapshot");
+  zbx_json_adduint64(j, "pid", pid);
+  zbx_json_adduint64(j, "interval", snapshot_interval);
+  zbx_json_adduint64(j, "samples", samples);
+  zbx_json_adduint64(j, "errors", errors);
+  zbx_json_adduint64(j, "units", nunits);
+  zbx_json_adduint64(j, "listed", nlisted);
+  zbx_json_adduint64(j, "sample_us", sample_us);
+  zbx_json_adduint64(j, "age_ms", 0 == clock ? 0 : (stats_clock_us() - clock) / 1000);
+  zbx_json_close(j);
+}
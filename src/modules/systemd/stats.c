@@ -0,0 +1,265 @@
+#include "libzbxsystemd.h"
+
+/*
+ * Module instrumentation.
+ *
+ * Zabbix agent serves items from forked processes which share nothing, so all
+ * counters are plain variables of the current process and need no locking.
+ * systemd.module.stats reports the counters of the process that serves it.
+ */
+
+// latency histogram buckets. Bucket i counts latencies below 2^i microseconds
+// and the last bucket counts all longer latencies.
+#define STATS_BUCKETS       25
+
+#define STATS_ITEMS_MAX     64
+#define STATS_METHODS_MAX   32
+
+typedef struct {
+  zbx_uint64_t  count;
+  zbx_uint64_t  errors;
+  zbx_uint64_t  sum_us;
+  zbx_uint64_t  max_us;
+  zbx_uint64_t  buckets[STATS_BUCKETS];
+} stats_histogram;
+
+// an item key and the handler it is served by
+typedef struct {
+  const char      *key;
+  int             (*handler)(AGENT_REQUEST*, AGENT_RESULT*);
+  stats_histogram latency;
+} stats_item;
+
+// a D-Bus method
+typedef struct {
+  char            *member;
+  stats_histogram latency;
+} stats_method_calls;
+
+static stats_item         items[STATS_ITEMS_MAX];
+static int                nitems = 0;
+
+static stats_method_calls methods[STATS_METHODS_MAX];
+static int                nmethods = 0;
+
+static stats_histogram    cgroup_reads;
+static zbx_uint64_t       cgroup_bytes = 0;
+
+static zbx_uint64_t       cache_hits[STATS_CACHE_COUNT];
+static zbx_uint64_t       cache_misses[STATS_CACHE_COUNT];
+static const char         *cache_names[STATS_CACHE_COUNT] = {
+  "unit_path", "property", "discovery", "snapshot"
+};
+
+/*
+ * stats_clock_us returns the current time of the monotonic clock in
+ * microseconds.
+ */
+zbx_uint64_t stats_clock_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zbx_uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * stats_record adds a sample, which started at the given time, to the given
+ * histogram.
+ */
+static void stats_record(stats_histogram *h, zbx_uint64_t start_us, int error)
+{
+  zbx_uint64_t  elapsed = stats_clock_us() - start_us;
+  int           i = 0;
+
+  while (i < STATS_BUCKETS - 1 && ((zbx_uint64_t) 1 << i) <= elapsed)
+    i++;
+
+  h->count++;
+  h->buckets[i]++;
+  h->sum_us += elapsed;
+  if (elapsed > h->max_us)
+    h->max_us = elapsed;
+  if (error)
+    h->errors++;
+}
+
+/*
+ * stats_item_handler serves all item keys of the module. It calls the handler
+ * of the requested key within the deadline of the request and records its
+ * latency.
+ */
+static int stats_item_handler(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  zbx_uint64_t  start = stats_clock_us();
+  int           i, res;
+
+  for (i = 0; i < nitems; i++)
+    if (0 == strcmp(request->key, items[i].key))
+      break;
+
+  if (i == nitems) {
+    SET_MSG_RESULT(result, strdup("Unsupported item key."));
+    return SYSINFO_RET_FAIL;
+  }
+
+  dbus_start_deadline();
+  res = items[i].handler(request, result);
+  dbus_end_deadline();
+  stats_record(&items[i].latency, start, SYSINFO_RET_OK != res);
+
+  return res;
+}
+
+/*
+ * stats_wrap_items replaces the handlers of the given item list, which must be
+ * terminated by a NULL key, with a handler that records their latency. Only
+ * the first call has any effect.
+ */
+void stats_wrap_items(ZBX_METRIC *keys)
+{
+  if (0 != nitems)
+    return;
+
+  for (; keys->key && nitems < STATS_ITEMS_MAX; keys++, nitems++) {
+    items[nitems].key = keys->key;
+    items[nitems].handler = keys->function;
+    keys->function = stats_item_handler;
+  }
+}
+
+/*
+ * stats_method returns the index of the given D-Bus method member name, for
+ * use with stats_record_method, or -1 if too many methods are known.
+ */
+int stats_method(const char *member)
+{
+  int i;
+
+  if (NULL == member)
+    return -1;
+
+  for (i = 0; i < nmethods; i++)
+    if (0 == strcmp(member, methods[i].member))
+      return i;
+
+  if (STATS_METHODS_MAX == nmethods)
+    return -1;
+
+  methods[nmethods].member = zbx_strdup(NULL, member);
+  return nmethods++;
+}
+
+/*
+ * stats_record_method records a D-Bus call of the given method index, which
+ * started at the given time.
+ */
+void stats_record_method(int method, zbx_uint64_t start_us, int error)
+{
+  if (0 <= method)
+    stats_record(&methods[method].latency, start_us, error);
+}
+
+/*
+ * stats_record_cgroup records a read of a cgroup file of the given size, which
+ * started at the given time.
+ */
+void stats_record_cgroup(zbx_uint64_t start_us, size_t bytes, int error)
+{
+  stats_record(&cgroup_reads, start_us, error);
+  cgroup_bytes += bytes;
+}
+
+/*
+ * stats_record_cache records a hit or miss of the given cache.
+ */
+void stats_record_cache(stats_cache cache, int hit)
+{
+  if (hit)
+    cache_hits[cache]++;
+  else
+    cache_misses[cache]++;
+}
+
+/*
+ * stats_histogram_json appends the given histogram to the given json document
+ * as an object of the given name. Empty buckets are omitted and the remaining
+ * buckets are named by their upper bound in microseconds.
+ */
+static void stats_histogram_json(struct zbx_json *j, const char *name, const stats_histogram *h)
+{
+  char buf[32];
+  int  i;
+
+  zbx_json_addobject(j, name);
+  zbx_json_adduint64(j, "count", h->count);
+  zbx_json_adduint64(j, "errors", h->errors);
+  zbx_json_adduint64(j, "sum_us", h->sum_us);
+  zbx_json_adduint64(j, "max_us", h->max_us);
+
+  zbx_json_addobject(j, "buckets");
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (0 == h->buckets[i])
+      continue;
+
+    if (i < STATS_BUCKETS - 1)
+      zbx_snprintf(buf, sizeof(buf), ZBX_FS_UI64, (zbx_uint64_t) 1 << i);
+    else
+      zbx_strlcpy(buf, "inf", sizeof(buf));
+
+    zbx_json_adduint64(j, buf, h->buckets[i]);
+  }
+  zbx_json_close(j);
+
+  zbx_json_close(j);
+}
+
+// systemd.module.stats[]
+int SYSTEMD_MODULE_STATS(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+  struct zbx_json j;
+  zbx_uint64_t    total;
+  char            buf[32];
+  int             i;
+
+  zbx_json_init(&j, ZBX_JSON_STAT_BUF_LEN);
+  zbx_json_adduint64(&j, "pid", getpid());
+
+  zbx_json_addobject(&j, "items");
+  for (i = 0; i < nitems; i++)
+    if (0 != items[i].latency.count)
+      stats_histogram_json(&j, items[i].key, &items[i].latency);
+  zbx_json_close(&j);
+
+  zbx_json_addobject(&j, "dbus");
+  for (i = 0; i < nmethods; i++)
+    stats_histogram_json(&j, methods[i].member, &methods[i].latency);
+  zbx_json_close(&j);
+
+  zbx_json_addobject(&j, "cgroup");
+  zbx_json_adduint64(&j, "bytes", cgroup_bytes);
+  stats_histogram_json(&j, "reads", &cgroup_reads);
+  zbx_json_close(&j);
+
+  zbx_json_addobject(&j, "cache");
+  for (i = 0; i < STATS_CACHE_COUNT; i++) {
+    total = cache_hits[i] + cache_misses[i];
+    zbx_json_addobject(&j, cache_names[i]);
+    zbx_json_adduint64(&j, "hits", cache_hits[i]);
+    zbx_json_adduint64(&j, "misses", cache_misses[i]);
+    zbx_snprintf(buf, sizeof(buf), "%.3f", 0 == total ? 0.0 : (double) cache_hits[i] / total);
+    zbx_json_addstring(&j, "ratio", buf, ZBX_JSON_TYPE_INT);
+    zbx_json_close(&j);
+  }
+  zbx_json_close(&j);
+
+  snapshot_stats_json(&j);
+  dbus_connection_json(&j);
+  dbus_breaker_json(&j);
+
+  zbx_json_close(&j);
+  SET_STR_RESULT(result, strdup(j.buffer));
+  zbx_json_free(&j);
+
+  return SYSINFO_RET_OK;
+}
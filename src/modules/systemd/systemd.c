@@ -1,5 +1,7 @@
 #include "libzbxsystemd.h"
 
+#include <fnmatch.h>
+
 #ifndef ITEM_KEY_LEN
 #define ITEM_KEY_LEN        255
 #endif
@@ -7,11 +9,192 @@
 #define SERVICE_EXT         ".service"
 #define SERVICE_EXT_LEN     8
 
+// match rule for a signal of the systemd manager
+#define SYSTEMD_MANAGER_SIGNAL(member) \
+  "type='signal',sender='" SYSTEMD_SERVICE_NAME "'," \
+  "path='" SYSTEMD_ROOT_NODE "',interface='" SYSTEMD_MANAGER_INTERFACE "'," \
+  "member='" member "'"
+
+// subscription state: 0 not yet subscribed, 1 subscribed, -1 refused by
+// systemd
+static int subscribed = 0;
+
+// number of match rules added and non-zero if systemd_signal_filter was added
+// to the current connection, while not yet subscribed
+static int matched = 0, filtered = 0;
+
+// unit name to object path cache, only used while subscribed
+static Map *unit_paths = NULL;
+
+// number of times the set of units or unit files changed, while subscribed
+static zbx_uint64_t generation = 0;
+
+/*
+ * systemd_unit_has_path returns non-zero if the given cached object path
+ * equals the given path. Used to forget all aliases of a unit.
+ */
+static int systemd_unit_has_path(const char *key, void *value, void *path)
+{
+  return 0 == strcmp((const char*) value, (const char*) path);
+}
+
+/*
+ * systemd_signal_filter invalidates cached unit data when systemd announces
+ * that units were loaded, unloaded or are about to be reloaded, or that unit
+ * files changed.
+ */
+static DBusHandlerResult systemd_signal_filter(
+  DBusConnection  *c,
+  DBusMessage     *msg,
+  void            *data
+) {
+  const char *id = NULL, *path = NULL;
+
+  if (DBUS_MESSAGE_TYPE_SIGNAL != dbus_message_get_type(msg))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "UnitNew") ||
+      dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "UnitRemoved")) {
+    generation++;
+    if (dbus_message_get_args(msg, NULL,
+                              DBUS_TYPE_STRING, &id,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_INVALID)) {
+      zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "%s: %s", dbus_message_get_member(msg), id);
+      map_delete(unit_paths, id);
+      map_delete_if(unit_paths, systemd_unit_has_path, (void*) path);
+    }
+  } else if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "Reloading")) {
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "systemd is reloading");
+    generation++;
+    map_reset(unit_paths);
+  } else if (dbus_message_is_signal(msg, SYSTEMD_MANAGER_INTERFACE, "UnitFilesChanged")) {
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "unit files changed");
+    generation++;
+  }
+
+  // other filters may be interested too
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/*
+ * systemd_subscribe asks systemd to emit unit signals to this connection, so
+ * that cached unit data can be invalidated. Once subscribed, or once systemd
+ * refused with an error reply, the bus is not contacted again. Calls that
+ * timed out or failed otherwise are tried again by the next call.
+ *
+ * Returns FAIL if signals are not available, in which case nothing should be
+ * cached.
+ */
+int systemd_subscribe()
+{
+  DBusMessage *msg = NULL;
+  DBusError   err;
+  const char  *rules[] = {
+    SYSTEMD_MANAGER_SIGNAL("UnitNew"),
+    SYSTEMD_MANAGER_SIGNAL("UnitRemoved"),
+    SYSTEMD_MANAGER_SIGNAL("Reloading"),
+    SYSTEMD_MANAGER_SIGNAL("UnitFilesChanged"),
+    NULL
+  };
+
+  if (0 != subscribed)
+    return 1 == subscribed ? SUCCEED : FAIL;
+
+  // signals are only read on a connection of this process
+  if (!dbus_is_owned())
+    return FAIL;
+
+  for (; rules[matched]; matched++)
+    if (FAIL == dbus_add_signal_match(rules[matched]))
+      return FAIL;
+
+  if (!filtered) {
+    if (!dbus_connection_add_filter(conn, systemd_signal_filter, NULL, NULL)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom adding signal filter");
+      return FAIL;
+    }
+    filtered = 1;
+  }
+
+  // systemd only emits unit signals while at least one client is subscribed
+  msg = dbus_message_new_method_call(
+    SYSTEMD_SERVICE_NAME,
+    SYSTEMD_ROOT_NODE,
+    SYSTEMD_MANAGER_INTERFACE,
+    "Subscribe");
+
+  dbus_error_init(&err);
+  if (NULL == (msg = dbus_exchange_message_err(msg, &err))) {
+    if (dbus_error_is_set(&err)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "%s: %s", err.name, err.message);
+      if (dbus_error_is_reply(&err))
+        subscribed = -1;
+      dbus_error_free(&err);
+    }
+    return FAIL;
+  }
+
+  dbus_message_unref(msg);
+
+  if (NULL == (unit_paths = map_create(free)))
+    return FAIL;
+
+  zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "subscribed to systemd signals");
+  subscribed = 1;
+
+  return SUCCEED;
+}
+
+/*
+ * systemd_reset forgets the subscription and all cached unit paths after the
+ * connection was replaced. The generation is advanced, so that data derived
+ * from the unit list is not reused either.
+ */
+void systemd_reset()
+{
+  if (NULL != unit_paths) {
+    map_free(unit_paths);
+    unit_paths = NULL;
+  }
+
+  subscribed = 0;
+  matched = 0;
+  filtered = 0;
+  generation++;
+}
+
+/*
+ * systemd_get_generation fills the given counter with the number of times
+ * systemd signalled a change of the set of units or unit files, after applying
+ * all pending signals. Data derived from the unit list may be reused for as
+ * long as the generation is unchanged.
+ *
+ * Returns FAIL if changes cannot be tracked.
+ */
+int systemd_get_generation(zbx_uint64_t *gen)
+{
+  if (!dbus_is_owned() || FAIL == systemd_subscribe())
+    return FAIL;
+
+  // signals may have been missed if the bus hung up meanwhile
+  dbus_dispatch_signals();
+  if (!dbus_is_owned())
+    return FAIL;
+
+  *gen = generation;
+
+  return SUCCEED;
+}
+
 /*
  * systemd_get_unit fills the given buffer with the Object Path of the given
  * unit name (e.g. sshd.service).
  *
  * If no unit extension is given, .service is appended on behalf of the caller.
+ *
+ * Resolved paths are cached until systemd signals that the unit was unloaded
+ * or that the manager is reloading.
  * 
  * Returns FAIL on error.
  */
@@ -35,6 +218,17 @@ int systemd_get_unit(char *s, size_t n, const char* unit)
   }
   c = &buf[0];
 
+  // check the cache, after applying any pending invalidations
+  if (SUCCEED == systemd_subscribe()) {
+    dbus_dispatch_signals();
+    if (NULL != (val = map_get(unit_paths, buf))) {
+      stats_record_cache(STATS_CACHE_UNIT_PATH, 1);
+      zbx_strlcpy(s, val, n);
+      return SUCCEED;
+    }
+    stats_record_cache(STATS_CACHE_UNIT_PATH, 0);
+  }
+
   // create method call
   msg = dbus_message_new_method_call(
     SYSTEMD_SERVICE_NAME,
@@ -49,7 +243,6 @@ int systemd_get_unit(char *s, size_t n, const char* unit)
   }
 
   if (NULL == (msg = dbus_exchange_message(msg))){
-    dbus_message_unref(msg);
     return FAIL;
   }
 
@@ -68,40 +261,275 @@ int systemd_get_unit(char *s, size_t n, const char* unit)
   
   dbus_message_iter_get_basic(&args, &val);
   zbx_strlcpy(s, val, n); // WARNING: object paths are unlimited
+
+  if (1 == subscribed)
+    map_set(unit_paths, buf, strdup(val));
+
   dbus_message_unref(msg);
 
   return SUCCEED;
 }
 
+/*
+ * systemd_parse_units decodes the a(ssssssouso) array in the given ListUnits
+ * reply into a new array of units and returns its length or -1 on error.
+ *
+ * Strings in the returned array point into the given message and are only
+ * valid until the message is unref'd. It is the callers responsibility to free
+ * the returned array.
+ */
+int systemd_parse_units(DBusMessage *msg, systemd_unit **units)
+{
+  DBusMessageIter args, arr, unit;
+  const char      *fields[7];
+  int             i = 0, n = 0, size = 0;
+
+  *units = NULL;
+
+  if (!dbus_message_iter_init(msg, &args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "no value returned");
+    return -1;
+  }
+  
+  if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&args)) {
+    zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "returned value is not an array");
+    return -1;
+  }
+
+  // loop through returned units
+  dbus_message_iter_recurse(&args, &arr);
+  while (DBUS_TYPE_STRUCT == dbus_message_iter_get_arg_type(&arr)) {
+    dbus_message_iter_recurse(&arr, &unit);
+
+    // read the leading (ssssssso) values
+    for (i = 0; i < 7; i++) {
+      fields[i] = NULL;
+      switch (dbus_message_iter_get_arg_type(&unit)) {
+      case DBUS_TYPE_STRING:
+      case DBUS_TYPE_OBJECT_PATH:
+        dbus_message_iter_get_basic(&unit, &fields[i]);
+      }
+      dbus_message_iter_next(&unit);
+    }
+
+    if (NULL == fields[0] || NULL == fields[6]) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "unexpected value type");
+      goto next_unit;
+    }
+
+    if (n == size) {
+      size = MAX(64, size * 2);
+      *units = zbx_realloc(*units, size * sizeof(systemd_unit));
+    }
+
+    (*units)[n].name = fields[0];
+    (*units)[n].description = fields[1];
+    (*units)[n].load_state = fields[2];
+    (*units)[n].active_state = fields[3];
+    (*units)[n].sub_state = fields[4];
+    (*units)[n].following = fields[5];
+    (*units)[n].path = fields[6];
+    n++;
+
+next_unit:
+    dbus_message_iter_next(&arr);
+  }
+
+  return n;
+}
+
+// most capable unit listing method known to be supported by systemd:
+// 2 ListUnitsByPatterns (v230), 1 ListUnitsFiltered (v227), 0 ListUnits
+static int list_units_method = 2;
+
+/*
+ * systemd_append_strings appends the given NULL terminated list of strings to
+ * the given message arguments as an array of strings (as).
+ */
+static int systemd_append_strings(DBusMessageIter *args, const char **list)
+{
+  DBusMessageIter arr;
+
+  if (!dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &arr))
+    return FAIL;
+
+  for (; list && *list; list++) {
+    if (!dbus_message_iter_append_basic(&arr, DBUS_TYPE_STRING, list)) {
+      dbus_message_iter_abandon_container(args, &arr);
+      return FAIL;
+    }
+  }
+
+  if (!dbus_message_iter_close_container(args, &arr))
+    return FAIL;
+
+  return SUCCEED;
+}
+
+/*
+ * systemd_unit_matches returns non-zero if the given unit has the given type,
+ * matches any of the given glob patterns and is in any of the given states.
+ * Missing or empty criteria match all units.
+ *
+ * As with ListUnitsFiltered, a state may be a load, active or sub state.
+ */
+static int systemd_unit_matches(
+  const systemd_unit  *unit,
+  const char          *type,
+  const char          **patterns,
+  const char          **states
+) {
+  int i;
+
+  if (NULL != type && !systemd_cmptype(unit->name, type))
+    return 0;
+
+  if (NULL != patterns && NULL != patterns[0]) {
+    for (i = 0; patterns[i]; i++)
+      if (0 == fnmatch(patterns[i], unit->name, FNM_NOESCAPE))
+        break;
+
+    if (NULL == patterns[i])
+      return 0;
+  }
+
+  if (NULL != states && NULL != states[0]) {
+    for (i = 0; states[i]; i++)
+      if (0 == strcmp(states[i], unit->load_state) ||
+          0 == strcmp(states[i], unit->active_state) ||
+          0 == strcmp(states[i], unit->sub_state))
+        break;
+
+    if (NULL == states[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * systemd_list_units lists the units which have the given type (e.g. service),
+ * match any of the given NULL terminated list of glob patterns and are in any
+ * of the given NULL terminated list of states. Each criteria may be NULL to
+ * match all units.
+ *
+ * Filtering is done by systemd with ListUnitsByPatterns or ListUnitsFiltered
+ * where available, so that units which are not of interest are never sent over
+ * the bus. Older versions of systemd fall back to ListUnits.
+ *
+ * The units are returned in a new array, as with systemd_parse_units, which
+ * points into the returned reply. It is the callers responsibility to free the
+ * array and unref the reply.
+ *
+ * Returns the number of units or -1 on error.
+ */
+int systemd_list_units(
+  DBusMessage   **reply,
+  systemd_unit  **units,
+  const char    *type,
+  const char    **patterns,
+  const char    **states
+) {
+  DBusMessage     *msg = NULL;
+  DBusMessageIter args;
+  DBusError       err;
+  const char      *methods[] = { "ListUnits", "ListUnitsFiltered", "ListUnitsByPatterns" };
+  const char      *type_patterns[2] = { NULL, NULL };
+  char            buf[ITEM_KEY_LEN+1];
+  int             i = 0, m = 0, n = 0;
+
+  *reply = NULL;
+  *units = NULL;
+
+  // systemd matches unit types with a pattern, unless other patterns are given
+  if (NULL != type && (NULL == patterns || NULL == patterns[0])) {
+    zbx_snprintf(buf, sizeof(buf), "*.%s", type);
+    type_patterns[0] = buf;
+    patterns = type_patterns;
+  }
+
+  while (NULL == *reply) {
+    msg = dbus_message_new_method_call(
+      SYSTEMD_SERVICE_NAME,
+      SYSTEMD_ROOT_NODE,
+      SYSTEMD_MANAGER_INTERFACE,
+      methods[list_units_method]);
+
+    if (NULL == msg)
+      return -1;
+
+    dbus_message_iter_init_append(msg, &args);
+    if ((1 <= list_units_method && FAIL == systemd_append_strings(&args, states)) ||
+        (2 == list_units_method && FAIL == systemd_append_strings(&args, patterns))) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "oom appending arguments");
+      dbus_message_unref(msg);
+      return -1;
+    }
+
+    dbus_error_init(&err);
+    if (NULL != (*reply = dbus_exchange_message_err(msg, &err)))
+      break;
+
+    if (!dbus_error_is_set(&err))
+      return -1;
+
+    if (0 == list_units_method || !dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_METHOD)) {
+      zabbix_log(LOG_LEVEL_ERR, LOG_PREFIX "%s: %s", err.name, err.message);
+      dbus_error_free(&err);
+      return -1;
+    }
+
+    zabbix_log(LOG_LEVEL_DEBUG, LOG_PREFIX "%s is not supported, falling back to %s",
+      methods[list_units_method], methods[list_units_method - 1]);
+    dbus_error_free(&err);
+    list_units_method--;
+  }
+
+  if (-1 == (n = systemd_parse_units(*reply, units))) {
+    dbus_message_unref(*reply);
+    *reply = NULL;
+    return -1;
+  }
+
+  // apply criteria not handled by systemd, keeping the listed order
+  for (i = 0, m = 0; i < n; i++)
+    if (systemd_unit_matches(&(*units)[i], type, patterns, states))
+      (*units)[m++] = (*units)[i];
+
+  return m;
+}
+
 /*
  * systemd_get_service_path fills the given buffer with the first segment of the
  * Service.ExecStart value for the given service object
  */
 int systemd_get_service_path(char *s, size_t n, const char *path)
 {
-  DBusMessageIter *val;
+  dbus_property   prop;
   DBusMessageIter arr, obj;
-  char *v = NULL;
+  char            *v = NULL;
 
-  val = dbus_get_property(
+  if (FAIL == dbus_get_property(
+                      &prop,
                       SYSTEMD_SERVICE_NAME,
                       path,
                       SYSTEMD_SERVICE_INTERFACE,
-                      "ExecStart");
-  
-  if (NULL == val)
+                      "ExecStart"))
     return FAIL;
 
-  // type: a(sasbttuii)
-  dbus_message_iter_recurse(val, &arr);   // -> array
-  dbus_message_iter_recurse(&arr, &obj);  // -> struct
-  dbus_message_iter_get_basic(&obj, &v);  // string
+  // type: a(sasbttuii). Services without ExecStart have an empty array.
+  dbus_message_iter_recurse(&prop.value, &arr);   // -> array
+  if (DBUS_TYPE_STRUCT == dbus_message_iter_get_arg_type(&arr)) {
+    dbus_message_iter_recurse(&arr, &obj);        // -> struct
+    dbus_message_iter_get_basic(&obj, &v);        // string
+  }
 
-  if (NULL == v)
-    return FAIL;
+  if (NULL != v)
+    zbx_strlcpy(s, v, n);
 
-  zbx_strlcpy(s, v, n);
-  return SUCCEED;
+  dbus_property_release(&prop);
+
+  return NULL == v ? FAIL : SUCCEED;
 }
 
 /*
@@ -110,13 +538,11 @@ int systemd_get_service_path(char *s, size_t n, const char *path)
  */
 int systemd_cmptype(const char *unit, const char *type)
 {
-  const char *c;
-  for (c = unit; ; c++) {
-    if ('\0' == *c)
-      return 0;
-    if ('.' == *c)
-      break;
-  }
+  // unit names may contain dots (e.g. org.cups.cupsd.service) but unit types
+  // may not
+  const char *c = strrchr(unit, '.');
+  if (NULL == c)
+    return 0;
 
   return (0 == strcmp(++c, type));
 }
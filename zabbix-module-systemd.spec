@@ -39,6 +39,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %{_libdir}/zabbix/modules/%{module}.so
 %{_sysconfdir}/zabbix/zabbix_agentd.d/%{module}.conf
+%{_sysconfdir}/zabbix/zabbix_module_systemd.conf
 %{_datarootdir}/selinux/packages/%{name}/%{module}.pp
 %{_docdir}/%{name}-%{version}/README.md
 %{_docdir}/%{name}-%{version}/COPYING